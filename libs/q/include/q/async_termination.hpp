@@ -61,7 +61,7 @@ public:
 
 protected:
 	async_termination( )
-	: deferred_termination_( ::q::make_shared< defer_type >( ) )
+	: deferred_termination_( defer_type::construct( ) )
 	{ }
 	async_termination( const async_termination& ) = delete;
 	async_termination( async_termination&& ) = delete;
@@ -97,8 +97,7 @@ private:
 	template< typename, typename >
 	friend class async_termination_interface;
 
-	// TODO: Convert to safe_shared_ptr
-	std::shared_ptr< defer_type > deferred_termination_;
+	typename defer_type::pointer_type deferred_termination_;
 };
 
 template< typename... Args, typename Completion >
@@ -0,0 +1,508 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_BROADCAST_CHANNEL_HPP
+#define LIBQ_BROADCAST_CHANNEL_HPP
+
+#include <q/channel.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace q {
+
+/**
+ * What a broadcast_channel does when a subscriber lags a full ring behind.
+ */
+enum class broadcast_lag
+{
+	/**
+	 * The oldest message is overwritten, and the subscriber skips it.
+	 */
+	drop,
+
+	/**
+	 * Senders are parked until the slowest subscriber has read the oldest
+	 * message.
+	 */
+	block
+};
+
+/**
+ * A channel where every message is received by every subscriber.
+ *
+ * Messages are stored once, as immutable reference counted tuples in a ring
+ * of @c capacity messages, and each subscriber reads them through its own
+ * cursor into the ring. A message is therefore never copied, regardless of
+ * the number of subscribers, and is received as a
+ * std::shared_ptr< const std::tuple< T... > >.
+ *
+ * A subscriber only receives messages sent after it subscribed. The ring
+ * retains the last @c capacity messages even once all subscribers have
+ * read them.
+ */
+template< typename... T >
+class broadcast_channel
+{
+	struct shared;
+
+public:
+	typedef std::tuple< T... >                    tuple_type;
+	typedef std::shared_ptr< const tuple_type >   message_type;
+	typedef detail::defer< message_type >         defer_type;
+
+	class subscriber
+	{
+	public:
+		~subscriber( )
+		{
+			shared_->unsubscribe( this );
+		}
+
+		subscriber( const subscriber& ) = delete;
+		subscriber& operator=( const subscriber& ) = delete;
+
+		/**
+		 * Receives the next message if there is one.
+		 *
+		 * @returns whether a message was received into @c message.
+		 */
+		bool try_receive( message_type& message )
+		{
+			return shared_->try_receive( this, message );
+		}
+
+		/**
+		 * Receives the next message, or waits for one. The returned
+		 * promise is rejected with a channel_closed_exception once the
+		 * channel is closed and all messages are read.
+		 */
+		promise< std::tuple< message_type > > receive( )
+		{
+			return shared_->receive( this );
+		}
+
+		/**
+		 * @returns the number of messages this subscriber has skipped,
+		 * as it lagged behind a broadcast_lag::drop channel.
+		 */
+		std::size_t dropped( ) const
+		{
+			return shared_->dropped( this );
+		}
+
+	private:
+		friend struct shared;
+
+		subscriber( std::shared_ptr< shared > shared, std::uint64_t cursor )
+		: shared_( std::move( shared ) )
+		, cursor_( cursor )
+		, dropped_( 0 )
+		{ }
+
+		std::shared_ptr< shared > shared_;
+		std::uint64_t cursor_;
+		std::size_t dropped_;
+		std::queue< typename defer_type::pointer_type > waiters_;
+	};
+
+	typedef std::shared_ptr< subscriber > subscriber_ptr;
+
+	/**
+	 * @param capacity the number of messages in the ring, at least 1.
+	 */
+	explicit broadcast_channel(
+		std::size_t capacity, broadcast_lag lag = broadcast_lag::drop )
+	: shared_( std::make_shared< shared >(
+		std::max< std::size_t >( capacity, 1 ), lag ) )
+	{ }
+
+	broadcast_channel( const broadcast_channel& ) = delete;
+	broadcast_channel& operator=( const broadcast_channel& ) = delete;
+
+	subscriber_ptr subscribe( )
+	{
+		return shared_->subscribe( shared_ );
+	}
+
+	/**
+	 * Closes the channel. Subscribers can still read the messages they
+	 * haven't read, but parked senders are rejected with a
+	 * channel_closed_exception, as their messages are never sent.
+	 */
+	void close( )
+	{
+		shared_->close( );
+	}
+
+	std::size_t capacity( ) const
+	{
+		return shared_->ring_.size( );
+	}
+
+	promise< std::tuple< > > send( T&&... t )
+	{
+		return shared_->send(
+			std::make_shared< const tuple_type >( std::move( t )... ) );
+	}
+
+	promise< std::tuple< > > send( const T&... t )
+	{
+		return shared_->send(
+			std::make_shared< const tuple_type >( t... ) );
+	}
+
+	/**
+	 * Sends a message to all current subscribers, or parks it if the
+	 * channel blocks on a lagging subscriber.
+	 *
+	 * @returns a promise resolved once the message is in the channel.
+	 */
+	promise< std::tuple< > > send( tuple_type&& t )
+	{
+		return shared_->send(
+			std::make_shared< const tuple_type >( std::move( t ) ) );
+	}
+
+	bool try_send( T&&... t )
+	{
+		return shared_->try_send(
+			std::make_shared< const tuple_type >( std::move( t )... ) );
+	}
+
+	bool try_send( const T&... t )
+	{
+		return shared_->try_send(
+			std::make_shared< const tuple_type >( t... ) );
+	}
+
+	/**
+	 * Sends a message unless the channel blocks on a lagging subscriber.
+	 *
+	 * @returns whether the message was sent.
+	 */
+	bool try_send( tuple_type&& t )
+	{
+		return shared_->try_send(
+			std::make_shared< const tuple_type >( std::move( t ) ) );
+	}
+
+private:
+	/**
+	 * The ring and the subscribers, shared by the channel and the
+	 * subscribers, as either can outlive the other.
+	 */
+	struct shared
+	{
+		/**
+		 * Waiting subscribers and parked senders taken under the lock,
+		 * resolved once it's released, as they may run continuations.
+		 */
+		struct wakeups
+		{
+			std::vector< std::pair<
+				typename defer_type::pointer_type, message_type
+			> > receivers_;
+			std::vector< typename defer_type::pointer_type > rejected_;
+			std::vector< typename detail::defer< >::pointer_type > senders_;
+			std::vector< typename detail::defer< >::pointer_type >
+				rejected_senders_;
+
+			void resolve( )
+			{
+				for ( auto& receiver : receivers_ )
+					receiver.first->set_value( std::move( receiver.second ) );
+
+				for ( auto& receiver : rejected_ )
+					receiver->set_exception( std::make_exception_ptr(
+						channel_closed_exception( ) ) );
+
+				for ( auto& sender : senders_ )
+					sender->set_value( );
+
+				for ( auto& sender : rejected_senders_ )
+					sender->set_exception( std::make_exception_ptr(
+						channel_closed_exception( ) ) );
+			}
+		};
+
+		shared( std::size_t capacity, broadcast_lag lag )
+		: mutex_( Q_HERE, "broadcast_channel" )
+		, ring_( capacity )
+		, head_( 0 )
+		, lag_( lag )
+		, closed_( false )
+		{ }
+
+		subscriber_ptr subscribe( const std::shared_ptr< shared >& self )
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			subscriber_ptr ret( new subscriber( self, head_ ) );
+
+			subscribers_.push_back( ret.get( ) );
+
+			return ret;
+		}
+
+		void unsubscribe( subscriber* sub )
+		{
+			wakeups wakeups;
+
+			{
+				Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+				subscribers_.erase( std::find(
+					subscribers_.begin( ), subscribers_.end( ), sub ) );
+
+				// The slowest subscriber may have left
+				release_senders( wakeups );
+			}
+
+			wakeups.resolve( );
+		}
+
+		void close( )
+		{
+			wakeups wakeups;
+
+			{
+				Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+				closed_ = true;
+
+				// Subscribers only wait when they've read everything
+				for ( auto sub : subscribers_ )
+				{
+					for ( ; !sub->waiters_.empty( ); sub->waiters_.pop( ) )
+						wakeups.rejected_.push_back(
+							std::move( sub->waiters_.front( ) ) );
+				}
+
+				// Senders blocked on a lagging subscriber would never
+				// be published
+				for ( ; !senders_.empty( ); senders_.pop( ) )
+					wakeups.rejected_senders_.push_back(
+						std::move( senders_.front( ).defer_ ) );
+			}
+
+			wakeups.resolve( );
+		}
+
+		promise< std::tuple< > > send( message_type&& message )
+		{
+			wakeups wakeups;
+
+			{
+				Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+				if ( closed_ )
+					Q_THROW( channel_closed_exception( ) );
+
+				if ( !senders_.empty( ) || !publish( message, wakeups ) )
+				{
+					auto defer = detail::defer< >::construct( );
+
+					senders_.push(
+						parked_sender{ std::move( message ), defer } );
+
+					return defer->get_promise( );
+				}
+			}
+
+			wakeups.resolve( );
+
+			return with( );
+		}
+
+		bool try_send( message_type&& message )
+		{
+			wakeups wakeups;
+
+			{
+				Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+				if ( closed_ )
+					Q_THROW( channel_closed_exception( ) );
+
+				if ( !senders_.empty( ) || !publish( message, wakeups ) )
+					return false;
+			}
+
+			wakeups.resolve( );
+
+			return true;
+		}
+
+		bool try_receive( subscriber* sub, message_type& message )
+		{
+			wakeups wakeups;
+
+			{
+				Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+				if ( !next( sub, message ) )
+					return false;
+
+				release_senders( wakeups );
+			}
+
+			wakeups.resolve( );
+
+			return true;
+		}
+
+		promise< std::tuple< message_type > > receive( subscriber* sub )
+		{
+			wakeups wakeups;
+			message_type message;
+
+			{
+				Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+				if ( !sub->waiters_.empty( ) || !next( sub, message ) )
+				{
+					if ( closed_ )
+						return reject< arguments< message_type > >(
+							channel_closed_exception( ) );
+
+					auto defer = defer_type::construct( );
+
+					sub->waiters_.push( defer );
+
+					return defer->get_promise( );
+				}
+
+				release_senders( wakeups );
+			}
+
+			wakeups.resolve( );
+
+			return with( std::move( message ) );
+		}
+
+		std::size_t dropped( const subscriber* sub )
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			return sub->dropped_;
+		}
+
+		/**
+		 * Moves the cursor of @c sub to the next message, which is
+		 * returned in @c message. Must be called with the mutex locked.
+		 *
+		 * @returns whether there was a message.
+		 */
+		bool next( subscriber* sub, message_type& message )
+		{
+			const std::uint64_t capacity = ring_.size( );
+			const auto oldest = head_ > capacity ? head_ - capacity : 0;
+
+			if ( sub->cursor_ < oldest )
+			{
+				// Overwritten, only when dropping
+				sub->dropped_ += oldest - sub->cursor_;
+				sub->cursor_ = oldest;
+			}
+
+			if ( sub->cursor_ == head_ )
+				return false;
+
+			message = ring_[ sub->cursor_++ % capacity ];
+
+			return true;
+		}
+
+		/**
+		 * Puts @c message in the ring, and takes the subscribers waiting
+		 * for it into @c wakeups. Must be called with the mutex locked.
+		 *
+		 * @returns false if the channel blocks on a lagging subscriber, in
+		 * which case @c message is untouched.
+		 */
+		bool publish( message_type& message, wakeups& wakeups )
+		{
+			const std::uint64_t capacity = ring_.size( );
+
+			if ( lag_ == broadcast_lag::block )
+			{
+				for ( auto sub : subscribers_ )
+					if ( head_ - sub->cursor_ >= capacity )
+						return false;
+			}
+
+			ring_[ head_++ % capacity ] = std::move( message );
+
+			for ( auto sub : subscribers_ )
+			{
+				if ( sub->waiters_.empty( ) )
+					continue;
+
+				auto waiter = std::move( sub->waiters_.front( ) );
+				sub->waiters_.pop( );
+
+				message_type next_message;
+				next( sub, next_message );
+
+				wakeups.receivers_.emplace_back(
+					std::move( waiter ), std::move( next_message ) );
+			}
+
+			return true;
+		}
+
+		/**
+		 * Publishes parked messages as long as there is room, and takes
+		 * their senders into @c wakeups. Must be called with the mutex
+		 * locked.
+		 */
+		void release_senders( wakeups& wakeups )
+		{
+			while ( !senders_.empty( ) &&
+				publish( senders_.front( ).message_, wakeups ) )
+			{
+				wakeups.senders_.push_back(
+					std::move( senders_.front( ).defer_ ) );
+				senders_.pop( );
+			}
+		}
+
+		struct parked_sender
+		{
+			message_type message_;
+			typename detail::defer< >::pointer_type defer_;
+		};
+
+		mutex mutex_;
+		std::vector< message_type > ring_;
+		std::uint64_t head_;
+		const broadcast_lag lag_;
+		bool closed_;
+		std::vector< subscriber* > subscribers_;
+		std::queue< parked_sender > senders_;
+	};
+
+	std::shared_ptr< shared > shared_;
+};
+
+} // namespace q
+
+#endif // LIBQ_BROADCAST_CHANNEL_HPP
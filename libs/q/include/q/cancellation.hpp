@@ -0,0 +1,233 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_CANCELLATION_HPP
+#define LIBQ_CANCELLATION_HPP
+
+#include <q/mutex.hpp>
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <vector>
+
+namespace q {
+
+/**
+ * The exception the stages of a cancelled promise chain are rejected with.
+ *
+ * Unlike q::exception, it doesn't capture a stack trace, as cancellation is
+ * expected rather than exceptional. Use cancelled_exception_ptr( ) rather
+ * than throwing it, which doesn't allocate.
+ */
+class cancelled_exception
+: public std::exception
+{
+public:
+	const char* what( ) const noexcept override;
+};
+
+/**
+ * @returns a std::exception_ptr to a cancelled_exception, which is shared by
+ * all cancelled chains.
+ */
+const std::exception_ptr& cancelled_exception_ptr( );
+
+namespace detail {
+
+struct cancellation_access;
+
+/**
+ * Something a cancellable chain is waiting for, which is to be given up when
+ * the chain is cancelled.
+ */
+struct cancellation_hook
+{
+	virtual ~cancellation_hook( ) = default;
+
+	virtual void cancel( ) noexcept = 0;
+};
+
+class cancellation_state
+{
+public:
+	cancellation_state( )
+	: cancelled_( false )
+	, mutex_( Q_HERE, "cancellation state" )
+	{ }
+
+	bool is_cancelled( ) const noexcept
+	{
+		return cancelled_.load( std::memory_order_acquire );
+	}
+
+	/**
+	 * Makes cancel( ) call @c hook, unless it has expired by then. If this
+	 * is already cancelled, @c hook is called right away.
+	 */
+	void add_hook( const std::shared_ptr< cancellation_hook >& hook );
+
+	void cancel( ) noexcept;
+
+private:
+	std::atomic< bool > cancelled_;
+	mutex mutex_;
+	std::vector< std::weak_ptr< cancellation_hook > > hooks_;
+};
+
+} // namespace detail
+
+/**
+ * A token through which a promise chain can see whether it has been
+ * cancelled by its cancellation_source.
+ *
+ * A default constructed token is never cancelled.
+ */
+class cancellation_token
+{
+public:
+	cancellation_token( ) = default;
+
+	bool is_cancelled( ) const noexcept
+	{
+		return state_ && state_->is_cancelled( );
+	}
+
+	/**
+	 * @returns whether this token can be cancelled at all.
+	 */
+	explicit operator bool( ) const noexcept
+	{
+		return !!state_;
+	}
+
+private:
+	friend class cancellation_source;
+	friend struct detail::cancellation_access;
+
+	cancellation_token(
+		std::shared_ptr< detail::cancellation_state > state ) noexcept
+	: state_( std::move( state ) )
+	{ }
+
+	std::shared_ptr< detail::cancellation_state > state_;
+};
+
+/**
+ * Cancels the promise chains given its tokens, see
+ * generic_promise::with_cancellation( ).
+ *
+ * Cancellation is cooperative: the then( ) stages of a cancelled chain which
+ * haven't yet started are rejected with a cancelled_exception instead of
+ * being run, without being scheduled on their queues. fail( ) and
+ * finally( ) stages are still run, on their queues.
+ *
+ * cancel( ) rejects the promises a chain is waiting for from outside of it,
+ * i.e. the promise with_cancellation( ) was called on, and promises returned
+ * by its stages, so that the chain unwinds and frees its captured state
+ * right away, even if those would never be resolved. A stage which is
+ * running when the chain is cancelled is let to finish first.
+ */
+class cancellation_source
+{
+public:
+	cancellation_source( );
+
+	void cancel( ) noexcept;
+
+	bool is_cancelled( ) const noexcept;
+
+	cancellation_token token( ) const noexcept;
+
+private:
+	std::shared_ptr< detail::cancellation_state > state_;
+};
+
+namespace detail {
+
+struct cancellation_access
+{
+	static void add_hook(
+		const cancellation_token& token,
+		const std::shared_ptr< cancellation_hook >& hook )
+	{
+		if ( token.state_ )
+			token.state_->add_hook( hook );
+	}
+};
+
+/**
+ * Resolves a deferred either through its own set_*( ) functions, or with a
+ * cancelled_exception when the chain is cancelled, whichever comes first.
+ */
+template< typename Deferred >
+class cancellable_resolver
+: public cancellation_hook
+{
+public:
+	cancellable_resolver( Deferred deferred )
+	: deferred_( std::move( deferred ) )
+	, settled_( false )
+	{ }
+
+	template< typename Expect >
+	void set_expect( Expect&& value )
+	{
+		if ( claim( ) )
+			take( )->set_expect( std::forward< Expect >( value ) );
+	}
+
+	template< typename Tuple >
+	void set_value( Tuple&& value )
+	{
+		if ( claim( ) )
+			take( )->set_value( std::forward< Tuple >( value ) );
+	}
+
+	void set_exception( const std::exception_ptr& e )
+	{
+		if ( claim( ) )
+			take( )->set_exception( e );
+	}
+
+	void cancel( ) noexcept override
+	{
+		if ( claim( ) )
+			take( )->set_exception( cancelled_exception_ptr( ) );
+	}
+
+private:
+	bool claim( )
+	{
+		return !settled_.exchange( true, std::memory_order_acq_rel );
+	}
+
+	// Let go of the deferred once resolved, as the losing side may keep
+	// this alive for long
+	Deferred take( )
+	{
+		return std::move( deferred_ );
+	}
+
+	Deferred deferred_;
+	std::atomic< bool > settled_;
+};
+
+} // namespace detail
+
+} // namespace q
+
+#endif // LIBQ_CANCELLATION_HPP
@@ -20,101 +20,1193 @@
 #include <q/exception.hpp>
 #include <q/mutex.hpp>
 #include <q/promise.hpp>
+#include <q/detail/ring_buffer.hpp>
 
+#include <algorithm>
 #include <queue>
 #include <atomic>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <vector>
 
 namespace q {
 
 Q_MAKE_SIMPLE_EXCEPTION( channel_closed_exception );
+Q_MAKE_SIMPLE_EXCEPTION( channel_full_exception );
 
+namespace detail {
+
+/**
+ * The waiter shared by the channels of a select( ), which is claimed by the
+ * first of them to have a message for it.
+ */
+template< typename... T >
+struct select_state
+{
+	typedef defer< std::size_t, T... > defer_type;
+
+	select_state( )
+	: defer_( defer_type::construct( ) )
+	, claimed_( false )
+	{ }
+
+	/**
+	 * @returns whether this call claimed the select, in which case the
+	 * caller must resolve defer_.
+	 */
+	bool claim( )
+	{
+		return !claimed_.exchange( true, std::memory_order_acq_rel );
+	}
+
+	bool claimed( ) const
+	{
+		return claimed_.load( std::memory_order_acquire );
+	}
+
+	typename defer_type::pointer_type defer_;
+	std::atomic< bool > claimed_;
+};
+
+struct channel_access;
+
+} // namespace detail
+
+/**
+ * A channel of messages from senders to receivers, each received once.
+ *
+ * A channel is unbounded by default. A bounded channel holds at most
+ * @c capacity messages, beyond which senders are parked until a receiver
+ * makes room, which applies backpressure to producers which wait for the
+ * promise returned by async_send( ). A capacity of 0 makes every
+ * async_send( ) wait for a receiver. send( ) never waits, and doesn't
+ * allocate, but throws a channel_full_exception if a bounded channel is
+ * full, so it never grows a channel beyond its capacity.
+ *
+ * Messages can also be sent and received in batches, with send_many( ) and
+ * receive_many( ), which lock the channel once per batch rather than once
+ * per message.
+ */
 template< typename... T >
 class channel
 {
 public:
-	typedef std::tuple< T... >    tuple_type;
-	typedef detail::defer< T... > defer_type;
-	typedef arguments< T... >     arguments_type;
+	typedef std::tuple< T... >            tuple_type;
+	typedef detail::defer< T... >         defer_type;
+	typedef arguments< T... >             arguments_type;
+	typedef std::vector< tuple_type >     batch_type;
 
 	channel( /* q::location, name */ )
+	: channel( std::numeric_limits< std::size_t >::max( ) )
+	{ }
+
+	explicit channel( std::size_t capacity )
 	: mutex_( Q_HERE, "channel" )
+	, capacity_( capacity )
 	, closed_( false )
 	{ }
 
+	/**
+	 * Closes the channel. Messages already in it can still be received,
+	 * but waiting receivers (including selects) are rejected with a
+	 * channel_closed_exception, as no message will arrive for them.
+	 */
 	void close( )
 	{
-		Q_AUTO_UNIQUE_LOCK( mutex_ );
+		std::deque< waiter > waiters;
 
-		closed_.store( true, std::memory_order_seq_cst );
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			closed_.store( true, std::memory_order_seq_cst );
+
+			// There are only waiters when there are no messages
+			waiters.swap( waiters_ );
+
+			waiters.erase( std::remove_if(
+				waiters.begin( ), waiters.end( ),
+				[ ]( waiter& waiter )
+				{
+					return waiter.select_ &&
+						!waiter.select_->claim( );
+				} ),
+				waiters.end( ) );
+		}
+
+		// Rejected outside of the lock, as it may run continuations
+		auto closed = std::make_exception_ptr( channel_closed_exception( ) );
+
+		for ( auto& waiter : waiters )
+		{
+			if ( waiter.defer_ )
+				waiter.defer_->set_exception( closed );
+			else if ( waiter.batch_defer_ )
+				waiter.batch_defer_->set_exception( closed );
+			else
+			{
+				auto defer = std::move( waiter.select_->defer_ );
+				defer->set_exception( closed );
+			}
+		}
+	}
+
+	std::size_t capacity( ) const
+	{
+		return capacity_;
 	}
 
 	void send( T&&... t )
 	{
-		return send( std::make_tuple( std::move( t )... ) );
+		send( std::make_tuple( std::move( t )... ) );
 	}
 
 	void send( const T&... t )
 	{
-		return send( std::make_tuple( t... ) );
+		send( std::make_tuple( t... ) );
 	}
 
+	/**
+	 * Sends a message without waiting for room.
+	 *
+	 * @throws channel_full_exception if the channel is full, i.e. only if
+	 * it's bounded. Use async_send( ) or try_send( ) to handle backpressure.
+	 */
 	void send( tuple_type&& t )
 	{
-		Q_AUTO_UNIQUE_LOCK( mutex_ );
+		waiter receiver = waiter( );
 
-		if ( closed_.load( std::memory_order_seq_cst ) )
-			Q_THROW( channel_closed_exception( ) );
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			if ( closed_.load( std::memory_order_seq_cst ) )
+				Q_THROW( channel_closed_exception( ) );
+
+			if ( !offer( t, receiver ) )
+				Q_THROW( channel_full_exception( ) );
+		}
+
+		if ( receiver )
+			deliver( receiver, t );
+	}
+
+	promise< std::tuple< > > async_send( T&&... t )
+	{
+		return async_send( std::make_tuple( std::move( t )... ) );
+	}
+
+	promise< std::tuple< > > async_send( const T&... t )
+	{
+		return async_send( std::make_tuple( t... ) );
+	}
+
+	/**
+	 * Sends a message, or parks it if the channel is full.
+	 *
+	 * @returns a promise resolved once the message is in the channel (or
+	 * handed to a receiver), i.e. when another message can be sent without
+	 * growing the channel beyond its capacity.
+	 */
+	promise< std::tuple< > > async_send( tuple_type&& t )
+	{
+		waiter receiver = waiter( );
 
-		if ( waiters_.empty( ) )
 		{
-			queue_.push( std::move( t ) );
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			if ( closed_.load( std::memory_order_seq_cst ) )
+				Q_THROW( channel_closed_exception( ) );
+
+			if ( !offer( t, receiver ) )
+			{
+				auto defer = detail::defer< >::construct( );
+
+				senders_.push( parked_sender{ std::move( t ), defer } );
+
+				return defer->get_promise( );
+			}
 		}
-		else
+
+		if ( receiver )
+			deliver( receiver, t );
+
+		return with( );
+	}
+
+	bool try_send( T&&... t )
+	{
+		return try_send( std::make_tuple( std::move( t )... ) );
+	}
+
+	bool try_send( const T&... t )
+	{
+		return try_send( std::make_tuple( t... ) );
+	}
+
+	/**
+	 * Sends a message unless the channel is full.
+	 *
+	 * @returns whether the message was sent.
+	 */
+	bool try_send( tuple_type&& t )
+	{
+		waiter receiver = waiter( );
+
 		{
-			auto waiter = std::move( waiters_.front( ) );
-			waiters_.pop( );
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			if ( closed_.load( std::memory_order_seq_cst ) )
+				Q_THROW( channel_closed_exception( ) );
 
-			waiter->set_value( std::move( t ) );
+			if ( !offer( t, receiver ) )
+				return false;
 		}
+
+		if ( receiver )
+			deliver( receiver, t );
+
+		return true;
+	}
+
+	/**
+	 * Sends all messages in @c messages (tuples, or values convertible to
+	 * tuple_type), which are moved from if @c messages is an rvalue. As
+	 * many as there is room for are put in the channel (or handed to
+	 * waiting receivers), and the rest are parked.
+	 *
+	 * @returns a promise resolved once all messages are in the channel.
+	 */
+	template< typename Range >
+	promise< std::tuple< > > send_many( Range&& messages )
+	{
+		return send_many(
+			std::begin( messages ), std::end( messages ),
+			std::is_lvalue_reference< Range >( ) );
+	}
+
+	/**
+	 * Receives a message if there is one, without allocating.
+	 *
+	 * @returns whether a message was received into @c t.
+	 */
+	bool try_receive( tuple_type& t )
+	{
+		typename detail::defer< >::pointer_type sender;
+
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			if ( !take_one( [ &t ]( tuple_type&& message )
+			{
+				t = std::move( message );
+			}, sender ) )
+				return false;
+		}
+
+		if ( sender )
+			sender->set_value( );
+
+		return true;
 	}
 
 	promise< tuple_type > receive( )
+	{
+		typename detail::defer< >::pointer_type sender;
+		promise< tuple_type > ret = receive( sender );
+
+		// Resolved outside of the lock, as it may run continuations
+		if ( sender )
+			sender->set_value( );
+
+		return ret;
+	}
+
+	/**
+	 * Receives up to @c max_n messages, i.e. all which are available, or
+	 * waits for at least one if there are none.
+	 */
+	promise< std::tuple< batch_type > > receive_many( std::size_t max_n )
+	{
+		std::vector< typename detail::defer< >::pointer_type > senders;
+		batch_type batch;
+
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			take( batch, max_n, senders );
+
+			if ( batch.empty( ) && max_n )
+			{
+				if ( closed_.load( std::memory_order_seq_cst ) )
+					return reject< arguments< batch_type > >(
+						channel_closed_exception( ) );
+
+				auto defer = batch_defer_type::construct( );
+
+				waiters_.push_back(
+					waiter{ nullptr, defer, nullptr, max_n } );
+
+				return defer->get_promise( );
+			}
+		}
+
+		for ( auto& sender : senders )
+			sender->set_value( );
+
+		return with( std::move( batch ) );
+	}
+
+private:
+	friend struct detail::channel_access;
+
+	typedef detail::defer< batch_type > batch_defer_type;
+	typedef detail::select_state< T... > select_type;
+
+	struct parked_sender
+	{
+		tuple_type message_;
+		// Only set for the last message of a send_many( ) batch
+		typename detail::defer< >::pointer_type defer_;
+	};
+
+	/**
+	 * A receiver waiting for a message, either by receive( ), by
+	 * receive_many( ) for up to @c max_ messages, or by a select( ) in
+	 * which this channel has index @c max_.
+	 */
+	struct waiter
+	{
+		typename defer_type::pointer_type defer_;
+		typename batch_defer_type::pointer_type batch_defer_;
+		std::shared_ptr< select_type > select_;
+		std::size_t max_;
+
+		explicit operator bool( ) const
+		{
+			return defer_ || batch_defer_ || select_;
+		}
+	};
+
+	/**
+	 * Takes the first waiter which can still receive a message into
+	 * @c receiver, skipping selects already claimed by other channels.
+	 * Must be called with the mutex locked.
+	 *
+	 * @returns whether there was such a waiter.
+	 */
+	bool claim_waiter( waiter& receiver )
+	{
+		for ( ; !waiters_.empty( ); waiters_.pop_front( ) )
+		{
+			auto& front = waiters_.front( );
+
+			if ( !front.select_ || front.select_->claim( ) )
+			{
+				receiver = std::move( front );
+				waiters_.pop_front( );
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Hands @c t to @c receiver, claimed by claim_waiter( ). Must be
+	 * called without the mutex locked, as it may run continuations.
+	 */
+	void deliver( waiter& receiver, tuple_type& t )
+	{
+		if ( receiver.defer_ )
+		{
+			receiver.defer_->set_value( std::move( t ) );
+		}
+		else if ( receiver.batch_defer_ )
+		{
+			batch_type batch;
+			batch.push_back( std::move( t ) );
+			receiver.batch_defer_->set_value(
+				std::make_tuple( std::move( batch ) ) );
+		}
+		else
+		{
+			auto defer = std::move( receiver.select_->defer_ );
+			defer->set_value( std::tuple_cat(
+				std::make_tuple( receiver.max_ ), std::move( t ) ) );
+		}
+	}
+
+	/**
+	 * Takes the next message and passes it to @c fn, and lets the first
+	 * parked sender (which is returned in @c sender) into the room made.
+	 * Must be called with the mutex locked.
+	 *
+	 * @returns whether there was a message.
+	 */
+	template< typename Fn >
+	bool take_one(
+		Fn&& fn, typename detail::defer< >::pointer_type& sender )
+	{
+		if ( !queue_.empty( ) )
+		{
+			fn( std::move( queue_.front( ) ) );
+			queue_.pop( );
+
+			if ( !senders_.empty( ) )
+			{
+				queue_.push( std::move( senders_.front( ).message_ ) );
+				sender = std::move( senders_.front( ).defer_ );
+				senders_.pop( );
+			}
+		}
+		else if ( !senders_.empty( ) )
+		{
+			fn( std::move( senders_.front( ).message_ ) );
+			sender = std::move( senders_.front( ).defer_ );
+			senders_.pop( );
+		}
+		else
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Resolves @c select with the next message of this channel (as index
+	 * @c index), unless it's already claimed, or registers it as a waiter.
+	 *
+	 * @returns whether the select is still waiting, i.e. whether it should
+	 * be registered with the following channels.
+	 */
+	bool register_select(
+		const std::shared_ptr< select_type >& select, std::size_t index )
+	{
+		typename detail::defer< >::pointer_type sender;
+		typename select_type::defer_type::pointer_type defer;
+		detail::late_value< tuple_type > message;
+		bool received;
+
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			received = !queue_.empty( ) || !senders_.empty( );
+
+			if ( !received && !closed_.load( std::memory_order_seq_cst ) )
+			{
+				// Prune waiters of selects settled by other channels,
+				// as they are otherwise only removed when a message
+				// arrives
+				waiters_.erase( std::remove_if(
+					waiters_.begin( ), waiters_.end( ),
+					[ ]( const waiter& waiter )
+					{
+						return waiter.select_ &&
+							waiter.select_->claimed( );
+					} ),
+					waiters_.end( ) );
+
+				waiters_.push_back(
+					waiter{ nullptr, nullptr, select, index } );
+
+				return true;
+			}
+
+			if ( !select->claim( ) )
+				return false;
+
+			if ( received )
+				take_one( [ &message ]( tuple_type&& t )
+				{
+					message.set( std::move( t ) );
+				}, sender );
+
+			defer = std::move( select->defer_ );
+		}
+
+		if ( !received )
+		{
+			defer->set_exception( std::make_exception_ptr(
+				channel_closed_exception( ) ) );
+			return false;
+		}
+
+		defer->set_value( std::tuple_cat(
+			std::make_tuple( index ), std::move( message.get( ) ) ) );
+
+		if ( sender )
+			sender->set_value( );
+
+		return false;
+	}
+
+	template< typename Iterator >
+	promise< std::tuple< > >
+	send_many( Iterator first, Iterator last, std::false_type )
+	{
+		return send_many(
+			std::make_move_iterator( first ),
+			std::make_move_iterator( last ),
+			std::true_type( ) );
+	}
+
+	template< typename Iterator >
+	promise< std::tuple< > >
+	send_many( Iterator first, Iterator last, std::true_type )
+	{
+		// Receivers claimed under the lock, resolved once it's released
+		std::vector< std::pair< waiter, tuple_type > > receivers;
+		std::vector< std::pair<
+			typename batch_defer_type::pointer_type, batch_type
+		> > batches;
+		typename detail::defer< >::pointer_type defer;
+
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			if ( closed_.load( std::memory_order_seq_cst ) )
+				Q_THROW( channel_closed_exception( ) );
+
+			while ( first != last )
+			{
+				if ( !waiters_.empty( ) && waiters_.front( ).batch_defer_ )
+				{
+					// Give a batch receiver as much as it wants at once
+					auto waiter = std::move( waiters_.front( ) );
+					waiters_.pop_front( );
+
+					batch_type batch;
+					for ( ; first != last && batch.size( ) < waiter.max_;
+						++first )
+						batch.push_back( tuple_type( *first ) );
+
+					batches.emplace_back(
+						std::move( waiter.batch_defer_ ),
+						std::move( batch ) );
+
+					continue;
+				}
+
+				tuple_type t( *first );
+				waiter receiver = waiter( );
+
+				if ( !offer( t, receiver ) )
+					break;
+
+				if ( receiver )
+					receivers.emplace_back(
+						std::move( receiver ), std::move( t ) );
+
+				++first;
+			}
+
+			if ( first != last )
+			{
+				for ( ; first != last; ++first )
+					senders_.push(
+						parked_sender{ tuple_type( *first ), nullptr } );
+
+				defer = detail::defer< >::construct( );
+
+				senders_.back( ).defer_ = defer;
+			}
+		}
+
+		for ( auto& batch : batches )
+			batch.first->set_value(
+				std::make_tuple( std::move( batch.second ) ) );
+
+		for ( auto& receiver : receivers )
+			deliver( receiver.first, receiver.second );
+
+		if ( defer )
+			return defer->get_promise( );
+
+		return with( );
+	}
+
+	/**
+	 * Moves up to @c max_n messages into @c batch, first from the queue
+	 * and then from parked senders, and lets parked senders into the room
+	 * made. Must be called with the mutex locked.
+	 *
+	 * The senders to resolve (outside the lock) are added to @c senders.
+	 */
+	void take(
+		batch_type& batch, std::size_t max_n,
+		std::vector< typename detail::defer< >::pointer_type >& senders )
+	{
+		for ( ; batch.size( ) < max_n && !queue_.empty( ); queue_.pop( ) )
+			batch.push_back( std::move( queue_.front( ) ) );
+
+		while ( !senders_.empty( ) )
+		{
+			auto& sender = senders_.front( );
+
+			if ( batch.size( ) < max_n )
+				// The queue is empty
+				batch.push_back( std::move( sender.message_ ) );
+			else if ( queue_.size( ) < capacity_ )
+				queue_.push( std::move( sender.message_ ) );
+			else
+				break;
+
+			if ( sender.defer_ )
+				senders.push_back( std::move( sender.defer_ ) );
+
+			senders_.pop( );
+		}
+	}
+
+	/**
+	 * Claims a waiting receiver into @c receiver, to which the caller must
+	 * deliver( ) @c t once the mutex is unlocked, or queues @c t if there's
+	 * room. Must be called with the mutex locked.
+	 *
+	 * @returns whether the message was taken, otherwise @c t is untouched.
+	 */
+	bool offer( tuple_type& t, waiter& receiver )
+	{
+		if ( claim_waiter( receiver ) )
+			return true;
+
+		if ( queue_.size( ) < capacity_ )
+		{
+			queue_.push( std::move( t ) );
+		}
+		else
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	promise< tuple_type >
+	receive( typename detail::defer< >::pointer_type& sender )
 	{
 		Q_AUTO_UNIQUE_LOCK( mutex_ );
 
-		if ( queue_.empty( ) )
+		if ( queue_.empty( ) && senders_.empty( ) )
 		{
 			if ( closed_.load( std::memory_order_seq_cst ) )
 				return reject< arguments_type >(
 					channel_closed_exception( ) );
 
-			auto defer = ::q::make_shared< defer_type >( );
+			auto defer = defer_type::construct( );
 
-			waiters_.push( defer );
+			waiters_.push_back( waiter{ defer, nullptr, nullptr, 1 } );
 
 			return defer->get_promise( );
 		}
+
+		auto defer = defer_type::construct( );
+
+		if ( queue_.empty( ) )
+		{
+			// Unbuffered, take the message from the sender directly
+			defer->set_value( std::move( senders_.front( ).message_ ) );
+			sender = std::move( senders_.front( ).defer_ );
+			senders_.pop( );
+		}
 		else
 		{
-			tuple_type t = std::move( queue_.front( ) );
+			defer->set_value( std::move( queue_.front( ) ) );
 			queue_.pop( );
 
-			auto defer = ::q::make_shared< defer_type >( );
-
-			defer->set_value( std::move( t ) );
-
-			return defer->get_promise( );
+			// Let the first parked sender in, in the room just made
+			if ( !senders_.empty( ) )
+			{
+				queue_.push( std::move( senders_.front( ).message_ ) );
+				sender = std::move( senders_.front( ).defer_ );
+				senders_.pop( );
+			}
 		}
+
+		return defer->get_promise( );
 	}
 
-private:
 	// TODO: Make this lock-free and consider other list types
 	mutex mutex_;
-	std::queue< std::shared_ptr< defer_type > > waiters_;
+	std::deque< waiter > waiters_;
+	std::queue< parked_sender > senders_;
 	std::queue< tuple_type > queue_;
+	const std::size_t capacity_;
+	std::atomic< bool > closed_;
+};
+
+namespace detail {
+
+struct channel_access
+{
+	template< typename... T >
+	static bool register_select(
+		channel< T... >& channel,
+		const std::shared_ptr< select_state< T... > >& select,
+		std::size_t index )
+	{
+		return channel.register_select( select, index );
+	}
+};
+
+} // namespace detail
+
+/**
+ * Receives a message from the first of the channels (of the same type) to
+ * have one, and resolves to the index of that channel followed by the
+ * message.
+ *
+ * A single waiter is registered with all channels, and is claimed by the
+ * first of them to have a message for it, so exactly one message is taken.
+ * The other channels skip the waiter and keep their messages for other
+ * receivers. If a channel is closed (and empty) before any message is
+ * received, whether it already was or is closed while the select waits,
+ * the returned promise is rejected with a channel_closed_exception.
+ */
+template< typename... T, typename... Channels >
+promise< std::tuple< std::size_t, T... > >
+select( channel< T... >& first, Channels&... rest )
+{
+	channel< T... >* channels[ ] = { &first, &rest... };
+
+	auto state = std::make_shared< detail::select_state< T... > >( );
+	auto ret = state->defer_->get_promise( );
+
+	std::size_t index = 0;
+	for ( auto channel : channels )
+		if ( !detail::channel_access::register_select(
+			*channel, state, index++ ) )
+			break;
+
+	return ret;
+}
+
+namespace channel_policy {
+
+/**
+ * One thread sends and one thread receives at a time.
+ */
+struct spsc
+{
+	template< typename T >
+	struct ring
+	{
+		typedef detail::spsc_ring< T > type;
+	};
+};
+
+/**
+ * Any number of threads send, and one thread receives at a time.
+ */
+struct mpsc
+{
+	template< typename T >
+	struct ring
+	{
+		typedef detail::mpsc_ring< T > type;
+	};
+};
+
+} // namespace channel_policy
+
+/**
+ * A bounded channel on a lock-free ring buffer, for a single consumer, and
+ * a single or multiple producers depending on @c Policy.
+ *
+ * Neither senders nor receivers ever lock. A receiver waiting for a message
+ * is parked in a single atomic slot, from which a sender takes it and hands
+ * it the next message, and senders waiting for room are parked in a
+ * lock-free stack, from which the receiver takes them. try_send( ) and
+ * try_receive( ) don't allocate.
+ *
+ * Unlike channel, only one receive( ) may be pending at a time, i.e. a new
+ * one must not be made before the previous one is resolved. With the spsc
+ * policy, the same goes for send( ).
+ *
+ * try_receive( ) must not be called while a receive( ) is pending, and
+ * try_send( ) not while a send( ) of the same producer (with spsc, of any
+ * producer) is pending. They would race with whoever serves the parked
+ * receiver or sender, or put a message ahead of a parked one. send( ) on
+ * the other hand parks while any sender is parked, to keep the order.
+ *
+ * Closing or destroying the channel rejects parked senders, and a parked
+ * receiver, with a channel_closed_exception.
+ */
+template< typename Policy, typename... T >
+class lockfree_channel
+{
+public:
+	typedef std::tuple< T... >    tuple_type;
+	typedef detail::defer< T... > defer_type;
+	typedef arguments< T... >     arguments_type;
+
+	explicit lockfree_channel( std::size_t capacity )
+	: ring_( capacity )
+	, receiver_( nullptr )
+	, senders_( nullptr )
+	, parked_( 0 )
+	, draining_( false )
+	, pending_( nullptr )
+	, pending_tail_( nullptr )
+	, closed_( false )
+	{ }
+
+	lockfree_channel( const lockfree_channel& ) = delete;
+	lockfree_channel& operator=( const lockfree_channel& ) = delete;
+
+	~lockfree_channel( )
+	{
+		// Like close( ), although no message can arrive anymore either way
+		if ( auto receiver = take_receiver( ) )
+			receiver->set_exception( std::make_exception_ptr(
+				channel_closed_exception( ) ) );
+
+		reject_senders( pending_ );
+		reject_senders( senders_.load( std::memory_order_acquire ) );
+	}
+
+	void close( )
+	{
+		closed_.store( true, std::memory_order_seq_cst );
+
+		// A parked receiver of an empty channel is rejected
+		if ( auto receiver = take_receiver( ) )
+			serve( std::move( receiver ) );
+
+		retry_senders( );
+	}
+
+	std::size_t capacity( ) const
+	{
+		return ring_.capacity( );
+	}
+
+	bool try_send( T&&... t )
+	{
+		return try_send( std::make_tuple( std::move( t )... ) );
+	}
+
+	bool try_send( const T&... t )
+	{
+		return try_send( std::make_tuple( t... ) );
+	}
+
+	/**
+	 * Sends a message unless the channel is full.
+	 *
+	 * @returns whether the message was sent.
+	 */
+	bool try_send( tuple_type&& t )
+	{
+		if ( closed_.load( std::memory_order_relaxed ) )
+			Q_THROW( channel_closed_exception( ) );
+
+		if ( !ring_.push( t ) )
+			return false;
+
+		notify_receiver( );
+
+		return true;
+	}
+
+	promise< std::tuple< > > send( T&&... t )
+	{
+		return send( std::make_tuple( std::move( t )... ) );
+	}
+
+	promise< std::tuple< > > send( const T&... t )
+	{
+		return send( std::make_tuple( t... ) );
+	}
+
+	/**
+	 * Sends a message, or parks it if the channel is full or other
+	 * senders are parked.
+	 *
+	 * @returns a promise resolved once the message is in the channel.
+	 */
+	promise< std::tuple< > > send( tuple_type&& t )
+	{
+		if ( closed_.load( std::memory_order_relaxed ) )
+			Q_THROW( channel_closed_exception( ) );
+
+		// Overtaking a parked sender could reorder the messages of a
+		// producer, and with spsc, make it push along with the sender
+		// moving the parked messages into the ring
+		if ( !parked_.load( std::memory_order_seq_cst ) && ring_.push( t ) )
+		{
+			notify_receiver( );
+			return with( );
+		}
+
+		auto sender = new parked_sender{
+			std::move( t ), detail::defer< >::construct( ), nullptr };
+
+		auto ret = sender->defer_->get_promise( );
+
+		park( sender );
+
+		return ret;
+	}
+
+	/**
+	 * Receives a message if there is one, without allocating.
+	 *
+	 * @returns whether a message was received into @c t.
+	 */
+	bool try_receive( tuple_type& t )
+	{
+		if ( !ring_.pop( [ &t ]( tuple_type&& message )
+		{
+			t = std::move( message );
+		} ) )
+			return false;
+
+		notify_senders( );
+
+		return true;
+	}
+
+	promise< tuple_type > receive( )
+	{
+		auto receiver = defer_type::construct( );
+		auto ret = receiver->get_promise( );
+
+		serve( std::move( receiver ) );
+
+		return ret;
+	}
+
+private:
+	typedef typename Policy::template ring< tuple_type >::type ring_type;
+	typedef typename defer_type::pointer_type receiver_type;
+
+	struct parked_sender
+	{
+		tuple_type message_;
+		typename detail::defer< >::pointer_type defer_;
+		parked_sender* next_;
+	};
+
+	receiver_type take_receiver( )
+	{
+		auto raw = receiver_.exchange( nullptr, std::memory_order_seq_cst );
+
+		// Adopt the reference held by receiver_
+		receiver_type receiver( raw );
+		if ( raw )
+			raw->release( );
+
+		return receiver;
+	}
+
+	/**
+	 * Resolves @c receiver with the next message, or parks it until there
+	 * is one. Called by whoever owns the consuming end of the ring, i.e.
+	 * the receiver, or whoever took the parked receiver.
+	 */
+	void serve( receiver_type receiver )
+	{
+		for ( ; ; )
+		{
+			detail::late_value< tuple_type > message;
+
+			if ( ring_.pop( [ &message ]( tuple_type&& t )
+			{
+				message.set( std::move( t ) );
+			} ) )
+			{
+				notify_senders( );
+				receiver->set_value( std::move( message.get( ) ) );
+				return;
+			}
+
+			if ( closed_.load( std::memory_order_seq_cst ) )
+			{
+				receiver->set_exception( std::make_exception_ptr(
+					channel_closed_exception( ) ) );
+				return;
+			}
+
+			receiver_.store( receiver.detach( ), std::memory_order_seq_cst );
+
+			// A message pushed before the receiver was parked would
+			// otherwise leave it parked, as its sender didn't see it
+			std::atomic_thread_fence( std::memory_order_seq_cst );
+
+			if ( !ring_.readable( ) &&
+				!closed_.load( std::memory_order_seq_cst ) )
+				return;
+
+			receiver = take_receiver( );
+			if ( !receiver )
+				// A sender took it, and serves it
+				return;
+		}
+	}
+
+	void notify_receiver( )
+	{
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+
+		if ( !receiver_.load( std::memory_order_relaxed ) )
+			return;
+
+		if ( auto receiver = take_receiver( ) )
+			serve( std::move( receiver ) );
+	}
+
+	void park( parked_sender* sender )
+	{
+		parked_.fetch_add( 1, std::memory_order_seq_cst );
+
+		auto head = senders_.load( std::memory_order_relaxed );
+		do
+		{
+			sender->next_ = head;
+		}
+		while ( !senders_.compare_exchange_weak(
+			head, sender,
+			std::memory_order_seq_cst,
+			std::memory_order_relaxed ) );
+
+		// Room made (or the channel closed) before the sender was parked
+		// would otherwise leave it parked, as the receiver didn't see it
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+
+		if ( ring_.writable( ) || closed_.load( std::memory_order_relaxed ) )
+			retry_senders( );
+	}
+
+	void notify_senders( )
+	{
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+
+		if ( parked_.load( std::memory_order_relaxed ) )
+			retry_senders( );
+	}
+
+	/**
+	 * Moves the messages of parked senders into the ring, in the order
+	 * they were parked, until it is full, or rejects the senders if the
+	 * channel is closed. Only one thread at a time does this, and if
+	 * another one already is, it retries when done instead.
+	 */
+	void retry_senders( )
+	{
+		for ( ; ; )
+		{
+			if ( draining_.exchange( true, std::memory_order_seq_cst ) )
+				return;
+
+			bool pending = drain_senders( );
+
+			draining_.store( false, std::memory_order_seq_cst );
+
+			std::atomic_thread_fence( std::memory_order_seq_cst );
+
+			if ( !pending && !senders_.load( std::memory_order_relaxed ) )
+				return;
+
+			if ( !ring_.writable( ) &&
+				!closed_.load( std::memory_order_relaxed ) )
+				return;
+		}
+	}
+
+	/**
+	 * Appends the newly parked senders to pending_, oldest first, and
+	 * moves as many as fit into the ring. Must only be called by the
+	 * thread which set draining_.
+	 *
+	 * @returns whether senders are left in pending_.
+	 */
+	bool drain_senders( )
+	{
+		auto sender = senders_.exchange( nullptr, std::memory_order_seq_cst );
+
+		if ( sender )
+		{
+			auto tail = sender;
+
+			parked_sender* fifo = nullptr;
+			while ( sender )
+			{
+				auto next = sender->next_;
+				sender->next_ = fifo;
+				fifo = sender;
+				sender = next;
+			}
+
+			if ( pending_tail_ )
+				pending_tail_->next_ = fifo;
+			else
+				pending_ = fifo;
+			pending_tail_ = tail;
+		}
+
+		const bool closed = closed_.load( std::memory_order_seq_cst );
+
+		while ( pending_ && ( closed || ring_.push( pending_->message_ ) ) )
+		{
+			sender = pending_;
+			pending_ = sender->next_;
+			if ( !pending_ )
+				pending_tail_ = nullptr;
+
+			parked_.fetch_sub( 1, std::memory_order_seq_cst );
+
+			auto defer = std::move( sender->defer_ );
+			delete sender;
+
+			if ( closed )
+			{
+				defer->set_exception( std::make_exception_ptr(
+					channel_closed_exception( ) ) );
+				continue;
+			}
+
+			notify_receiver( );
+			defer->set_value( );
+		}
+
+		return pending_ != nullptr;
+	}
+
+	static void reject_senders( parked_sender* sender )
+	{
+		while ( sender )
+		{
+			auto next = sender->next_;
+			sender->defer_->set_exception( std::make_exception_ptr(
+				channel_closed_exception( ) ) );
+			delete sender;
+			sender = next;
+		}
+	}
+
+	ring_type ring_;
+	std::atomic< defer_type* > receiver_;
+	// Newly parked senders, newest first
+	std::atomic< parked_sender* > senders_;
+	// Parked senders whose messages aren't yet in the ring
+	std::atomic< std::size_t > parked_;
+	std::atomic< bool > draining_;
+	// Parked senders taken from senders_, oldest first, only touched by
+	// the thread draining them
+	parked_sender* pending_;
+	parked_sender* pending_tail_;
 	std::atomic< bool > closed_;
 };
 
+template< typename... T >
+using spsc_channel = lockfree_channel< channel_policy::spsc, T... >;
+
+template< typename... T >
+using mpsc_channel = lockfree_channel< channel_policy::mpsc, T... >;
+
 } // namespace q
 
 #endif // LIBQ_CHANNEL_HPP
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_DETAIL_HAZARD_POINTER_HPP
+#define LIBQ_DETAIL_HAZARD_POINTER_HPP
+
+#include <atomic>
+#include <cstddef>
+
+namespace q { namespace detail {
+
+/**
+ * A hazard record is owned by one thread at a time, and holds the pointers
+ * this thread is currently dereferencing in lock-free data structures. Memory
+ * retired by any thread will not be freed as long as it is referenced from
+ * any hazard record.
+ */
+struct hazard_record
+{
+	static const std::size_t slots = 4;
+
+	std::atomic< void* > pointers[ slots ];
+	std::atomic< bool > active;
+	hazard_record* next;
+
+	// Only accessed by the owning thread
+	std::size_t used;
+};
+
+/**
+ * @returns the hazard record of the current thread. The record is released
+ * when the thread exits.
+ */
+hazard_record* this_thread_hazard_record( );
+
+/**
+ * Acquires a spare hazard record, for a hazard pointer which doesn't fit in
+ * the record of the current thread. It's returned with
+ * release_hazard_record( ).
+ */
+hazard_record* acquire_hazard_record( );
+void release_hazard_record( hazard_record* record );
+
+typedef void( *hazard_deleter )( void* );
+
+/**
+ * Retires @c ptr, which must already be unreachable for threads which don't
+ * yet hold a hazard pointer to it. @c deleter will be called with @c ptr once
+ * no hazard pointer references it anymore, which may happen on any thread.
+ */
+void retire_hazardous( void* ptr, hazard_deleter deleter );
+
+/**
+ * Scoped hazard pointer. Hazard pointers must be destructed in the reverse
+ * order they were created, per thread, which is naturally the case when they
+ * are kept on the stack. If more are nested than the record of the thread
+ * has slots, the rest use spare records, which is slower but safe.
+ */
+class hazard_pointer
+{
+public:
+	hazard_pointer( )
+	: record_( this_thread_hazard_record( ) )
+	, spare_( record_->used == hazard_record::slots )
+	{
+		if ( spare_ )
+			record_ = acquire_hazard_record( );
+
+		slot_ = &record_->pointers[ record_->used++ ];
+	}
+
+	hazard_pointer( const hazard_pointer& ) = delete;
+	hazard_pointer& operator=( const hazard_pointer& ) = delete;
+
+	~hazard_pointer( )
+	{
+		slot_->store( nullptr, std::memory_order_release );
+		--record_->used;
+
+		if ( spare_ )
+			release_hazard_record( record_ );
+	}
+
+	/**
+	 * Loads the pointer in @c source and protects it from being freed
+	 * until this hazard pointer is reset or destructed.
+	 */
+	template< typename T >
+	T* protect( const std::atomic< T* >& source )
+	{
+		T* ptr = source.load( std::memory_order_relaxed );
+
+		for ( ; ; )
+		{
+			slot_->store( ptr, std::memory_order_seq_cst );
+
+			T* validated = source.load( std::memory_order_seq_cst );
+
+			if ( validated == ptr )
+				return ptr;
+
+			ptr = validated;
+		}
+	}
+
+	void reset( )
+	{
+		slot_->store( nullptr, std::memory_order_release );
+	}
+
+private:
+	hazard_record* record_;
+	bool spare_;
+	std::atomic< void* >* slot_;
+};
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_DETAIL_HAZARD_POINTER_HPP
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_DETAIL_INTRUSIVE_PTR_HPP
+#define LIBQ_DETAIL_INTRUSIVE_PTR_HPP
+
+#include <cstddef>
+#include <utility>
+
+namespace q { namespace detail {
+
+/**
+ * Smart pointer to an object which holds its own reference counter, and
+ * provides add_ref( ) and release( ), where release( ) deletes the object
+ * when the last reference is dropped.
+ *
+ * Unlike std::shared_ptr, this requires no separate control block, and is
+ * the size of a raw pointer.
+ */
+template< typename T >
+class intrusive_ptr
+{
+public:
+	intrusive_ptr( ) noexcept
+	: ptr_( nullptr )
+	{ }
+
+	intrusive_ptr( std::nullptr_t ) noexcept
+	: ptr_( nullptr )
+	{ }
+
+	/**
+	 * Takes a new reference to @c ptr.
+	 */
+	explicit intrusive_ptr( T* ptr ) noexcept
+	: ptr_( ptr )
+	{
+		if ( ptr_ )
+			ptr_->add_ref( );
+	}
+
+	intrusive_ptr( const intrusive_ptr& other ) noexcept
+	: ptr_( other.ptr_ )
+	{
+		if ( ptr_ )
+			ptr_->add_ref( );
+	}
+
+	intrusive_ptr( intrusive_ptr&& other ) noexcept
+	: ptr_( other.ptr_ )
+	{
+		other.ptr_ = nullptr;
+	}
+
+	template< typename U >
+	intrusive_ptr( intrusive_ptr< U >&& other ) noexcept
+	: ptr_( other.detach( ) )
+	{ }
+
+	template< typename U >
+	intrusive_ptr( const intrusive_ptr< U >& other ) noexcept
+	: ptr_( other.get( ) )
+	{
+		if ( ptr_ )
+			ptr_->add_ref( );
+	}
+
+	~intrusive_ptr( )
+	{
+		if ( ptr_ )
+			ptr_->release( );
+	}
+
+	intrusive_ptr& operator=( intrusive_ptr other ) noexcept
+	{
+		std::swap( ptr_, other.ptr_ );
+		return *this;
+	}
+
+	T* get( ) const noexcept
+	{
+		return ptr_;
+	}
+
+	T& operator*( ) const noexcept
+	{
+		return *ptr_;
+	}
+
+	T* operator->( ) const noexcept
+	{
+		return ptr_;
+	}
+
+	explicit operator bool( ) const noexcept
+	{
+		return ptr_ != nullptr;
+	}
+
+	/**
+	 * Gives up ownership of the pointer without releasing the reference.
+	 */
+	T* detach( ) noexcept
+	{
+		T* ptr = ptr_;
+		ptr_ = nullptr;
+		return ptr;
+	}
+
+private:
+	T* ptr_;
+};
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_DETAIL_INTRUSIVE_PTR_HPP
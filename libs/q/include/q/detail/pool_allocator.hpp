@@ -0,0 +1,80 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_DETAIL_POOL_ALLOCATOR_HPP
+#define LIBQ_DETAIL_POOL_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+
+namespace q { namespace detail {
+
+#ifdef LIBQ_POOL_ALLOCATOR
+
+/**
+ * Allocates @c size bytes from size-classed pools of small blocks. Each
+ * thread allocates from and frees to its own magazines of blocks, which are
+ * exchanged with a shared depot a whole magazine at a time. Blocks freed by
+ * another thread than the one which allocated them are therefore returned in
+ * batches, rather than one by one.
+ *
+ * Sizes above the largest size class are allocated from the heap.
+ */
+void* pool_allocate( std::size_t size );
+
+/**
+ * Returns a block allocated by pool_allocate( ) with the same @c size. This
+ * may be done by any thread.
+ */
+void pool_deallocate( void* ptr, std::size_t size ) noexcept;
+
+/**
+ * Base class giving a class (and its subclasses) pool allocated instances.
+ * Objects must be deleted as their most derived type.
+ */
+struct pool_allocated
+{
+	static void* operator new( std::size_t size )
+	{
+		return pool_allocate( size );
+	}
+
+	static void operator delete( void* ptr, std::size_t size ) noexcept
+	{
+		pool_deallocate( ptr, size );
+	}
+};
+
+#else
+
+inline void* pool_allocate( std::size_t size )
+{
+	return ::operator new( size );
+}
+
+inline void pool_deallocate( void* ptr, std::size_t ) noexcept
+{
+	::operator delete( ptr );
+}
+
+struct pool_allocated
+{ };
+
+#endif // LIBQ_POOL_ALLOCATOR
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_DETAIL_POOL_ALLOCATOR_HPP
@@ -0,0 +1,317 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_DETAIL_RING_BUFFER_HPP
+#define LIBQ_DETAIL_RING_BUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace q { namespace detail {
+
+/**
+ * The size of a cache line, which data written by different threads is
+ * padded to, to not share lines.
+ */
+const std::size_t cache_line_size = 64;
+
+inline std::size_t round_up_to_power_of_two( std::size_t n )
+{
+	std::size_t ret = 1;
+	while ( ret < n )
+		ret <<= 1;
+	return ret;
+}
+
+/**
+ * Bounded lock-free single-producer/single-consumer FIFO queue.
+ *
+ * The producer and the consumer each keep a cached copy of the other's
+ * index, so that they only read each other's cache line when the ring looks
+ * full or empty respectively.
+ *
+ * The roles may move between threads, as long as the moves are synchronized
+ * by the caller, i.e. only one thread pushes and one pops at a time.
+ */
+template< typename T >
+class spsc_ring
+{
+public:
+	explicit spsc_ring( std::size_t capacity )
+	: mask_( round_up_to_power_of_two( capacity ? capacity : 1 ) - 1 )
+	, slots_( new slot[ mask_ + 1 ] )
+	, head_( 0 )
+	, cached_tail_( 0 )
+	, tail_( 0 )
+	, cached_head_( 0 )
+	{ }
+
+	spsc_ring( const spsc_ring& ) = delete;
+	spsc_ring& operator=( const spsc_ring& ) = delete;
+
+	~spsc_ring( )
+	{
+		while ( pop( [ ]( T&& ) { } ) )
+			;
+	}
+
+	std::size_t capacity( ) const
+	{
+		return mask_ + 1;
+	}
+
+	/**
+	 * Moves @c t into the ring, unless it's full, in which case @c t is
+	 * left untouched.
+	 */
+	bool push( T& t )
+	{
+		auto tail = tail_.load( std::memory_order_relaxed );
+
+		if ( tail - cached_head_ > mask_ )
+		{
+			cached_head_ = head_.load( std::memory_order_acquire );
+			if ( tail - cached_head_ > mask_ )
+				return false;
+		}
+
+		::new ( &slots_[ tail & mask_ ] ) T( std::move( t ) );
+		tail_.store( tail + 1, std::memory_order_release );
+
+		return true;
+	}
+
+	/**
+	 * Calls @c fn with the oldest element as an rvalue, and removes it,
+	 * unless the ring is empty.
+	 */
+	template< typename Fn >
+	bool pop( Fn&& fn )
+	{
+		auto head = head_.load( std::memory_order_relaxed );
+
+		if ( head == cached_tail_ )
+		{
+			cached_tail_ = tail_.load( std::memory_order_acquire );
+			if ( head == cached_tail_ )
+				return false;
+		}
+
+		auto elem = reinterpret_cast< T* >( &slots_[ head & mask_ ] );
+		fn( std::move( *elem ) );
+		elem->~T( );
+
+		head_.store( head + 1, std::memory_order_release );
+
+		return true;
+	}
+
+	/**
+	 * @returns whether pop( ) would succeed. Called by the consumer.
+	 */
+	bool readable( ) const
+	{
+		return head_.load( std::memory_order_relaxed ) !=
+			tail_.load( std::memory_order_acquire );
+	}
+
+	/**
+	 * @returns whether push( ) would succeed. Called by the producer.
+	 */
+	bool writable( ) const
+	{
+		return tail_.load( std::memory_order_relaxed ) -
+			head_.load( std::memory_order_acquire ) <= mask_;
+	}
+
+private:
+	typedef typename std::aligned_storage<
+		sizeof( T ), std::alignment_of< T >::value
+	>::type slot;
+
+	const std::size_t mask_;
+	std::unique_ptr< slot[ ] > slots_;
+
+	char pad0_[ cache_line_size ];
+
+	// Consumer side
+	std::atomic< std::size_t > head_;
+	std::size_t cached_tail_;
+
+	char pad1_[ cache_line_size ];
+
+	// Producer side
+	std::atomic< std::size_t > tail_;
+	std::size_t cached_head_;
+
+	char pad2_[ cache_line_size ];
+};
+
+/**
+ * Bounded lock-free multi-producer/single-consumer FIFO queue.
+ *
+ * Each slot has a sequence number, telling whether it's free to be written
+ * for a certain lap around the ring, or has been written and is ready to be
+ * read. Producers claim slots with a compare-and-swap of the tail index, and
+ * publish them through the sequence number, so the consumer can find a slot
+ * claimed but not yet published, even though later slots are.
+ */
+template< typename T >
+class mpsc_ring
+{
+public:
+	// With a single cell, a published cell would look free for the next
+	// lap, so there are at least two
+	explicit mpsc_ring( std::size_t capacity )
+	: mask_( round_up_to_power_of_two( capacity > 1 ? capacity : 2 ) - 1 )
+	, cells_( new cell[ mask_ + 1 ] )
+	, head_( 0 )
+	, tail_( 0 )
+	{
+		for ( std::size_t i = 0; i <= mask_; ++i )
+			cells_[ i ].sequence_.store( i, std::memory_order_relaxed );
+	}
+
+	mpsc_ring( const mpsc_ring& ) = delete;
+	mpsc_ring& operator=( const mpsc_ring& ) = delete;
+
+	~mpsc_ring( )
+	{
+		while ( pop( [ ]( T&& ) { } ) )
+			;
+	}
+
+	std::size_t capacity( ) const
+	{
+		return mask_ + 1;
+	}
+
+	/**
+	 * Moves @c t into the ring, unless it's full, in which case @c t is
+	 * left untouched. May be called by any number of threads.
+	 */
+	bool push( T& t )
+	{
+		auto tail = tail_.load( std::memory_order_relaxed );
+		cell* c;
+
+		for ( ; ; )
+		{
+			c = &cells_[ tail & mask_ ];
+
+			auto sequence = c->sequence_.load( std::memory_order_acquire );
+			auto diff = static_cast< std::ptrdiff_t >( sequence - tail );
+
+			if ( diff == 0 )
+			{
+				if ( tail_.compare_exchange_weak(
+					tail, tail + 1, std::memory_order_relaxed ) )
+					break;
+			}
+			else if ( diff < 0 )
+			{
+				// Not yet read since the last lap
+				return false;
+			}
+			else
+			{
+				tail = tail_.load( std::memory_order_relaxed );
+			}
+		}
+
+		::new ( &c->storage_ ) T( std::move( t ) );
+		c->sequence_.store( tail + 1, std::memory_order_release );
+
+		return true;
+	}
+
+	/**
+	 * Calls @c fn with the oldest element as an rvalue, and removes it,
+	 * unless the ring is empty or the oldest slot isn't published yet.
+	 */
+	template< typename Fn >
+	bool pop( Fn&& fn )
+	{
+		auto head = head_.load( std::memory_order_relaxed );
+		auto& c = cells_[ head & mask_ ];
+
+		if ( c.sequence_.load( std::memory_order_acquire ) != head + 1 )
+			return false;
+
+		auto elem = reinterpret_cast< T* >( &c.storage_ );
+		fn( std::move( *elem ) );
+		elem->~T( );
+
+		c.sequence_.store( head + mask_ + 1, std::memory_order_release );
+		head_.store( head + 1, std::memory_order_relaxed );
+
+		return true;
+	}
+
+	/**
+	 * @returns whether pop( ) would succeed. Called by the consumer.
+	 */
+	bool readable( ) const
+	{
+		auto head = head_.load( std::memory_order_relaxed );
+
+		return cells_[ head & mask_ ].sequence_.load(
+			std::memory_order_acquire ) == head + 1;
+	}
+
+	/**
+	 * @returns whether a push( ) would find a free slot.
+	 */
+	bool writable( ) const
+	{
+		auto tail = tail_.load( std::memory_order_relaxed );
+
+		return cells_[ tail & mask_ ].sequence_.load(
+			std::memory_order_acquire ) == tail;
+	}
+
+private:
+	struct cell
+	{
+		std::atomic< std::size_t > sequence_;
+		typename std::aligned_storage<
+			sizeof( T ), std::alignment_of< T >::value
+		>::type storage_;
+	};
+
+	const std::size_t mask_;
+	std::unique_ptr< cell[ ] > cells_;
+
+	char pad0_[ cache_line_size ];
+
+	// Consumer side
+	std::atomic< std::size_t > head_;
+
+	char pad1_[ cache_line_size ];
+
+	// Producer side
+	std::atomic< std::size_t > tail_;
+
+	char pad2_[ cache_line_size ];
+};
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_DETAIL_RING_BUFFER_HPP
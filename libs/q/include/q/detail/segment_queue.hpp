@@ -0,0 +1,358 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_DETAIL_SEGMENT_QUEUE_HPP
+#define LIBQ_DETAIL_SEGMENT_QUEUE_HPP
+
+#include <q/detail/hazard_pointer.hpp>
+
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace q { namespace detail {
+
+/**
+ * Unbounded lock-free multi-producer/multi-consumer FIFO queue.
+ *
+ * Elements are stored in a linked list of fixed-size segments. Producers and
+ * consumers claim slots within a segment with a single fetch-and-add each, so
+ * contention is spread over the slots rather than concentrated on one lock.
+ * A consumer which claims a slot that its producer hasn't filled yet marks
+ * it as abandoned, in which case the producer retries on a later slot.
+ * Since every push is linearized at the point it fills its slot, two pushes
+ * from the same thread are always popped in order.
+ *
+ * Exhausted segments are freed using hazard pointers. The first segment is
+ * allocated by the first push, so an unused queue holds no segment at all.
+ */
+template< typename T, std::size_t SegmentSize = 128 >
+class segment_queue
+{
+public:
+	segment_queue( )
+	: head_( nullptr )
+	, tail_( nullptr )
+	{ }
+
+	segment_queue( const segment_queue& ) = delete;
+	segment_queue& operator=( const segment_queue& ) = delete;
+
+	~segment_queue( )
+	{
+		T t;
+		while ( pop( t ) )
+			;
+
+		auto seg = head_.load( std::memory_order_relaxed );
+		while ( seg )
+		{
+			auto next = seg->next_.load( std::memory_order_relaxed );
+			delete seg;
+			seg = next;
+		}
+	}
+
+	void push( T&& t )
+	{
+		hazard_pointer hp;
+
+		for ( ; ; )
+		{
+			segment* seg = hp.protect( tail_ );
+
+			if ( !seg )
+			{
+				if ( push_first( t ) )
+					return;
+
+				continue;
+			}
+
+			std::size_t index = seg->enqueue_.fetch_add(
+				1, std::memory_order_relaxed );
+
+			if ( index < SegmentSize )
+			{
+				if ( seg->slots_[ index ].fill( t ) )
+					return;
+
+				// The slot was abandoned by a consumer, retry
+				continue;
+			}
+
+			segment* next = seg->next_.load( std::memory_order_acquire );
+
+			if ( !next )
+			{
+				// Pre-fill a fresh segment with this element, and try
+				// to append it.
+				auto fresh = new segment;
+				fresh->enqueue_.store( 1, std::memory_order_relaxed );
+				fresh->slots_[ 0 ].fill( t );
+
+				if ( seg->next_.compare_exchange_strong(
+					next, fresh, std::memory_order_acq_rel ) )
+				{
+					tail_.compare_exchange_strong(
+						seg, fresh, std::memory_order_acq_rel );
+					return;
+				}
+
+				fresh->slots_[ 0 ].take( t );
+				delete fresh;
+			}
+
+			tail_.compare_exchange_strong(
+				seg, next, std::memory_order_acq_rel );
+		}
+	}
+
+	/**
+	 * Pops the first element into @c t.
+	 *
+	 * @returns false if the queue was empty.
+	 */
+	bool pop( T& t )
+	{
+		hazard_pointer hp;
+
+		for ( ; ; )
+		{
+			segment* seg = hp.protect( head_ );
+
+			if ( !seg )
+				return false;
+
+			std::size_t dequeue = seg->dequeue_.load(
+				std::memory_order_acquire );
+
+			if ( dequeue >= SegmentSize )
+			{
+				segment* next = seg->next_.load(
+					std::memory_order_acquire );
+
+				if ( !next )
+					return false;
+
+				// The tail must never point to a segment which is
+				// unlinked from the head.
+				segment* tail = seg;
+				tail_.compare_exchange_strong(
+					tail, next, std::memory_order_acq_rel );
+
+				if ( head_.compare_exchange_strong(
+					seg, next, std::memory_order_seq_cst ) )
+				{
+					hp.reset( );
+					retire_hazardous( seg, &segment::destroy );
+				}
+
+				continue;
+			}
+
+			std::size_t enqueue = seg->enqueue_.load(
+				std::memory_order_acquire );
+
+			if ( dequeue >= enqueue )
+				return false;
+
+			std::size_t index = seg->dequeue_.fetch_add(
+				1, std::memory_order_acq_rel );
+
+			if ( index >= SegmentSize )
+				continue;
+
+			if ( seg->slots_[ index ].consume( t ) )
+				return true;
+		}
+	}
+
+	/**
+	 * @returns whether the queue seems empty. This is only a snapshot and
+	 * can be outdated once returned.
+	 */
+	bool empty( ) const
+	{
+		hazard_pointer hp;
+
+		segment* seg = hp.protect( head_ );
+
+		if ( !seg )
+			return true;
+
+		std::size_t dequeue = seg->dequeue_.load( std::memory_order_acquire );
+		std::size_t enqueue = seg->enqueue_.load( std::memory_order_acquire );
+
+		if ( dequeue < SegmentSize )
+			return dequeue >= enqueue;
+
+		return !seg->next_.load( std::memory_order_acquire );
+	}
+
+private:
+	/**
+	 * Pushes @c t as the first element of the queue, in a new segment, or
+	 * helps a concurrent push which got there first to finish.
+	 *
+	 * The head is set before the tail, so that no element can be pushed
+	 * into a segment which consumers can't reach yet.
+	 *
+	 * @returns true if @c t was pushed
+	 */
+	bool push_first( T& t )
+	{
+		segment* head = head_.load( std::memory_order_acquire );
+
+		if ( !head )
+		{
+			auto fresh = new segment;
+			fresh->enqueue_.store( 1, std::memory_order_relaxed );
+			fresh->slots_[ 0 ].fill( t );
+
+			if ( head_.compare_exchange_strong(
+				head, fresh, std::memory_order_acq_rel ) )
+			{
+				segment* tail = nullptr;
+				tail_.compare_exchange_strong(
+					tail, fresh, std::memory_order_acq_rel );
+				return true;
+			}
+
+			fresh->slots_[ 0 ].take( t );
+			delete fresh;
+		}
+
+		segment* tail = nullptr;
+		tail_.compare_exchange_strong(
+			tail, head, std::memory_order_acq_rel );
+
+		return false;
+	}
+
+	enum slot_state : unsigned char
+	{
+		slot_empty,
+		slot_ready,
+		slot_abandoned
+	};
+
+	struct slot
+	{
+		slot( )
+		: state_( slot_empty )
+		{ }
+
+		T* get( )
+		{
+			return reinterpret_cast< T* >( &storage_ );
+		}
+
+		/**
+		 * Moves @c t into the slot. If the slot has been abandoned by a
+		 * consumer, @c t is moved back and false is returned.
+		 */
+		bool fill( T& t )
+		{
+			::new ( &storage_ ) T( std::move( t ) );
+
+			unsigned char expected = slot_empty;
+			if ( state_.compare_exchange_strong(
+				expected, slot_ready, std::memory_order_release,
+				std::memory_order_relaxed ) )
+				return true;
+
+			take( t );
+			return false;
+		}
+
+		void take( T& t )
+		{
+			t = std::move( *get( ) );
+			get( )->~T( );
+		}
+
+		/**
+		 * Waits briefly for a producer to fill the slot, and abandons it
+		 * if that doesn't happen.
+		 *
+		 * @returns true if an element was moved into @c t
+		 */
+		bool consume( T& t )
+		{
+			for ( std::size_t spin = 0; spin < spin_limit; ++spin )
+			{
+				if ( state_.load( std::memory_order_acquire ) ==
+					slot_ready )
+				{
+					take( t );
+					return true;
+				}
+
+				if ( spin > spin_limit / 2 )
+					std::this_thread::yield( );
+			}
+
+			unsigned char expected = slot_empty;
+			if ( state_.compare_exchange_strong(
+				expected, slot_abandoned, std::memory_order_acq_rel ) )
+				return false;
+
+			// Filled just now
+			take( t );
+			return true;
+		}
+
+		std::atomic< unsigned char > state_;
+		typename std::aligned_storage<
+			sizeof( T ), std::alignment_of< T >::value
+		>::type storage_;
+	};
+
+	static const std::size_t spin_limit = 128;
+	static const std::size_t cache_line = 64;
+
+	struct segment
+	{
+		segment( )
+		: enqueue_( 0 )
+		, dequeue_( 0 )
+		, next_( nullptr )
+		{ }
+
+		static void destroy( void* seg )
+		{
+			delete static_cast< segment* >( seg );
+		}
+
+		std::atomic< std::size_t > enqueue_;
+		char pad0_[ cache_line - sizeof( std::atomic< std::size_t > ) ];
+		std::atomic< std::size_t > dequeue_;
+		char pad1_[ cache_line - sizeof( std::atomic< std::size_t > ) ];
+		std::atomic< segment* > next_;
+		slot slots_[ SegmentSize ];
+	};
+
+	std::atomic< segment* > head_;
+	char pad0_[ cache_line - sizeof( std::atomic< segment* > ) ];
+	std::atomic< segment* > tail_;
+	char pad1_[ cache_line - sizeof( std::atomic< segment* > ) ];
+};
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_DETAIL_SEGMENT_QUEUE_HPP
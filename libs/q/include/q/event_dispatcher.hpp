@@ -49,6 +49,14 @@ public:
 
 	virtual void add_task( task ) = 0;
 
+	/**
+	 * @returns the number of tasks this dispatcher can run concurrently.
+	 */
+	virtual std::size_t parallelism( ) const
+	{
+		return 1;
+	}
+
 	/**
 	 * TODO: Reconsider
 	 */
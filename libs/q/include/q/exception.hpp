@@ -18,11 +18,15 @@
 #define LIBQ_EXCEPTION_HPP
 
 #include <q/types.hpp>
+#include <q/detail/intrusive_ptr.hpp>
 
+#include <cstddef>
 #include <exception>
 #include <vector>
 #include <iosfwd>
 #include <sstream>
+#include <type_traits>
+#include <typeinfo>
 
 #define Q_THROW( e, ... ) \
 	throw ::q::add_exception_properties( e __VA_ARGS__ )
@@ -115,8 +119,18 @@ private:
 	T t_;
 };
 
+class exception_info_block;
+
 } // namespace detail
 
+/**
+ * The base class of q exceptions, which carries any number of infos, i.e.
+ * values of any type, such as a stack trace.
+ *
+ * The infos are stored inline in reference counted blocks, a few per block,
+ * which are shared by copies of the exception. Adding an info to a copy
+ * starts a new block, so the original is never affected.
+ */
 class exception
 : std::exception
 {
@@ -126,54 +140,66 @@ public:
 	exception( const exception& );
 	virtual ~exception( );
 
+	/**
+	 * @returns the first info of type @c T, or nullptr.
+	 */
 	template< typename T >
 	const detail::exception_info< T >* get_info( ) const
 	{
-		auto& _infos = infos( );
-		for ( const auto& info : _infos )
-		{
-			auto ei = detail::exception_info< T >::cast( *info );
-			if ( ei )
-				return ei;
-		}
-		return nullptr;
+		return static_cast< const detail::exception_info< T >* >(
+			find_info( typeid( T ) ) );
 	}
 
 	template< typename T >
 	detail::exception_info< T >* get_info( )
 	{
-		for ( auto& info : infos( ) )
-		{
-			auto ei = detail::exception_info< T >::cast( *info );
-			if ( ei )
-				return ei;
-		}
-		return nullptr;
+		return const_cast< detail::exception_info< T >* >(
+			static_cast< const exception* >( this )->get_info< T >( ) );
 	}
 
-	const std::vector< std::shared_ptr< detail::exception_info_base > >&
-	infos( ) const;
+	/**
+	 * @returns all infos, in the order they were added.
+	 */
+	std::vector< const detail::exception_info_base* > infos( ) const;
 
 	template< typename T >
 	exception& operator<<( T&& t )
 	{
-		std::shared_ptr< detail::exception_info_base > ptr(
-			new detail::exception_info< T >(
-				std::forward< T >( t ) ) );
+		typedef typename std::decay< T >::type value_type;
+		typedef detail::exception_info< value_type > info_type;
+
+		static_assert(
+			std::alignment_of< info_type >::value <=
+				std::alignment_of< std::max_align_t >::value,
+			"exception info is over-aligned" );
 
-		add_info( std::move( ptr ) );
+		auto info = ::new ( reserve_info( sizeof( info_type ) ) )
+			info_type( std::forward< T >( t ) );
+
+		add_info( typeid( value_type ), info, sizeof( info_type ) );
 
 		return *this;
 	}
 
 private:
-	void add_info( std::shared_ptr< detail::exception_info_base >&& ptr );
-
-	std::vector< std::shared_ptr< detail::exception_info_base > >&
-	infos( );
-
-	struct pimpl;
-	std::unique_ptr< pimpl > pimpl_;
+	/**
+	 * @returns storage for an info of @c size bytes, in a block which is
+	 * not shared.
+	 */
+	void* reserve_info( std::size_t size );
+
+	/**
+	 * Adds @c info, constructed in the storage from reserve_info( ).
+	 */
+	void add_info(
+		const std::type_info& type,
+		detail::exception_info_base* info,
+		std::size_t size ) noexcept;
+
+	const detail::exception_info_base*
+	find_info( const std::type_info& type ) const;
+
+	detail::intrusive_ptr< detail::exception_info_block > infos_;
 };
 
 std::ostream& operator<<( std::ostream&, const exception& );
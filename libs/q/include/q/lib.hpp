@@ -20,6 +20,7 @@
 #include <q/scope.hpp>
 #include <q/functional.hpp>
 #include <q/exception.hpp>
+#include <q/stacktrace.hpp>
 
 #include <q/detail/lib.hpp>
 
@@ -95,6 +96,18 @@ public:
 	 * NOT IMPLEMENTED
 	 */
 	settings& set_long_stack_support( bool ) { return *this; }
+
+	/**
+	 * Sets how much of a stack trace is captured when a q::exception is
+	 * constructed, see stacktrace_capture.
+	 *
+	 * Defaults to stacktrace_capture::addresses.
+	 */
+	settings& set_stacktrace_capture( stacktrace_capture capture )
+	{
+		::q::set_stacktrace_capture( capture );
+		return *this;
+	}
 };
 
 void initialize( settings = settings( ) );
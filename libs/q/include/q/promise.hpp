@@ -24,6 +24,8 @@
 #include <q/exception.hpp>
 #include <q/expect.hpp>
 #include <q/memory.hpp>
+#include <q/cancellation.hpp>
+#include <q/timer.hpp>
 
 #include <q/promise/core.hpp>
 #include <q/promise/signal.hpp>
@@ -32,18 +34,17 @@
 #include <q/promise/defer.hpp>
 #include <q/promise/reject.hpp>
 #include <q/promise/with.hpp>
+#include <q/promise/delay.hpp>
 #include <q/promise/when.hpp>
 #include <q/promise/all.hpp>
+#include <q/promise/all_settled.hpp>
+#include <q/promise/race.hpp>
 #include <q/promise/promise_impl.hpp>
 
-#include <future>
 #include <memory>
 
 namespace q {
 
-// TODO: Get rid of std::promise <-> std::future as we manually encapsulate
-// data and exceptions in q::expect and signal manually too.
-
 	// TODO: Implement progress reporting
 	template< typename T >
 	class progress
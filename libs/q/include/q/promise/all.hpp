@@ -21,6 +21,9 @@
 #include <q/type_traits.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 
 namespace q {
 
@@ -55,318 +58,900 @@ static inline promise< std::tuple< > > all( )
 	return with( );
 }
 
-// TODO: Consider a different, less recursive, design
+namespace detail {
+
+template< bool Promises, typename... T >
+struct all_result
+{ };
+
+template< typename... Promises >
+struct all_result< true, Promises... >
+{
+	typedef promise<
+		typename merge_promise_arguments< Promises... >::tuple_type
+	> type;
+};
+
+/**
+ * Storage for a value which is constructed at most once, after the storage.
+ */
+template< typename T >
+class late_value
+{
+public:
+	late_value( )
+	: set_( false )
+	{ }
+
+	late_value( const late_value& ) = delete;
+	late_value& operator=( const late_value& ) = delete;
+
+	~late_value( )
+	{
+		if ( set_ )
+			get( ).~T( );
+	}
+
+	void set( T&& value )
+	{
+		::new ( &storage_ ) T( std::move( value ) );
+		set_ = true;
+	}
+
+	T& get( )
+	{
+		return *reinterpret_cast< T* >( &storage_ );
+	}
+
+private:
+	typename std::aligned_storage<
+		sizeof( T ), std::alignment_of< T >::value
+	>::type storage_;
+	bool set_;
+};
+
+template< std::size_t I, typename Elements, typename Outer, typename Inner >
+struct append_flat_indices;
+
+template<
+	std::size_t I,
+	std::size_t... Elements,
+	std::size_t... Outer,
+	std::size_t... Inner
+>
+struct append_flat_indices<
+	I,
+	index_tuple< Elements... >,
+	index_tuple< Outer... >,
+	index_tuple< Inner... >
+>
+{
+	typedef index_tuple< Outer..., ( I + 0 * Elements )... > outer;
+	typedef index_tuple< Inner..., Elements... > inner;
+};
+
+/**
+ * Lists, for every element of the tuples Tuples... when concatenated, the
+ * index of the tuple it belongs to (outer) and its index within that tuple
+ * (inner).
+ */
+template<
+	std::size_t I,
+	typename Outer,
+	typename Inner,
+	typename... Tuples
+>
+struct flat_indices
+{
+	typedef Outer outer;
+	typedef Inner inner;
+};
+
+template<
+	std::size_t I,
+	typename Outer,
+	typename Inner,
+	typename First,
+	typename... Rest
+>
+struct flat_indices< I, Outer, Inner, First, Rest... >
+{
+	typedef append_flat_indices<
+		I,
+		typename make_index_tuple< std::tuple_size< First >::value >::type,
+		Outer,
+		Inner
+	> appended;
+
+	typedef flat_indices<
+		I + 1,
+		typename appended::outer,
+		typename appended::inner,
+		Rest...
+	> next;
+
+	typedef typename next::outer outer;
+	typedef typename next::inner inner;
+};
+
+template< typename Result >
+struct all_defer
+{
+	typedef typename ::q::tuple_arguments< Result >
+		::template apply< defer >::type type;
+};
+
+/**
+ * The state of a variadic all( ): the result of every input, the number of
+ * inputs not yet settled, and the promise to resolve, which is the block
+ * itself, so that it's allocated once. The first input to be rejected
+ * rejects the promise, otherwise the last input to be fulfilled resolves it,
+ * by moving every input's values directly into the result.
+ */
+template< typename Result, typename... Tuples >
+class all_block
+: public embedded_defer< typename all_defer< Result >::type >
+{
+public:
+	typedef typename all_defer< Result >::type defer_type;
+	typedef intrusive_ptr< all_block >         pointer_type;
+
+	static pointer_type construct( )
+	{
+		return pointer_type( new all_block );
+	}
+
+	template< std::size_t I >
+	void settle(
+		expect< typename std::tuple_element<
+			I, std::tuple< Tuples... >
+		>::type >&& result )
+	{
+		if ( result.has_exception( ) )
+		{
+			if ( !failed_.exchange( true, std::memory_order_acq_rel ) )
+				this->set_exception( result.exception( ) );
+		}
+		else
+			std::get< I >( slots_ ).set( result.consume( ) );
+
+		if ( remaining_.fetch_sub( 1, std::memory_order_acq_rel ) == 1 &&
+			!failed_.load( std::memory_order_relaxed ) )
+		{
+			typedef flat_indices<
+				0, index_tuple< >, index_tuple< >, Tuples...
+			> indices;
+
+			resolve(
+				typename indices::outer( ),
+				typename indices::inner( ) );
+		}
+	}
+
+private:
+	all_block( )
+	: embedded_defer< defer_type >( &all_block::destroy )
+	, remaining_( sizeof...( Tuples ) )
+	, failed_( false )
+	{ }
+
+	static void destroy( embedded_defer< defer_type >* block )
+	{
+		delete static_cast< all_block* >( block );
+	}
+
+	template< std::size_t... Outer, std::size_t... Inner >
+	void resolve( index_tuple< Outer... >, index_tuple< Inner... > )
+	{
+		this->set_value( Result( std::move(
+			std::get< Inner >( std::get< Outer >( slots_ ).get( ) ) )... ) );
+	}
+
+	std::atomic< std::size_t > remaining_;
+	std::atomic< bool > failed_;
+	std::tuple< late_value< Tuples >... > slots_;
+};
+
+template< std::size_t I, typename Block >
+struct all_settler
+{
+	template< typename T >
+	void operator( )( expect< T >&& result )
+	{
+		block_->template settle< I >( std::move( result ) );
+	}
+
+	intrusive_ptr< Block > block_;
+};
+
+template< typename Block, std::size_t... I, typename... Promises >
+void settle_all(
+	const intrusive_ptr< Block >& block,
+	index_tuple< I... >,
+	Promises&&... promises )
+{
+	int expand[ ] = {
+		( promise_access::settle(
+			std::forward< Promises >( promises ),
+			all_settler< I, Block >{ block } ), 0 )...
+	};
+	( void )expand;
+}
+
+} // namespace detail
+
+/**
+ * Combines promises (of any types) into one promise of all their values, in
+ * order. If any of the promises is rejected, the returned promise is
+ * rejected with the first such exception.
+ */
 template< typename First, typename... Rest >
-typename std::enable_if<
+typename detail::all_result<
 	are_promises<
 		typename std::decay< First >::type,
 		typename std::decay< Rest >::type...
 	>::value,
-	promise<
-		typename merge_promise_arguments< First, Rest... >::tuple_type
-	>
+	First,
+	Rest...
 >::type
 all( First&& first, Rest&&... rest )
 {
-	auto when_rest = all( std::forward< Rest >( rest )... );
-	auto when_rest_tmp = Q_MOVE_TEMPORARILY_COPYABLE( when_rest );
-
-	typedef typename std::decay< First >::type::tuple_type
-		first_tuple_type;
-	typedef typename merge_promise_arguments< Rest... >::tuple_type
-		rest_tuple_type;
 	typedef typename merge_promise_arguments< First, Rest... >::tuple_type
 		full_tuple_type;
+	typedef detail::all_block<
+		full_tuple_type,
+		typename std::decay< First >::type::tuple_type,
+		typename std::decay< Rest >::type::tuple_type...
+	> block_type;
 
-	return first.then( [ when_rest_tmp ]( first_tuple_type&& data ) mutable
-	-> promise< full_tuple_type >
+	auto block = block_type::construct( );
+
+	detail::settle_all(
+		block,
+		typename make_index_tuple< 1 + sizeof...( Rest ) >::type( ),
+		std::forward< First >( first ),
+		std::forward< Rest >( rest )... );
+
+	return block->get_promise( );
+}
+
+namespace detail {
+
+/**
+ * How combinators of a std::vector of promises of @c Tuple return each
+ * element: tuples of two or more values as they are, a single value
+ * unwrapped, and no value as void.
+ */
+template<
+	typename Tuple,
+	std::size_t Size = std::tuple_size< Tuple >::value
+>
+struct all_vector_element
+{
+	typedef Tuple                      type;
+	typedef std::vector< type >        vector_type;
+	typedef std::tuple< vector_type >  result_type;
+
+	static expect< type > convert( expect< Tuple >&& value )
 	{
-		auto rest_promise = when_rest_tmp.consume( );
-		auto data_tmp = Q_MOVE_TEMPORARILY_COPYABLE( data );
+		return std::move( value );
+	}
 
-		auto failer = [ ]( std::exception_ptr&& e ) mutable
-		{
-			std::rethrow_exception( e );
-		};
+	template< typename Defer >
+	static void fulfill( Defer& deferred,
+	                     expect< type >* values,
+	                     std::size_t size )
+	{
+		vector_type result;
+		result.reserve( size );
 
-		auto completer = [ data_tmp ]
-		                 ( rest_tuple_type&& rest_data ) mutable
-		{
-			return std::tuple_cat(
-				data_tmp.consume( ),
-				std::move( rest_data ) );
-		};
+		for ( std::size_t i = 0; i < size; ++i )
+			result.push_back( values[ i ].consume( ) );
 
-		auto full_value = rest_promise.fail( failer ).then( completer );
+		deferred.set_value( std::move( result ) );
+	}
+};
 
-		return std::move( full_value );
-	} );
-}
+template< typename Tuple >
+struct all_vector_element< Tuple, 1 >
+: all_vector_element< typename std::tuple_element< 0, Tuple >::type, 2 >
+{
+	typedef typename std::tuple_element< 0, Tuple >::type type;
+
+	static expect< type > convert( expect< Tuple >&& value )
+	{
+		if ( value.has_exception( ) )
+			return expect< type >( value.exception( ) );
+		return expect< type >( std::get< 0 >( value.consume( ) ) );
+	}
+};
+
+template< typename Tuple >
+struct all_vector_element< Tuple, 0 >
+{
+	typedef void          type;
+	typedef std::tuple< > result_type;
+
+	static expect< void > convert( expect< Tuple >&& value )
+	{
+		if ( value.has_exception( ) )
+			return expect< void >( value.exception( ) );
+		return expect< void >( );
+	}
+
+	template< typename Defer >
+	static void fulfill( Defer& deferred, expect< void >*, std::size_t )
+	{
+		deferred.set_value( );
+	}
+};
 
 /**
- * Combines a std::vector of promises (of the same type) into one promise
- * which resolves to a std::vector of the combined result types, in order.
+ * The kinds of join_block, i.e. how a std::vector of promises is combined.
+ */
+struct join_all { };
+struct join_all_settled { };
+struct join_race { };
+struct join_any { };
+struct join_some { };
+
+template< typename Tuple, typename Kind >
+struct join_result
+{
+	typedef typename all_vector_element< Tuple >::result_type type;
+};
+
+template< typename Tuple >
+struct join_result< Tuple, join_all_settled >
+{
+	typedef std::tuple< std::vector< expect<
+		typename all_vector_element< Tuple >::type
+	> > > type;
+};
+
+template< typename Tuple >
+struct join_result< Tuple, join_race >
+{
+	typedef Tuple type;
+};
+
+template< typename Tuple >
+struct join_result< Tuple, join_any >
+{
+	typedef Tuple type;
+};
+
+/**
+ * The join block of a combinator of a std::vector of promises, allocated
+ * once with the per-element results stored after it.
  *
- * If the list of promises contain std::tuples with zero or one elements, the
- * resulting promise will be a promise of a std::vector of the values within
- * the tuples (or a promise without a value) wrapped in q::expect.
- * If the promises contain std::tuples with two or more elements, the
- * resulting promise will contain a list of std::tuples wrapped in q::expect.
+ * The elements not yet settled are counted per shard of elements, and the
+ * shards not yet settled are counted separately, so that elements settling
+ * at the same time on different threads mostly decrement different cache
+ * lines.
+ *
+ * The first-wins kinds (race, any and some) resolve through a latch, and
+ * then let go of the result, so that the losing elements only keep the
+ * block itself alive.
  */
-template< typename List >
-typename std::enable_if<
-	is_vector< List >::value &&
-	is_promise< typename std::decay< List >::type::value_type >::value &&
-	( std::tuple_size<
-		typename std::decay< List >::type::value_type::tuple_type
-	>::value >= 2 ),
-	promise<
-		std::tuple<
-			std::vector<
-				typename std::decay< List >::type::value_type::tuple_type
-			>
-		>
-	>
->::type
-all( List&& list )
+template< typename Tuple, typename Kind >
+class join_block
 {
-	typedef typename std::decay< List >::type          list_type;
-	typedef typename list_type::value_type::tuple_type element_type;
+public:
+	typedef all_vector_element< Tuple >                element;
+	typedef typename element::type                     element_type;
 	typedef expect< element_type >                     expect_type;
-	typedef std::vector< element_type >                return_type;
-	typedef std::vector< expect_type >                 expect_return_type;
 	typedef combined_promise_exception< element_type > exception_type;
+	typedef typename join_result< Tuple, Kind >::type  result_type;
+	typedef typename ::q::tuple_arguments< result_type >
+		::template apply< defer >::type                defer_type;
+
+	static const std::size_t shard_size = 64;
+
+	/**
+	 * Resolves @c deferred right away if @c size elements can't be joined
+	 * (e.g. none), in which case no block is needed.
+	 *
+	 * @returns whether @c deferred was resolved.
+	 */
+	static bool resolve_trivially(
+		defer_type& deferred, std::size_t size, std::size_t required )
+	{
+		return resolve_trivially( deferred, size, required, Kind( ) );
+	}
+
+	/**
+	 * Allocates a block for @c size elements, of which @c required must be
+	 * fulfilled for a join_some block. The block is owned by the caller, who
+	 * must release( ) it, and by the completion of all elements.
+	 */
+	static join_block* construct(
+		std::size_t size,
+		std::size_t required,
+		typename defer_type::pointer_type deferred )
+	{
+		const std::size_t shards = ( size + shard_size - 1 ) / shard_size;
+		const std::size_t count = value_count( size, Kind( ) );
+		const std::size_t bytes = allocation_size( shards, count );
 
-	auto deferred = detail::defer< return_type >::make( );
+		void* ptr = pool_allocate( bytes );
 
-	std::size_t num = list.size( );
-	auto expect_returns = std::make_shared< expect_return_type >( num );
-	auto counter = std::make_shared< std::atomic< std::size_t > >( num );
-	auto any_failure = std::make_shared< std::atomic< bool > >( false );
+		return ::new ( ptr ) join_block(
+			size, required, shards, count, std::move( deferred ) );
+	}
 
-	auto resolver = [ deferred, expect_returns, any_failure ]( )
+	join_block( const join_block& ) = delete;
+	join_block& operator=( const join_block& ) = delete;
+
+	void settle( std::size_t index, expect< Tuple >&& value )
 	{
-		if ( any_failure->load( std::memory_order_seq_cst ) )
-		{
-			// At least one element's promise failed
-			deferred->set_exception(
-				std::make_exception_ptr(
-					exception_type(
-						std::move( *expect_returns )
-					)
-				)
-			);
-		}
-		else
-		{
-			auto returns = return_type( expect_returns.size( ) );
-			std::transform(
-				expect_returns->begin( ),
-				expect_returns->end( ),
-				returns.begin( ),
-				[ ]( expect_type& data )
-				{
-					return std::move( data.consume( ) );
-				} );
-
-			deferred->set_value( std::move( returns ) );
-		}
-	};
+		settle( index, std::move( value ), Kind( ) );
 
-	auto part_completion = [ expect_returns, counter, resolver ]
-	                       ( std::size_t index, expect_type&& data ) mutable
+		complete( index );
+	}
+
+	/**
+	 * Completes an element whose promise was destroyed without being
+	 * resolved. A join_all or join_all_settled block is then never resolved.
+	 */
+	void abandon( std::size_t index )
+	{
+		abandoned_.store( true, std::memory_order_relaxed );
+
+		complete( index );
+	}
+
+	void release( )
 	{
-		expect_returns->at( index ) = std::move( data );
+		if ( refs_.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
 
-		auto prev = counter->fetch_sub( 1, std::memory_order_seq_cst );
+		const auto bytes = allocation_size( shards_, count_ );
 
-		if ( prev == 1 ) // Last element
-			resolver( );
+		this->~join_block( );
+		pool_deallocate( this, bytes );
+	}
+
+private:
+	static const std::size_t cache_line_size = 64;
+
+	// Each shard fills a cache line of its own, as the shards are placed at
+	// a cache line boundary
+	struct shard
+	{
+		std::atomic< std::size_t > remaining;
+		char padding[ cache_line_size - sizeof( std::atomic< std::size_t > ) ];
 	};
 
-	for ( std::size_t i = 0; i < num; ++i )
-		list[ i ]
-		.fail( [ i, part_completion, any_failure ]
-		       ( std::exception_ptr&& e ) mutable
-		{
-			any_failure->store( true, std::memory_order_seq_cst );
-			part_completion(
-				i,
-				refuse< element_type >( std::move( e ) ) );
-		} )
-		.then( [ i, part_completion ]
-		       ( element_type&& data ) mutable
+	static_assert(
+		std::alignment_of< expect_type >::value <= cache_line_size,
+		"the values must be aligned by the end of the shards" );
+
+	join_block( std::size_t size,
+	            std::size_t required,
+	            std::size_t shards,
+	            std::size_t count,
+	            typename defer_type::pointer_type&& deferred )
+	: refs_( 2 )
+	, remaining_shards_( shards )
+	, failed_( false )
+	, abandoned_( false )
+	, latched_( false )
+	, fulfilled_claimed_( 0 )
+	, fulfilled_( 0 )
+	, failures_claimed_( 0 )
+	, failures_( 0 )
+	, size_( size )
+	, required_( required )
+	, shards_( shards )
+	, count_( count )
+	, deferred_( std::move( deferred ) )
+	{
+		for ( std::size_t i = 0; i < shards; ++i )
 		{
-			part_completion(
-				i,
-				fulfill< element_type >( std::move( data ) ) );
-		} );
+			const std::size_t left = size - i * shard_size;
+			const std::size_t remaining =
+				left < shard_size ? left : shard_size;
+			::new ( &this->shards( )[ i ] ) shard( );
+			this->shards( )[ i ].remaining.store(
+				remaining, std::memory_order_relaxed );
+		}
 
-	return deferred->get_promise( );
-}
+		for ( std::size_t i = 0; i < count; ++i )
+			::new ( &values( )[ i ] ) expect_type( );
+	}
 
-template< typename List >
-typename std::enable_if<
-	is_vector< List >::value &&
-	is_promise< typename std::decay< List >::type::value_type >::value &&
-	std::tuple_size<
-		typename std::decay< List >::type::value_type::tuple_type
-	>::value == 1,
-	promise< std::tuple< std::vector<
-		typename std::tuple_element<
-			0,
-			typename std::decay<
-				List
-			>::type::value_type::tuple_type
-		>::type
-	> > >
->::type
-all( List&& list )
-{
-	typedef typename std::decay< List >::type                  list_type;
-	typedef typename list_type::value_type::tuple_type         tuple_type;
-	typedef typename std::tuple_element< 0, tuple_type >::type element_type;
-	typedef expect< element_type >                             expect_type;
-	typedef std::vector< element_type >                        return_type;
-	typedef std::vector< expect_type >                         expect_return_type;
-	typedef combined_promise_exception< element_type >         exception_type;
+	~join_block( )
+	{
+		for ( std::size_t i = 0; i < count_; ++i )
+			values( )[ i ].~expect_type( );
+	}
+
+	static std::size_t value_count( std::size_t size, join_all )
+	{
+		return size;
+	}
+
+	static std::size_t value_count( std::size_t size, join_all_settled )
+	{
+		return size;
+	}
+
+	static std::size_t value_count( std::size_t, join_race )
+	{
+		return 0;
+	}
+
+	static std::size_t value_count( std::size_t size, join_any )
+	{
+		return size;
+	}
+
+	// The first required fulfilled values, followed by the failures which
+	// make it impossible to fulfill as many
+	static std::size_t value_count( std::size_t size, join_some )
+	{
+		return size + 1;
+	}
+
+	/**
+	 * The block is only as aligned as the allocator makes it, so it's
+	 * allocated with room to move the shards up to a cache line boundary.
+	 */
+	static std::size_t allocation_size(
+		std::size_t shards, std::size_t count )
+	{
+		return sizeof( join_block ) + cache_line_size - 1 +
+			shards * sizeof( shard ) + count * sizeof( expect_type );
+	}
+
+	shard* shards( )
+	{
+		const auto end = reinterpret_cast< std::uintptr_t >( this ) +
+			sizeof( join_block );
+
+		return reinterpret_cast< shard* >(
+			( end + cache_line_size - 1 ) / cache_line_size *
+			cache_line_size );
+	}
+
+	expect_type* values( )
+	{
+		return reinterpret_cast< expect_type* >( shards( ) + shards_ );
+	}
+
+	std::vector< expect_type > take_values(
+		std::size_t first, std::size_t count )
+	{
+		std::vector< expect_type > results;
+		results.reserve( count );
+
+		for ( std::size_t i = first; i < first + count; ++i )
+			results.push_back( std::move( values( )[ i ] ) );
+
+		return results;
+	}
+
+	static void reject( defer_type& deferred,
+	                    std::vector< expect_type >&& results )
+	{
+		deferred.set_exception( std::make_exception_ptr(
+			exception_type( std::move( results ) ) ) );
+	}
+
+	static bool resolve_trivially(
+		defer_type& deferred, std::size_t size, std::size_t, join_all )
+	{
+		if ( size )
+			return false;
+
+		element::fulfill( deferred, nullptr, 0 );
+		return true;
+	}
+
+	static bool resolve_trivially(
+		defer_type& deferred,
+		std::size_t size,
+		std::size_t,
+		join_all_settled )
+	{
+		if ( size )
+			return false;
 
-	auto deferred = detail::defer< return_type >::make( );
+		deferred.set_value( std::vector< expect_type >( ) );
+		return true;
+	}
 
-	std::size_t num = list.size( );
-	auto expect_returns = std::make_shared< expect_return_type >( num );
-	auto counter = std::make_shared< std::atomic< std::size_t > >( num );
-	auto any_failure = std::make_shared< std::atomic< bool > >( false );
+	static bool resolve_trivially(
+		defer_type& deferred, std::size_t size, std::size_t, join_race )
+	{
+		if ( size )
+			return false;
+
+		reject( deferred, std::vector< expect_type >( ) );
+		return true;
+	}
+
+	static bool resolve_trivially(
+		defer_type& deferred, std::size_t size, std::size_t, join_any )
+	{
+		if ( size )
+			return false;
+
+		reject( deferred, std::vector< expect_type >( ) );
+		return true;
+	}
+
+	static bool resolve_trivially(
+		defer_type& deferred,
+		std::size_t size,
+		std::size_t required,
+		join_some )
+	{
+		if ( !required )
+			element::fulfill( deferred, nullptr, 0 );
+		else if ( required > size )
+			reject( deferred, std::vector< expect_type >( ) );
+		else
+			return false;
+
+		return true;
+	}
+
+	/**
+	 * @returns true for the one caller which gets to resolve the result.
+	 */
+	bool latch( )
+	{
+		return !latched_.load( std::memory_order_relaxed ) &&
+			!latched_.exchange( true, std::memory_order_acq_rel );
+	}
+
+	void settle( std::size_t index, expect< Tuple >&& value, join_all )
+	{
+		auto& slot = values( )[ index ];
+
+		slot = element::convert( std::move( value ) );
+
+		if ( slot.has_exception( ) )
+			failed_.store( true, std::memory_order_relaxed );
+	}
+
+	void settle( std::size_t index,
+	             expect< Tuple >&& value,
+	             join_all_settled )
+	{
+		values( )[ index ] = element::convert( std::move( value ) );
+	}
 
-	auto resolver = [ deferred, expect_returns, any_failure ]( )
+	void settle( std::size_t, expect< Tuple >&& value, join_race )
 	{
-		if ( any_failure->load( std::memory_order_seq_cst ) )
+		if ( !latch( ) )
+			return;
+
+		deferred_->set_expect( std::move( value ) );
+		deferred_ = nullptr;
+	}
+
+	void settle( std::size_t index, expect< Tuple >&& value, join_any )
+	{
+		if ( !value.has_exception( ) )
 		{
-			// At least one element's promise failed
-			deferred->set_exception(
-				std::make_exception_ptr(
-					exception_type(
-						std::move( *expect_returns )
-					)
-				)
-			);
+			if ( !latch( ) )
+				return;
+
+			deferred_->set_expect( std::move( value ) );
+			deferred_ = nullptr;
+			return;
 		}
-		else
+
+		values( )[ index ] = element::convert( std::move( value ) );
+
+		if ( failures_.fetch_add( 1, std::memory_order_acq_rel ) + 1 ==
+			size_ && latch( ) )
 		{
-			auto returns = return_type( expect_returns->size( ) );
-			std::transform(
-				expect_returns->begin( ),
-				expect_returns->end( ),
-				returns.begin( ),
-				[ ]( expect_type& data )
-				{
-					return std::move( data.consume( ) );
-				} );
-
-			deferred->set_value( std::move( returns ) );
+			reject( *deferred_, take_values( 0, size_ ) );
+			deferred_ = nullptr;
 		}
-	};
+	}
 
-	auto part_completion = [ expect_returns, counter, resolver ]
-	                       ( std::size_t index, expect_type&& data ) mutable
+	void settle( std::size_t, expect< Tuple >&& value, join_some )
 	{
-		expect_returns->at( index ) = std::move( data );
+		if ( !value.has_exception( ) )
+		{
+			auto claim = fulfilled_claimed_.fetch_add(
+				1, std::memory_order_relaxed );
 
-		auto prev = counter->fetch_sub( 1, std::memory_order_seq_cst );
+			if ( claim >= required_ )
+				return;
 
-		if ( prev == 1 ) // Last element
-			resolver( );
-	};
+			values( )[ claim ] = element::convert( std::move( value ) );
 
-	for ( std::size_t i = 0; i < num; ++i )
-		list[ i ]
-		.fail( [ i, part_completion, any_failure ]
-		       ( std::exception_ptr&& e ) mutable
-		{
-			any_failure->store( true, std::memory_order_seq_cst );
-			part_completion(
-				i,
-				refuse< element_type >( std::move( e ) ) );
-		} )
-		.then( [ i, part_completion ]
-		       ( element_type&& data ) mutable
-		{
-			part_completion(
-				i,
-				fulfill< element_type >( std::move( data ) ) );
-		} );
+			if ( fulfilled_.fetch_add( 1, std::memory_order_acq_rel ) + 1 ==
+				required_ && latch( ) )
+			{
+				element::fulfill( *deferred_, values( ), required_ );
+				deferred_ = nullptr;
+			}
 
-	return deferred->get_promise( );
-}
+			return;
+		}
 
-template< typename List >
-typename std::enable_if<
-	is_vector< List >::value &&
-	is_promise< typename std::decay< List >::type::value_type >::value &&
-	std::tuple_size<
-		typename std::decay< List >::type::value_type::tuple_type
-	>::value == 0,
-	promise< std::tuple< > >
->::type
-all( List&& list )
-{
-	typedef expect< void >                     expect_type;
-	typedef std::vector< expect_type >         expect_return_type;
-	typedef combined_promise_exception< void > exception_type;
+		const std::size_t fatal = size_ - required_ + 1;
 
-	auto deferred = ::q::make_shared< detail::defer< > >( );
+		auto claim = failures_claimed_.fetch_add(
+			1, std::memory_order_relaxed );
 
-	std::size_t num = list.size( );
-	auto expect_returns = std::make_shared< expect_return_type >( num );
-	auto counter = std::make_shared< std::atomic< std::size_t > >( num );
-	auto any_failure = std::make_shared< std::atomic< bool > >( false );
+		if ( claim >= fatal )
+			return;
 
-	auto resolver = [ deferred, expect_returns, any_failure ]( )
-	{
-		if ( any_failure->load( std::memory_order_seq_cst ) )
+		values( )[ required_ + claim ] =
+			element::convert( std::move( value ) );
+
+		if ( failures_.fetch_add( 1, std::memory_order_acq_rel ) + 1 ==
+			fatal && latch( ) )
 		{
-			// At least one element's promise failed
-			deferred->set_exception(
-				std::make_exception_ptr(
-					exception_type(
-						std::move( *expect_returns )
-					)
-				)
-			);
+			reject( *deferred_, take_values( required_, fatal ) );
+			deferred_ = nullptr;
 		}
+	}
+
+	void complete( std::size_t index )
+	{
+		auto& shard = shards( )[ index / shard_size ];
+
+		if ( shard.remaining.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
+
+		if ( remaining_shards_.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
+
+		if ( !abandoned_.load( std::memory_order_relaxed ) )
+			resolve( Kind( ) );
+
+		release( );
+	}
+
+	void resolve( join_all )
+	{
+		if ( failed_.load( std::memory_order_relaxed ) )
+			reject( *deferred_, take_values( 0, size_ ) );
 		else
-		{
-			deferred->set_value( );
-		}
-	};
+			element::fulfill( *deferred_, values( ), size_ );
+	}
 
-	auto part_completion = [ expect_returns, counter, resolver ]
-	                       ( std::size_t index, expect_type&& data ) mutable
+	void resolve( join_all_settled )
 	{
-		expect_returns->at( index ) = std::move( data );
+		deferred_->set_value( take_values( 0, size_ ) );
+	}
+
+	// The first-wins kinds are resolved when settled
+	template< typename FirstWins >
+	void resolve( FirstWins )
+	{ }
+
+	std::atomic< std::size_t > refs_;
+	std::atomic< std::size_t > remaining_shards_;
+	std::atomic< bool > failed_;
+	std::atomic< bool > abandoned_;
+	std::atomic< bool > latched_;
+	std::atomic< std::size_t > fulfilled_claimed_;
+	std::atomic< std::size_t > fulfilled_;
+	std::atomic< std::size_t > failures_claimed_;
+	std::atomic< std::size_t > failures_;
+	const std::size_t size_;
+	const std::size_t required_;
+	const std::size_t shards_;
+	const std::size_t count_;
+	typename defer_type::pointer_type deferred_;
+};
 
-		auto prev = counter->fetch_sub( 1, std::memory_order_seq_cst );
+/**
+ * The continuation of one element of a join_block. It owns a share of the
+ * block until it has run, or is destroyed without running.
+ */
+template< typename Tuple, typename Kind >
+class join_settler
+{
+public:
+	typedef join_block< Tuple, Kind > block_type;
 
-		if ( prev == 1 ) // Last element
-			resolver( );
-	};
+	join_settler( block_type* block, std::size_t index ) noexcept
+	: block_( block )
+	, index_( index )
+	{ }
 
-	for ( std::size_t i = 0; i < num; ++i )
-		list[ i ]
-		.fail( [ i, part_completion, any_failure ]
-		       ( std::exception_ptr&& e ) mutable
-		{
-			any_failure->store( true, std::memory_order_seq_cst );
-			part_completion( i, refuse< void >( std::move( e ) ) );
-		} )
-		.then( [ i, part_completion ]( ) mutable
-		{
-			part_completion( i, fulfill< void >( ) );
-		} );
+	join_settler( join_settler&& other ) noexcept
+	: block_( other.block_ )
+	, index_( other.index_ )
+	{
+		other.block_ = nullptr;
+	}
+
+	join_settler( const join_settler& ) = delete;
+	join_settler& operator=( const join_settler& ) = delete;
+
+	~join_settler( )
+	{
+		if ( block_ )
+			block_->abandon( index_ );
+	}
+
+	void operator( )( expect< Tuple >&& value )
+	{
+		auto block = block_;
+		block_ = nullptr;
+		block->settle( index_, std::move( value ) );
+	}
+
+private:
+	block_type* block_;
+	std::size_t index_;
+};
+
+template< typename List >
+struct join_list_tuple
+{
+	typedef typename std::decay< List >::type::value_type::tuple_type type;
+};
+
+/**
+ * Joins the promises in @c list as @c Kind.
+ */
+template< typename Kind, typename List >
+typename join_block<
+	typename join_list_tuple< List >::type, Kind
+>::defer_type::promise_type
+join_list( List& list, std::size_t required = 0 )
+{
+	typedef typename join_list_tuple< List >::type tuple_type;
+	typedef join_block< tuple_type, Kind >         block_type;
+	typedef join_settler< tuple_type, Kind >       settler_type;
+
+	auto deferred = block_type::defer_type::construct( );
+
+	if ( block_type::resolve_trivially( *deferred, list.size( ), required ) )
+		return deferred->get_promise( );
+
+	auto block = block_type::construct( list.size( ), required, deferred );
+
+	for ( std::size_t i = 0; i < list.size( ); ++i )
+		promise_access::settle( list[ i ], settler_type( block, i ) );
+
+	block->release( );
 
 	return deferred->get_promise( );
 }
 
+} // namespace detail
+
+/**
+ * Combines a std::vector of promises (of the same type) into one promise
+ * which resolves to a std::vector of the combined result types, in order.
+ *
+ * If the promises contain std::tuples with one element, the resulting
+ * promise is of a std::vector of the values within the tuples. If they
+ * contain std::tuples with two or more elements, the resulting promise is of
+ * a std::vector of the tuples. If they contain no values, neither does the
+ * resulting promise.
+ *
+ * If any of the promises is rejected, the resulting promise is rejected
+ * with a combined_promise_exception holding every result, once all promises
+ * are resolved.
+ */
+template< typename List >
+typename std::enable_if<
+	is_vector< typename std::decay< List >::type >::value &&
+	is_promise< typename std::decay< List >::type::value_type >::value,
+	promise< typename detail::all_vector_element<
+		typename std::decay< List >::type::value_type::tuple_type
+	>::result_type >
+>::type
+all( List&& list )
+{
+	return detail::join_list< detail::join_all >( list );
+}
+
 } // namespace q
 
 #endif // LIBQ_PROMISE_ALL_HPP
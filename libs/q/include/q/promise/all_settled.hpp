@@ -0,0 +1,163 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_PROMISE_ALL_SETTLED_HPP
+#define LIBQ_PROMISE_ALL_SETTLED_HPP
+
+#include <q/promise/all.hpp>
+
+namespace q {
+
+namespace detail {
+
+template< bool Promises, typename... T >
+struct all_settled_result
+{ };
+
+template< typename... Promises >
+struct all_settled_result< true, Promises... >
+{
+	typedef promise< std::tuple< expect< typename all_vector_element<
+		typename std::decay< Promises >::type::tuple_type
+	>::type >... > > type;
+};
+
+template< typename... Tuples >
+struct all_settled_results
+{
+	typedef std::tuple<
+		expect< typename all_vector_element< Tuples >::type >...
+	> type;
+};
+
+/**
+ * The state of a variadic all_settled( ): the result of every input and the
+ * number of inputs not yet settled, and the promise, which is the block
+ * itself. The last input to settle resolves the promise with all the
+ * results.
+ */
+template< typename... Tuples >
+class all_settled_block
+: public embedded_defer< typename all_defer< std::tuple<
+	typename all_settled_results< Tuples... >::type
+> >::type >
+{
+public:
+	typedef typename all_settled_results< Tuples... >::type result_type;
+	typedef typename all_defer< std::tuple< result_type > >::type defer_type;
+	typedef intrusive_ptr< all_settled_block >               pointer_type;
+
+	static pointer_type construct( )
+	{
+		return pointer_type( new all_settled_block );
+	}
+
+	template< std::size_t I >
+	void settle(
+		expect< typename std::tuple_element<
+			I, std::tuple< Tuples... >
+		>::type >&& result )
+	{
+		typedef all_vector_element< typename std::tuple_element<
+			I, std::tuple< Tuples... >
+		>::type > element;
+
+		std::get< I >( results_ ) = element::convert( std::move( result ) );
+
+		if ( remaining_.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+			this->set_value( std::move( results_ ) );
+	}
+
+private:
+	all_settled_block( )
+	: embedded_defer< defer_type >( &all_settled_block::destroy )
+	, remaining_( sizeof...( Tuples ) )
+	{ }
+
+	static void destroy( embedded_defer< defer_type >* block )
+	{
+		delete static_cast< all_settled_block* >( block );
+	}
+
+	std::atomic< std::size_t > remaining_;
+	result_type results_;
+};
+
+} // namespace detail
+
+/**
+ * Waits for all promises (of any types) to be resolved, and resolves to a
+ * std::tuple of their results, each wrapped in q::expect, in order. The
+ * returned promise is never rejected, and no exception is thrown or
+ * constructed to report the failed promises.
+ *
+ * Like with all( ) of a std::vector, a promise of one value results in an
+ * expect of that value, and a promise of no value in an expect< void >.
+ */
+template< typename First, typename... Rest >
+typename detail::all_settled_result<
+	are_promises<
+		typename std::decay< First >::type,
+		typename std::decay< Rest >::type...
+	>::value,
+	First,
+	Rest...
+>::type
+all_settled( First&& first, Rest&&... rest )
+{
+	typedef detail::all_settled_block<
+		typename std::decay< First >::type::tuple_type,
+		typename std::decay< Rest >::type::tuple_type...
+	> block_type;
+
+	auto block = block_type::construct( );
+
+	detail::settle_all(
+		block,
+		typename make_index_tuple< 1 + sizeof...( Rest ) >::type( ),
+		std::forward< First >( first ),
+		std::forward< Rest >( rest )... );
+
+	return block->get_promise( );
+}
+
+/**
+ * Waits for all promises in a std::vector (of the same type) to be
+ * resolved, and resolves to a std::vector of their results, each wrapped in
+ * q::expect, in order. The returned promise is never rejected, and no
+ * exception is thrown or constructed to report the failed promises.
+ *
+ * Each promise costs as much as with all( ). Only the cost of rejecting the
+ * combined promise is saved, which matters less the more promises there are.
+ */
+template< typename List >
+typename std::enable_if<
+	is_vector< typename std::decay< List >::type >::value &&
+	is_promise< typename std::decay< List >::type::value_type >::value,
+	promise< std::tuple< std::vector< expect< typename
+		detail::all_vector_element<
+			typename std::decay< List >::type::value_type::tuple_type
+		>::type
+	> > > >
+>::type
+all_settled( List&& list )
+{
+	return detail::join_list< detail::join_all_settled >( list );
+}
+
+} // namespace q
+
+#endif // LIBQ_PROMISE_ALL_SETTLED_HPP
@@ -27,7 +27,13 @@ class promise;
 template< typename T >
 class shared_promise;
 
-namespace detail { template< bool, typename > class generic_promise; }
+namespace detail {
+
+template< bool, typename > class generic_promise;
+
+struct promise_access;
+
+} // namespace detail
 
 template< class T >
 struct is_promise
@@ -62,7 +68,7 @@ struct are_promises
 
 // TODO: Make this exception actually chain the original exception that was thrown..
 class broken_promise_exception
-: exception
+: public exception
 {
 public:
 	broken_promise_exception( ) = delete;
@@ -73,7 +79,7 @@ public:
 };
 
 class generic_combined_promise_exception
-: exception
+: public exception
 {
 public:
 	generic_combined_promise_exception( ) = default;
@@ -95,7 +101,7 @@ private:
 
 template< typename T >
 class combined_promise_exception
-: generic_combined_promise_exception
+: public generic_combined_promise_exception
 {
 public:
 	typedef std::vector< expect< T > > exception_type;
@@ -21,17 +21,23 @@ namespace q {
 
 namespace detail {
 
+/**
+ * The resolving side of a promise. A defer is the shared state of the promise
+ * it resolves, so constructing one is the only allocation needed for a new
+ * promise.
+ */
 template< typename... T >
 class defer
-: public std::enable_shared_from_this< defer< T... > >
+: public promise_state_data< std::tuple< T... > >
 {
 public:
-	typedef std::tuple< T... >                              tuple_type;
-	typedef expect< tuple_type >                            expect_type;
-	typedef detail::promise_state_data< tuple_type, false > state_data_type;
-	typedef detail::promise_state< tuple_type, false >      state_type;
-	typedef promise< tuple_type >                           promise_type;
-	typedef shared_promise< tuple_type >                    shared_promise_type;
+	typedef std::tuple< T... >                        tuple_type;
+	typedef expect< tuple_type >                      expect_type;
+	typedef detail::promise_state_data< tuple_type >  state_data_type;
+	typedef intrusive_ptr< state_data_type >          state_data_ptr;
+	typedef intrusive_ptr< defer< T... > >            pointer_type;
+	typedef promise< tuple_type >                     promise_type;
+	typedef shared_promise< tuple_type >              shared_promise_type;
 
 	void set_expect( expect_type&& exp )
 	{
@@ -43,16 +49,12 @@ public:
 
 	inline void set_value( tuple_type&& tuple )
 	{
-		auto value = ::q::fulfill< tuple_type >( std::move( tuple ) );
-		promise_.set_value( std::move( value ) );
-		signal_->done( );
+		this->resolve( ::q::fulfill< tuple_type >( std::move( tuple ) ) );
 	}
 
 	inline void set_value( const tuple_type& tuple )
 	{
-		auto value = ::q::fulfill< tuple_type >( tuple );
-		promise_.set_value( std::move( value ) );
-		signal_->done( );
+		this->resolve( ::q::fulfill< tuple_type >( tuple ) );
 	}
 
 	template< typename... Args >
@@ -69,8 +71,7 @@ public:
 
 	void set_exception( const std::exception_ptr& e )
 	{
-		promise_.set_value( ::q::refuse< tuple_type >( e ) );
-		signal_->done( );
+		this->resolve( ::q::refuse< tuple_type >( e ) );
 	}
 
 	/**
@@ -258,7 +259,10 @@ public:
 
 	void satisfy( promise_type&& promise )
 	{
-		auto _this = this->shared_from_this( );
+		if ( this->cancellation( ) )
+			return satisfy_cancellably( std::move( promise ) );
+
+		auto _this = pointer_type( this );
 
 		promise
 		.fail( [ _this ]( std::exception_ptr&& e )
@@ -279,7 +283,10 @@ public:
 
 	void satisfy( shared_promise_type promise )
 	{
-		auto _this = this->shared_from_this( );
+		if ( this->cancellation( ) )
+			return satisfy_cancellably( std::move( promise ) );
+
+		auto _this = pointer_type( this );
 
 		promise
 		.fail( [ _this ]( std::exception_ptr&& e )
@@ -300,10 +307,13 @@ public:
 	 }
 	 */
 
-	// Moves the promise out of the defer
+	/**
+	 * Returns the promise resolved by this defer. This must only be called
+	 * once, as the promise is unique.
+	 */
 	promise_type get_promise( )
 	{
-		return std::move( deferred_ );
+		return promise_type( state_data_ptr( this ) );
 	}
 
 	template< typename Promise >
@@ -335,42 +345,56 @@ public:
 		return get_promise( );
 	}
 
-	static std::shared_ptr< defer< T... > > construct( )
+	static pointer_type construct( )
 	{
-		typedef typename state_data_type::future_type future_type;
+		return pointer_type( new defer< T... > );
+	}
 
-		std::promise< expect_type > std_promise;
-		future_type future = std_promise.get_future( );
+protected:
+	defer( ) = default;
 
-		state_data_type state_data( std::move( future ) );
-		state_type state( std::move( state_data ) );
+private:
+	typedef cancellable_resolver< pointer_type > resolver_type;
 
-		auto signal = state.signal( );
+	/**
+	 * Like satisfy( ), but gives up waiting for @c promise if this
+	 * promise's chain is cancelled first.
+	 */
+	void satisfy_cancellably( promise_type&& promise )
+	{
+		auto resolver = std::make_shared< resolver_type >(
+			pointer_type( this ) );
 
-		promise_type q_promise( std::move( state ) );
+		promise
+		.fail( [ resolver ]( std::exception_ptr&& e )
+		{
+			resolver->set_exception( std::move( e ) );
+		} )
+		.then( [ resolver ]( tuple_type&& tuple )
+		{
+			resolver->set_value( std::move( tuple ) );
+		} );
 
-		return ::q::make_shared_using_constructor< defer< T... > >(
-			std::move( std_promise ),
-			std::move( signal ),
-			std::move( q_promise ) );
+		cancellation_access::add_hook( this->cancellation( ), resolver );
+	}
+
+	void satisfy_cancellably( shared_promise_type promise )
+	{
+		auto resolver = std::make_shared< resolver_type >(
+			pointer_type( this ) );
+
+		promise
+		.fail( [ resolver ]( std::exception_ptr&& e )
+		{
+			resolver->set_exception( std::move( e ) );
+		} )
+		.then( [ resolver ]( const tuple_type& tuple )
+		{
+			resolver->set_value( tuple );
+		} );
+
+		cancellation_access::add_hook( this->cancellation( ), resolver );
 	}
-	
-protected:
-	defer( ) = delete;
-	
-	defer( std::promise< expect_type >&& promise,
-	       promise_signal_ptr&& signal,
-	       promise_type&& deferred )
-	: promise_( std::move( promise ) )
-	, signal_( std::move( signal ) )
-	, deferred_( std::move( deferred ) )
-	{ }
-	
-private:
-	std::promise< expect_type > promise_;
-	promise_signal_ptr          signal_;
-	
-	promise_type                deferred_;
 };
 
 template< typename... T >
@@ -378,6 +402,36 @@ class defer< std::tuple< T... > >
 : public defer< T... >
 { };
 
+/**
+ * A defer as the base class of a larger object, such as the block of a
+ * combinator, so that the object and the promise it resolves are allocated
+ * together. The object is destroyed by @c destroy, which must delete it as
+ * its most derived type, when the last reference to the state is released.
+ */
+template< typename Defer >
+class embedded_defer
+: public Defer
+{
+public:
+	typedef void ( *destroy_type )( embedded_defer* );
+
+	static void destroy( Defer* defer )
+	{
+		auto self = static_cast< embedded_defer* >( defer );
+		self->destroy_( self );
+	}
+
+protected:
+	embedded_defer( destroy_type destroy )
+	: destroy_( destroy )
+	{
+		this->set_embedded( );
+	}
+
+private:
+	destroy_type destroy_;
+};
+
 } // namespace detail
 
 } // namespace q
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_PROMISE_DELAY_HPP
+#define LIBQ_PROMISE_DELAY_HPP
+
+#include <q/timer.hpp>
+
+namespace q {
+
+/**
+ * @returns a promise which is resolved on @c queue once @c duration has
+ * passed, using @c timer.
+ *
+ * Unlike sleeping within a task, this doesn't block any thread. If
+ * @c timer is terminated first, the promise is rejected with a
+ * timer_terminated_exception.
+ */
+inline promise< std::tuple< > >
+delay( const timer_ptr& timer,
+       timer::duration duration,
+       const queue_ptr& queue = default_queue( ) )
+{
+	auto deferred = detail::defer< >::construct( );
+	deferred->set_producer( queue );
+
+	timer->schedule( duration, [ deferred ]( )
+	{
+		deferred->set_value( );
+	}, [ deferred ]( std::exception_ptr e )
+	{
+		deferred->set_exception( std::move( e ) );
+	}, queue );
+
+	return deferred->get_promise( );
+}
+
+/**
+ * Like delay( timer, duration, queue ), using the default timer.
+ */
+inline promise< std::tuple< > >
+delay( timer::duration duration, const queue_ptr& queue = default_queue( ) )
+{
+	return delay( default_timer( ), duration, queue );
+}
+
+} // namespace q
+
+#endif // LIBQ_PROMISE_DELAY_HPP
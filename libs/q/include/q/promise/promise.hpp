@@ -47,7 +47,7 @@ public:
 	{ };
 
 	generic_promise( state_type&& state )
-	: state_( ::q::make_shared< state_type >( std::move( state ) ) )
+	: state_( std::move( state ) )
 	{ }
 
 	generic_promise( this_type&& ref ) = default;
@@ -132,13 +132,6 @@ public:
 	>::type
 	then( Fn&& fn, queue_ptr queue = default_queue( ) );
 
-	template< typename Logger >
-	typename std::enable_if<
-		is_same_type< Logger, log_chain_generator >::value,
-		this_type
-	>::type
-	then( Logger&& logger, queue_ptr queue = default_queue( ) );
-
 	/**
 	 * Matches an exception as a raw std::exception_ptr
 	 */
@@ -226,6 +219,27 @@ public:
 	>::type
 	finally( Fn&& fn, queue_ptr queue = default_queue( ) );
 
+	/**
+	 * Attaches @c token to the chain from this promise onwards. Once it is
+	 * cancelled, then() functions of this and derived promises are no
+	 * longer run, but their promises are rejected with a
+	 * cancelled_exception. fail() and finally() functions are still run.
+	 *
+	 * Cancelling also rejects the returned promise right away if this one
+	 * isn't yet resolved, so that the chain doesn't wait for it.
+	 */
+	unique_this_type with_cancellation( const cancellation_token& token );
+
+	/**
+	 * @returns a promise resolved like this one, unless this one isn't
+	 * resolved within @c duration, in which case it's rejected with a
+	 * timeout_exception on @c queue. The timer is cancelled as soon as
+	 * this promise is resolved. If the default timer is terminated first,
+	 * it's rejected with a timer_terminated_exception.
+	 */
+	unique_this_type timeout( timer::duration duration,
+	                          queue_ptr queue = default_queue( ) );
+
 	void done( )
 	{
 		// TODO: Implement
@@ -234,8 +248,9 @@ public:
 private:
 	friend class ::q::promise< tuple_type >;
 	friend class ::q::shared_promise< tuple_type >;
+	friend struct ::q::detail::promise_access;
 
-	std::shared_ptr< state_type > state_;
+	state_type state_;
 };
 
 } // namespace detail
@@ -254,6 +269,10 @@ public:
 	: base_type( std::move( state ) )
 	{ }
 
+	promise( typename base_type::state_type::data_ptr data )
+	: base_type( typename base_type::state_type( std::move( data ) ) )
+	{ }
+
 	promise( ) = delete;
 	promise( this_type&& ) = default;
 	promise( const this_type& ) = delete;
@@ -267,7 +286,7 @@ public:
 	>::type
 	share( )
 	{
-		return shared_promise< T >( base_type::state_->acquire( ) );
+		return shared_promise< T >( base_type::state_.acquire( ) );
 	}
 };
 
@@ -283,8 +302,8 @@ public:
 	: base_type( std::move( state ) )
 	{ }
 
-	shared_promise( detail::promise_state_data< T, false >&& state )
-	: base_type( std::move( state ) )
+	shared_promise( typename base_type::state_type::data_ptr data )
+	: base_type( typename base_type::state_type( std::move( data ) ) )
 	{ }
 
 	shared_promise( ) = delete;
@@ -295,10 +314,53 @@ public:
 
 	promise< T > unshare( ) noexcept // TODO: analyze noexcept here
 	{
-		return promise< T >( base_type::state_->acquire( ) );
+		return promise< T >( base_type::state_.acquire( ) );
 	}
 };
 
+namespace detail {
+
+/**
+ * Gives promise combinators (such as all( )) access to a promise's state, so
+ * that they can wait for it without creating a new promise per input.
+ */
+struct promise_access
+{
+	/**
+	 * Calls @c fn with the result of @c promise, as an expect< tuple_type >,
+	 * when the promise is resolved. @c fn is run synchronously by the thread
+	 * resolving the promise (or by this thread, if it already is), so it
+	 * must be short and thread safe, but takes no queue slot.
+	 */
+	template< typename Promise, typename Fn >
+	static void settle( Promise&& promise, Fn&& fn )
+	{
+		typedef typename std::decay< Promise >::type::state_type state_type;
+		typedef typename std::decay< Fn >::type fn_type;
+
+		// The state is only referenced weakly, as it is alive whenever the
+		// runner is run, so that a promise which is never resolved frees
+		// its continuation (and fn).
+		struct runner
+		{
+			void operator( )( )
+			{
+				fn_( state_type::consume( *data_ ) );
+			}
+
+			typename state_type::data_type* data_;
+			fn_type fn_;
+		};
+
+		auto& state = promise.state_;
+
+		state.signal( ).push(
+			runner{ state.get( ), std::forward< Fn >( fn ) }, nullptr );
+	}
+};
+
+} // namespace detail
+
 } // namespace q
 
 #endif // LIBQ_PROMISE_PROMISE_HPP
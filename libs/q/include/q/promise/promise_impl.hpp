@@ -19,6 +19,168 @@
 
 namespace q { namespace detail {
 
+/**
+ * The tasks scheduled when a promise is resolved. These are function objects
+ * rather than lambdas, as C++11 lambdas can't take ownership of move-only
+ * functions, and q::task doesn't need them to be copyable.
+ */
+template< typename Deferred, typename Fn, typename State >
+struct set_by_fun_task
+{
+	Deferred deferred_;
+	Fn fn_;
+	State state_;
+
+	void operator( )( )
+	{
+		auto value = state_.consume( );
+		if ( value.has_exception( ) )
+			// Redirect exception
+			deferred_->set_exception( value.exception( ) );
+		else if ( state_.is_cancelled( ) )
+			deferred_->set_exception( cancelled_exception_ptr( ) );
+		else
+			deferred_->set_by_fun( std::move( fn_ ), value.consume( ) );
+	}
+};
+
+template< typename Deferred, typename Fn, typename State >
+struct satisfy_by_fun_task
+{
+	Deferred deferred_;
+	Fn fn_;
+	State state_;
+
+	void operator( )( )
+	{
+		auto value = state_.consume( );
+		if ( value.has_exception( ) )
+			// Redirect exception
+			deferred_->set_exception( value.exception( ) );
+		else if ( state_.is_cancelled( ) )
+			deferred_->set_exception( cancelled_exception_ptr( ) );
+		else
+			deferred_->satisfy_by_fun(
+				std::move( fn_ ), value.consume( ) );
+	}
+};
+
+template< typename Deferred, typename Fn, typename State >
+struct fail_task
+{
+	Deferred deferred_;
+	Fn fn_;
+	State state_;
+
+	void operator( )( )
+	{
+		auto value = state_.consume( );
+		if ( value.has_exception( ) )
+		{
+			// Redirect exception
+			try
+			{
+				fn_( value.exception( ) );
+			}
+			catch ( ... )
+			{
+				deferred_->set_exception( std::current_exception( ) );
+				return;
+			}
+			// TODO: Set special value to the state, to let the chain
+			// continue without running any handlers.
+		}
+		else
+		{
+			// Forward data
+			deferred_->set_value( value.consume( ) );
+		}
+	}
+};
+
+template< typename Deferred, typename Fn, typename State >
+struct fail_satisfy_task
+{
+	Deferred deferred_;
+	Fn fn_;
+	State state_;
+
+	void operator( )( )
+	{
+		auto value = state_.consume( );
+		if ( value.has_exception( ) )
+		{
+			// Redirect exception
+			deferred_->satisfy_by_fun(
+				std::move( fn_ ),
+				value.exception( )
+			);
+		}
+		else
+		{
+			// Forward data
+			deferred_->set_value( value.consume( ) );
+		}
+	}
+};
+
+template< typename Deferred, typename Fn, typename State >
+struct finally_task
+{
+	Deferred deferred_;
+	Fn fn_;
+	State state_;
+
+	void operator( )( )
+	{
+		fn_( );
+
+		auto value = state_.consume( );
+		deferred_->set_expect( std::move( value ) );
+	}
+};
+
+/**
+ * The race between a promise being resolved and its timeout expiring, of
+ * which only the first must resolve the deferred.
+ */
+template< typename Deferred >
+struct timeout_race
+{
+	timeout_race( Deferred deferred, const timer_ptr& timer )
+	: deferred_( std::move( deferred ) )
+	, timer_( timer )
+	, settled_( false )
+	{ }
+
+	bool claim( )
+	{
+		return !settled_.exchange( true, std::memory_order_acq_rel );
+	}
+
+	Deferred deferred_;
+	// Weak, as the timer holds the race until it expires
+	std::weak_ptr< timer > timer_;
+	timer::handle handle_;
+	std::atomic< bool > settled_;
+};
+
+template<
+	template< typename, typename, typename > class Task,
+	typename Deferred,
+	typename Fn,
+	typename State
+>
+Task< Deferred, typename std::decay< Fn >::type, State >
+make_continuation( Deferred deferred, Fn&& fn, State state )
+{
+	return Task< Deferred, typename std::decay< Fn >::type, State >{
+		std::move( deferred ),
+		std::forward< Fn >( fn ),
+		std::move( state )
+	};
+}
+
 /**
  * ( ... ) -> value
  */
@@ -39,20 +201,15 @@ then( Fn&& fn, queue_ptr queue )
 {
 	typedef Q_RESULT_OF_AS_TUPLE_TYPE( Fn ) return_tuple_type;
 	auto deferred = detail::defer< return_tuple_type >::construct( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
-
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
-	{
-		auto value = state->consume( );
-		if ( value.has_exception( ) )
-			// Redirect exception
-	 		deferred->set_exception( value.exception( ) );
-	 	else
-			deferred->set_by_fun( tmp_fn.consume( ), value.consume( ) );
-	};
+	deferred->set_cancellation( state_.cancellation( ) );
+	deferred->set_producer( queue );
 
-	state_->signal( )->push( std::move( perform ), queue );
+	state_.signal( ).push(
+		make_continuation< set_by_fun_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ),
+		true );
 
 	return std::move( deferred->get_promise( ) );
 }
@@ -87,20 +244,15 @@ then( Fn&& fn, queue_ptr queue )
 {
 	typedef Q_RESULT_OF_AS_TUPLE_TYPE( Fn ) return_tuple_type;
 	auto deferred = detail::defer< return_tuple_type >::construct( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
+	deferred->set_cancellation( state_.cancellation( ) );
+	deferred->set_producer( queue );
 
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
-	{
-		auto value = state->consume( );
-		if ( value.has_exception( ) )
-			// Redirect exception
-	 		deferred->set_exception( value.exception( ) );
-	 	else
-			deferred->set_by_fun( tmp_fn.consume( ), value.consume( ) );
-	};
-
-	state_->signal( )->push( std::move( perform ), queue );
+	state_.signal( ).push(
+		make_continuation< set_by_fun_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ),
+		true );
 
 	return std::move( deferred->get_promise( ) );
 }
@@ -125,20 +277,14 @@ then( Fn&& fn, queue_ptr queue )
 {
 	typedef Q_RESULT_OF( Fn )::tuple_type return_tuple_type;
 	auto deferred = detail::defer< return_tuple_type >::construct( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
-
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
-	{
-		auto value = state->consume( );
-		if ( value.has_exception( ) )
-			// Redirect exception
-	 		deferred->set_exception( value.exception( ) );
-	 	else
-			deferred->satisfy_by_fun( tmp_fn.consume( ), value.consume( ) );
-	};
+	deferred->set_cancellation( state_.cancellation( ) );
 
-	state_->signal( )->push( std::move( perform ), queue );
+	state_.signal( ).push(
+		make_continuation< satisfy_by_fun_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ),
+		true );
 
 	return std::move( deferred->get_promise( ) );
 }
@@ -164,48 +310,18 @@ then( Fn&& fn, queue_ptr queue )
 {
 	typedef Q_RESULT_OF( Fn )::tuple_type return_tuple_type;
 	auto deferred = detail::defer< return_tuple_type >::construct( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
+	deferred->set_cancellation( state_.cancellation( ) );
 
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
-	{
-		auto value = state->consume( );
-		if ( value.has_exception( ) )
-			// Redirect exception
-	 		deferred->set_exception( value.exception( ) );
-	 	else
-			deferred->satisfy_by_fun( tmp_fn.consume( ), value.consume( ) );
-	};
-
-	state_->signal( )->push( std::move( perform ), queue );
+	state_.signal( ).push(
+		make_continuation< satisfy_by_fun_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ),
+		true );
 
 	return std::move( deferred->get_promise( ) );
 }
 
-template< bool Shared, typename... Args >
-template< typename Logger >
-inline typename std::enable_if<
-	is_same_type< Logger, log_chain_generator >::value,
-	typename generic_promise< Shared, std::tuple< Args... > >::this_type
->::type
-generic_promise< Shared, std::tuple< Args... > >::
-then( Logger&& logger, queue_ptr queue )
-{
-	auto tmp_logger = Q_TEMPORARILY_COPYABLE( logger );
-
-	auto fn = [ tmp_logger ]( tuple_type args ) -> void
-	{
-		call_with_args_by_tuple( tmp_logger.consume( ), args );
-	};
-	std::packaged_task< void( void ) > task; // REDO
-
-	auto future = task.get_future( );
-
-	// queue->push( fn );
-
-	return this_type( std::move( future ) );
-}
-
 /**
  * Matches an exception as a raw std::exception_ptr
  */
@@ -225,35 +341,14 @@ generic_promise< Shared, std::tuple< Args... > >::
 fail( Fn&& fn, queue_ptr queue )
 {
 	auto deferred = detail::defer< Args... >::construct( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
+	deferred->set_cancellation( state_.cancellation( ) );
+	deferred->set_producer( queue );
 
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
-	{
-		auto value = state->consume( );
-		if ( value.has_exception( ) )
-		{
-			// Redirect exception
-			try
-			{
-				tmp_fn.consume( )( value.exception( ) );
-			}
-			catch ( ... )
-			{
-				deferred->set_exception( std::current_exception( ) );
-				return;
-			}
-			// TODO: Set special value to the state, to let the chain continue
-			// without running any handlers.
-		}
-		else
-		{
-			// Forward data
-			deferred->set_value( value.consume( ) );
-		}
-	};
-
-	state_->signal( )->push( std::move( perform ), queue );
+	state_.signal( ).push(
+		make_continuation< fail_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ) );
 
 	return deferred->get_promise( );
 }
@@ -276,28 +371,13 @@ fail( Fn&& fn, queue_ptr queue )
 {
 //	typedef Q_RESULT_OF( Fn )::tuple_type tuple_type;
 	auto deferred = detail::defer< tuple_type >::construct( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
-
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
-	{
-		auto value = state->consume( );
-		if ( value.has_exception( ) )
-		{
-			// Redirect exception
-			deferred->satisfy_by_fun(
-				tmp_fn.consume( ),
-				value.exception( )
-			);
-		}
-		else
-		{
-			// Forward data
-			deferred->set_value( value.consume( ) );
-		}
-	};
+	deferred->set_cancellation( state_.cancellation( ) );
 
-	state_->signal( )->push( std::move( perform ), queue );
+	state_.signal( ).push(
+		make_continuation< fail_satisfy_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ) );
 
 	return deferred->template get_suitable_promise< Q_RESULT_OF( Fn ) >( );
 }
@@ -314,19 +394,80 @@ typename std::enable_if<
 generic_promise< Shared, std::tuple< Args... > >::
 finally( Fn&& fn, queue_ptr queue )
 {
-	auto deferred = ::q::make_shared< detail::defer< Args... > >( );
-	auto tmp_fn = Q_TEMPORARILY_COPYABLE( fn );
-	auto state = state_;
+	auto deferred = detail::defer< Args... >::construct( );
+	deferred->set_cancellation( state_.cancellation( ) );
+	deferred->set_producer( queue );
+
+	state_.signal( ).push(
+		make_continuation< finally_task >(
+			deferred, std::forward< Fn >( fn ), state_ ),
+		queue,
+		state_.fuses_with( queue ) );
+
+	return deferred->get_promise( );
+}
+
+template< bool Shared, typename... Args >
+typename generic_promise< Shared, std::tuple< Args... > >::unique_this_type
+generic_promise< Shared, std::tuple< Args... > >::
+with_cancellation( const cancellation_token& token )
+{
+	auto deferred = detail::defer< Args... >::construct( );
+	deferred->set_cancellation( token );
 
-	auto perform = [ deferred, tmp_fn, state ]( ) mutable
+	auto promise = deferred->get_promise( );
+
+	typedef cancellable_resolver< decltype( deferred ) > resolver_type;
+
+	auto resolver = std::make_shared< resolver_type >( std::move( deferred ) );
+
+	// Forwarded synchronously by whichever thread resolves this promise,
+	// unless the chain is cancelled first
+	promise_access::settle( *this, [ resolver ]( expect< tuple_type >&& value )
 	{
-		tmp_fn.consume( )( );
+		resolver->set_expect( std::move( value ) );
+	} );
 
-		auto value = state->consume( );
-		deferred->set_expect( std::move( value ) );
-	};
+	cancellation_access::add_hook( token, resolver );
+
+	return promise;
+}
+
+template< bool Shared, typename... Args >
+typename generic_promise< Shared, std::tuple< Args... > >::unique_this_type
+generic_promise< Shared, std::tuple< Args... > >::
+timeout( timer::duration duration, queue_ptr queue )
+{
+	auto deferred = detail::defer< Args... >::construct( );
+	deferred->set_cancellation( state_.cancellation( ) );
+
+	typedef timeout_race< decltype( deferred ) > race_type;
+
+	auto timer = default_timer( );
+	auto race = std::make_shared< race_type >( deferred, timer );
+
+	race->handle_ = timer->schedule( duration, [ race ]( )
+	{
+		if ( race->claim( ) )
+			race->deferred_->set_exception(
+				std::make_exception_ptr( timeout_exception( ) ) );
+	}, [ race ]( std::exception_ptr e )
+	{
+		// The timeout can't be enforced without a timer
+		if ( race->claim( ) )
+			race->deferred_->set_exception( std::move( e ) );
+	}, queue );
+
+	promise_access::settle( *this, [ race ]( expect< tuple_type >&& value )
+	{
+		if ( !race->claim( ) )
+			return;
+
+		if ( auto timer = race->timer_.lock( ) )
+			timer->cancel( race->handle_ );
 
-	state_->signal( )->push( std::move( perform ), queue );
+		race->deferred_->set_expect( std::move( value ) );
+	} );
 
 	return deferred->get_promise( );
 }
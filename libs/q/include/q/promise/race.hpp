@@ -0,0 +1,189 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_PROMISE_RACE_HPP
+#define LIBQ_PROMISE_RACE_HPP
+
+#include <q/promise/all.hpp>
+
+namespace q {
+
+namespace detail {
+
+template< typename First, typename... Rest >
+struct same_tuple_types
+: std::true_type
+{ };
+
+template< typename First, typename Second, typename... Rest >
+struct same_tuple_types< First, Second, Rest... >
+: bool_type<
+	std::is_same<
+		typename std::decay< First >::type::tuple_type,
+		typename std::decay< Second >::type::tuple_type
+	>::value &&
+	same_tuple_types< Second, Rest... >::value
+>
+{ };
+
+template< bool Promises, typename... T >
+struct first_wins_result
+{ };
+
+template< typename First, typename... Rest >
+struct first_wins_result< true, First, Rest... >
+: std::enable_if<
+	same_tuple_types< First, Rest... >::value,
+	promise< typename std::decay< First >::type::tuple_type >
+>
+{ };
+
+/**
+ * Joins @c first and @c rest (promises of the same type) as @c Kind, where
+ * I... are the indices of @c rest, less one.
+ */
+template< typename Kind, std::size_t... I, typename First, typename... Rest >
+promise< typename std::decay< First >::type::tuple_type >
+join_each( index_tuple< I... >, First&& first, Rest&&... rest )
+{
+	typedef typename std::decay< First >::type::tuple_type tuple_type;
+	typedef join_block< tuple_type, Kind >                 block_type;
+	typedef join_settler< tuple_type, Kind >               settler_type;
+
+	auto deferred = block_type::defer_type::construct( );
+	auto block = block_type::construct( 1 + sizeof...( I ), 0, deferred );
+
+	int expand[ ] = {
+		( promise_access::settle(
+			std::forward< First >( first ),
+			settler_type( block, 0 ) ), 0 ),
+		( promise_access::settle(
+			std::forward< Rest >( rest ),
+			settler_type( block, I + 1 ) ), 0 )...
+	};
+	( void )expand;
+
+	block->release( );
+
+	return deferred->get_promise( );
+}
+
+} // namespace detail
+
+/**
+ * Resolves to the result of the first promise in a std::vector (of the same
+ * type) to be resolved, whether it is fulfilled or rejected.
+ *
+ * The promises which lose the race don't hold on to the returned promise,
+ * and their continuations take no queue slots when they are resolved.
+ * An empty std::vector gives a promise rejected with an empty
+ * combined_promise_exception.
+ */
+template< typename List >
+typename std::enable_if<
+	is_vector< typename std::decay< List >::type >::value &&
+	is_promise< typename std::decay< List >::type::value_type >::value,
+	promise< typename std::decay< List >::type::value_type::tuple_type >
+>::type
+race( List&& list )
+{
+	return detail::join_list< detail::join_race >( list );
+}
+
+/**
+ * Resolves to the result of the first of the promises (of the same type) to
+ * be resolved, whether it is fulfilled or rejected.
+ */
+template< typename First, typename... Rest >
+typename detail::first_wins_result<
+	are_promises<
+		typename std::decay< First >::type,
+		typename std::decay< Rest >::type...
+	>::value,
+	First,
+	Rest...
+>::type
+race( First&& first, Rest&&... rest )
+{
+	return detail::join_each< detail::join_race >(
+		typename make_index_tuple< sizeof...( Rest ) >::type( ),
+		std::forward< First >( first ),
+		std::forward< Rest >( rest )... );
+}
+
+/**
+ * Resolves to the value of the first promise in a std::vector (of the same
+ * type) to be fulfilled. If all of them are rejected, the returned promise
+ * is rejected with a combined_promise_exception of all their exceptions.
+ */
+template< typename List >
+typename std::enable_if<
+	is_vector< typename std::decay< List >::type >::value &&
+	is_promise< typename std::decay< List >::type::value_type >::value,
+	promise< typename std::decay< List >::type::value_type::tuple_type >
+>::type
+any( List&& list )
+{
+	return detail::join_list< detail::join_any >( list );
+}
+
+/**
+ * Resolves to the value of the first of the promises (of the same type) to
+ * be fulfilled. If all of them are rejected, the returned promise is
+ * rejected with a combined_promise_exception of all their exceptions.
+ */
+template< typename First, typename... Rest >
+typename detail::first_wins_result<
+	are_promises<
+		typename std::decay< First >::type,
+		typename std::decay< Rest >::type...
+	>::value,
+	First,
+	Rest...
+>::type
+any( First&& first, Rest&&... rest )
+{
+	return detail::join_each< detail::join_any >(
+		typename make_index_tuple< sizeof...( Rest ) >::type( ),
+		std::forward< First >( first ),
+		std::forward< Rest >( rest )... );
+}
+
+/**
+ * Resolves to the values of the first @c count promises in a std::vector
+ * (of the same type) to be fulfilled, in the order they were fulfilled. The
+ * values are returned like with all( ) of a std::vector.
+ *
+ * As soon as too many promises are rejected for @c count of them to be
+ * fulfilled, the returned promise is rejected with a
+ * combined_promise_exception of those exceptions.
+ */
+template< typename List >
+typename std::enable_if<
+	is_vector< typename std::decay< List >::type >::value &&
+	is_promise< typename std::decay< List >::type::value_type >::value,
+	promise< typename detail::all_vector_element<
+		typename std::decay< List >::type::value_type::tuple_type
+	>::result_type >
+>::type
+some( std::size_t count, List&& list )
+{
+	return detail::join_list< detail::join_some >( list, count );
+}
+
+} // namespace q
+
+#endif // LIBQ_PROMISE_RACE_HPP
@@ -38,7 +38,7 @@ reject( E&& e )
 	typedef typename Arguments::template apply< detail::defer >::type
 		defer_type;
 
-	auto deferred = ::q::make_shared< defer_type >( );
+	auto deferred = defer_type::construct( );
 
 	deferred->set_exception( std::forward< E >( e ) );
 
@@ -55,7 +55,7 @@ reject( E&& e )
 	typedef typename Arguments::template apply< detail::defer >::type
 		defer_type;
 
-	auto deferred = ::q::make_shared< defer_type >( );
+	auto deferred = defer_type::construct( );
 
 	deferred->set_exception(
 		std::make_exception_ptr( std::forward< E >( e ) ) );
@@ -17,34 +17,123 @@
 #ifndef LIBQ_PROMISE_SIGNAL_HPP
 #define LIBQ_PROMISE_SIGNAL_HPP
 
-#include <q/exception.hpp>
+#include <q/types.hpp>
+#include <q/cancellation.hpp>
+#include <q/detail/pool_allocator.hpp>
 
-#include <vector>
-#include <memory>
+#include <atomic>
 
 namespace q { namespace detail {
 
-// TODO: Make lock-free with a lock-free queue and atomic bool.
+/**
+ * Holds the continuations of a promise, and schedules them when done( ) is
+ * called.
+ *
+ * Continuations are registered lock-free onto an intrusive stack, which done( )
+ * seals by exchanging the head with a sentinel. The first continuation is
+ * stored inline, as unique promises never get more than one.
+ */
 class promise_signal
-: public std::enable_shared_from_this< promise_signal >
 {
 public:
+	promise_signal( ) noexcept;
 	~promise_signal( );
 
+	promise_signal( const promise_signal& ) = delete;
+	promise_signal& operator=( const promise_signal& ) = delete;
+
+	/**
+	 * Schedules all continuations. Must only be called once.
+	 */
 	void done( ) noexcept;
 
-	void push( task&& task, const queue_ptr& queue );
+	/**
+	 * Schedules @c task on @c queue when done( ) is called, or immediately
+	 * if it already has been. If @c queue is null, @c task is run
+	 * synchronously instead.
+	 *
+	 * If @c fuse is true, done( ) is known to be called by a task running on
+	 * @c queue, and @c task is run right after that task, as part of it,
+	 * rather than being enqueued.
+	 *
+	 * If @c cancellable is true and the cancellation token is cancelled by
+	 * the time @c task is dispatched, it is run right away instead of being
+	 * enqueued, expecting it to see the cancellation and not run user code.
+	 */
+	void push( task&& task,
+	           const queue_ptr& queue,
+	           bool fuse = false,
+	           bool cancellable = false );
 
-protected:
-	promise_signal( );
+	/**
+	 * Sets the cancellation token of the promise. Must be called before
+	 * the signal is shared with another thread.
+	 */
+	void set_cancellation( const cancellation_token& token )
+	{
+		token_ = token;
+	}
+
+	const cancellation_token& cancellation( ) const noexcept
+	{
+		return token_;
+	}
 
 private:
-	struct pimpl;
+	struct node
+	: pool_allocated
+	{
+		node( ) noexcept
+		: fused_( false )
+		, cancellable_( false )
+		, next_( nullptr )
+		{ }
 
-	std::unique_ptr< pimpl > pimpl_;
-};
+		node( task&& task,
+		      const queue_ptr& queue,
+		      bool fused,
+		      bool cancellable )
+		: task_( std::move( task ) )
+		, queue_( queue )
+		, fused_( fused )
+		, cancellable_( cancellable )
+		, next_( nullptr )
+		{ }
+
+		task task_;
+		queue_ptr queue_;
+		bool fused_;
+		bool cancellable_;
+		node* next_;
+	};
 
-typedef std::shared_ptr< promise_signal > promise_signal_ptr;
+	static node* sealed( ) noexcept;
+
+	/**
+	 * Runs or schedules a continuation once the signal is done.
+	 */
+	void dispatch( task&& task,
+	               const queue_ptr& queue,
+	               bool fused,
+	               bool cancellable );
+
+	/**
+	 * Runs @c task inline if @c queue allows it (or is null), otherwise
+	 * pushes it.
+	 */
+	static void schedule( task&& task, const queue_ptr& queue );
+
+	/**
+	 * Runs @c task after the currently running fused task, or right away if
+	 * there is none.
+	 */
+	static void run_fused( task&& task, const queue_ptr& queue );
+
+	std::atomic< node* > head_;
+	std::atomic< bool > first_claimed_;
+	node first_;
+	cancellation_token token_;
+};
 
 } } // namespace detail, namespace queue
 
@@ -17,7 +17,12 @@
 #ifndef LIBQ_PROMISE_STATE_HPP
 #define LIBQ_PROMISE_STATE_HPP
 
-#include <future>
+#include <q/detail/intrusive_ptr.hpp>
+#include <q/detail/pool_allocator.hpp>
+
+#include <atomic>
+#include <new>
+#include <type_traits>
 
 // TODO: Consider moving to is_nothrow_* alternatives since we won't allow
 // exceptions to be thrown when copying or moving data between asynchronous
@@ -25,154 +30,262 @@
 
 namespace q { namespace detail {
 
-template< typename T, bool Shared >
-struct promise_state_data
+template< typename... T >
+class defer;
+
+template< typename Defer >
+class embedded_defer;
+
+/**
+ * The state shared between a defer and the promises it resolves. This is
+ * the only allocation made per chain stage, as the result and the promise's
+ * continuations are stored inline. The object is reference counted
+ * intrusively, and is allocated as the defer (of which this is the base
+ * class) which resolves it, or as an object embedding it (embedded_defer).
+ */
+template< typename T >
+class promise_state_data
+: public pool_allocated
 {
+public:
 	typedef expect< T > value_type;
-	typedef std::future< value_type > future_type;
+	typedef typename ::q::tuple_arguments< T >
+		::template apply< defer >::type defer_type;
 
-	promise_state_data( ) = delete;
-	promise_state_data( promise_state_data< T, Shared >&& ) = default;
-	promise_state_data( const promise_state_data< T, Shared >& ) = delete;
+	enum class status
+	: unsigned char
+	{
+		pending,
+		fulfilled,
+		rejected,
+		consumed
+	};
 
-	promise_state_data( future_type&& future )
-	: future( std::move( future ) )
-	, signal( make_shared< promise_signal >( ) )
-	{ }
+	promise_state_data( const promise_state_data& ) = delete;
+	promise_state_data& operator=( const promise_state_data& ) = delete;
 
-	future_type future;
-	promise_signal_ptr signal;
-};
+	void add_ref( ) noexcept
+	{
+		refs_.fetch_add( 1, std::memory_order_relaxed );
+	}
 
-template< typename T >
-struct promise_state_data< T, true >
-{
-	typedef expect< T > value_type;
-	typedef std::shared_future< value_type > future_type;
+	void release( ) noexcept
+	{
+		if ( refs_.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
+
+		if ( embedded_ )
+			embedded_defer< defer_type >::destroy(
+				static_cast< defer_type* >( this ) );
+		else
+			delete static_cast< defer_type* >( this );
+	}
 
-	promise_state_data( ) = delete;
-	promise_state_data( promise_state_data< T, true >&& unique ) = default;
-	promise_state_data( const promise_state_data< T, true >& unique ) = default;
+	status get_status( ) const noexcept
+	{
+		return status_.load( std::memory_order_acquire );
+	}
 
-	promise_state_data( promise_state_data< T, false >&& unique )
-	: future( unique.future.share( ) )
-	, signal( unique.signal )
-	{ }
+	promise_signal& signal( ) noexcept
+	{
+		return signal_;
+	}
 
-	future_type future;
-	promise_signal_ptr signal;
-};
+	/**
+	 * Marks this state as only being resolved by a task running on @c queue.
+	 */
+	void set_producer( const queue_ptr& queue ) noexcept
+	{
+		producer_ = queue.get( );
+	}
 
-template< typename T >
-struct shared_state
-{
-	typedef promise_state_data< T, true > state_type;
+	/**
+	 * @returns whether a continuation on @c queue can be fused with the task
+	 * resolving this state.
+	 */
+	bool fuses_with( const queue_ptr& queue ) const
+	{
+		return producer_ && producer_ == queue.get( ) && queue->fusion( );
+	}
 
-public:
-	shared_state( ) = delete;
-	shared_state( const shared_state< T >& ) = default;
-	shared_state( shared_state< T >&& ) = default;
+	/**
+	 * Attaches a cancellation token, inherited by promises derived from
+	 * this one. Must be called before the state is shared.
+	 */
+	void set_cancellation( const cancellation_token& token )
+	{
+		signal_.set_cancellation( token );
+	}
 
-	typename state_type::value_type consume( )
+	const cancellation_token& cancellation( ) const noexcept
 	{
-		return data_->future.get( );
+		return signal_.cancellation( );
 	}
 
-	promise_signal_ptr signal( )
+	/**
+	 * Copies the result. Must not be called before the state is resolved.
+	 */
+	value_type get( ) const
 	{
-		return data_->signal;
+		return *value( );
 	}
 
-	state_type acquire( )
+	/**
+	 * Moves the result out. Must not be called before the state is resolved,
+	 * and only once.
+	 */
+	value_type consume( )
 	{
-		return *data_;
+		status_.store( status::consumed, std::memory_order_relaxed );
+		return std::move( *value( ) );
 	}
 
 protected:
-	shared_state( promise_state_data< T, false >&& data )
-	: data_( std::make_shared< state_type >( std::move( data ) ) )
+	promise_state_data( ) noexcept
+	: refs_( 0 )
+	, status_( status::pending )
+	, embedded_( false )
+	, producer_( nullptr )
 	{ }
 
+	~promise_state_data( )
+	{
+		if ( status_.load( std::memory_order_relaxed ) != status::pending )
+			value( )->~value_type( );
+	}
+
+	/**
+	 * Stores the result and schedules the continuations. Must only be
+	 * called once.
+	 */
+	void resolve( value_type&& result )
+	{
+		auto resolved = result.has_exception( )
+			? status::rejected
+			: status::fulfilled;
+
+		::new ( &storage_ ) value_type( std::move( result ) );
+		status_.store( resolved, std::memory_order_release );
+
+		signal_.done( );
+	}
+
+	/**
+	 * Marks this state as the base of an embedded_defer, which is destroyed
+	 * as such.
+	 */
+	void set_embedded( ) noexcept
+	{
+		embedded_ = true;
+	}
+
 private:
-	std::shared_ptr< state_type > data_;
+	value_type* value( ) noexcept
+	{
+		return reinterpret_cast< value_type* >( &storage_ );
+	}
+
+	const value_type* value( ) const noexcept
+	{
+		return reinterpret_cast< const value_type* >( &storage_ );
+	}
+
+	std::atomic< std::size_t > refs_;
+	std::atomic< status > status_;
+	// Fits in the padding after status_
+	bool embedded_;
+	const queue* producer_;
+	typename std::aligned_storage<
+		sizeof( value_type ), std::alignment_of< value_type >::value
+	>::type storage_;
+	promise_signal signal_;
 };
 
-template< typename T >
-class unique_state
+/**
+ * A promise's handle to its state. Shared promises copy the result out of
+ * the state, unique promises move it.
+ */
+template< typename T, bool Shared >
+class promise_state
 {
-	typedef promise_state_data< T, false > state_type;
-
 public:
-	unique_state( ) = delete;
-	unique_state( const unique_state< T >& ) = delete;
-	unique_state( unique_state< T >&& s )// = default;
-	: data_( std::move( s.data_ ) )
+	typedef promise_state_data< T >    data_type;
+	typedef intrusive_ptr< data_type > data_ptr;
+	typedef expect< T >                value_type;
+
+	promise_state( ) = delete;
+
+	promise_state( data_ptr data ) noexcept
+	: data_( std::move( data ) )
 	{ }
 
-	typename state_type::value_type& ref( )
+	promise_state( promise_state&& ) = default;
+	promise_state( const promise_state& ) = default;
+
+	promise_state& operator=( promise_state&& ) = default;
+	promise_state& operator=( const promise_state& ) = default;
+
+	value_type consume( )
 	{
-		return data_.future.get( );
+		return consume( *data_ );
 	}
 
-	typename state_type::value_type consume( )
+	/**
+	 * Like consume( ), for a state not necessarily owned by a handle.
+	 */
+	static value_type consume( data_type& data )
 	{
-		return std::move( data_.future.get( ) );
+		return consume( data, bool_type< Shared >( ) );
 	}
 
-	promise_signal_ptr signal( )
+	promise_signal& signal( ) noexcept
 	{
-		return data_.signal;
+		return data_->signal( );
 	}
 
-	state_type acquire( )
+	bool fuses_with( const queue_ptr& queue ) const
 	{
-		return std::move( data_ );
+		return data_->fuses_with( queue );
 	}
 
-protected:
-	unique_state( state_type&& data )
-	: data_( std::move( data ) )
-	{ }
-
-private:
-	state_type data_;
-};
-
-template< typename T, bool Shared >
-struct promise_state;
+	const cancellation_token& cancellation( ) const noexcept
+	{
+		return data_->cancellation( );
+	}
 
-template< typename T >
-struct promise_state< T, true >
-: shared_state< T >
-{
-	typedef shared_state< T > base_type;
+	bool is_cancelled( ) const noexcept
+	{
+		return data_->cancellation( ).is_cancelled( );
+	}
 
-	promise_state( promise_state_data< T, false >&& data )
-	: base_type( std::move( data ) )
-	{ }
+	data_ptr acquire( ) const noexcept
+	{
+		return data_;
+	}
 
-	promise_state( promise_state< T, true >&& data ) = default;
-	promise_state( const promise_state< T, true >& data ) = default;
+	data_type* get( ) const noexcept
+	{
+		return data_.get( );
+	}
 
 	static_assert(
-		is_copyable_or_movable< T >::value,
+		!Shared || is_copyable_or_movable< T >::value,
 		"T must be copyable or movable" );
-};
 
-template< typename T >
-struct promise_state< T, false >
-: unique_state< T >
-{
-	typedef unique_state< T > base_type;
+	static_assert( Shared || is_movable< T >::value, "T must be movable" );
 
-	promise_state( promise_state_data< T, false >&& data )
-	: base_type( std::move( data ) )
-	{ }
+private:
+	static value_type consume( data_type& data, std::true_type )
+	{
+		return data.get( );
+	}
 
-	promise_state( promise_state< T, false >&& data ) = default;
-	promise_state( const promise_state< T, false >& data ) = delete;
+	static value_type consume( data_type& data, std::false_type )
+	{
+		return data.consume( );
+	}
 
-	static_assert( is_movable< T >::value, "T must be movable" );
+	data_ptr data_;
 };
 
 } } // namespace detail, namespace queue
@@ -30,7 +30,7 @@ template< typename... T >
 promise< std::tuple< T... > >
 with( T&&... t )
 {
-	auto deferred = ::q::make_shared< detail::defer< T... > >( );
+	auto deferred = detail::defer< T... >::construct( );
 
 	deferred->set_value( std::forward_as_tuple( t... ) );
 
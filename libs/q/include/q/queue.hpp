@@ -22,9 +22,12 @@
 #include <q/exception.hpp>
 
 #include <memory>
+#include <chrono>
 
 namespace q {
 
+namespace detail { class promise_signal; }
+
 class queue_exception
 : public exception
 { };
@@ -43,12 +46,65 @@ public:
 
 	priority_t priority( ) const;
 
+	/**
+	 * The share of CPU time this queue gets, relative to other queues, when
+	 * scheduled by a fair share scheduler. Defaults to 1024.
+	 */
+	void set_weight( std::size_t weight );
+	std::size_t weight( ) const;
+
+	/**
+	 * Caps the CPU time of this queue, when scheduled by a fair share
+	 * scheduler, to a fraction (0 < quota <= 1) of the scheduler's capacity.
+	 * 0 means no cap, which is the default.
+	 */
+	void set_cpu_quota( double quota );
+	double cpu_quota( ) const;
+
+	/**
+	 * @returns the CPU time consumed by the tasks of this queue, as measured
+	 * by a fair share scheduler.
+	 */
+	std::chrono::nanoseconds consumed_time( ) const;
+
+	/**
+	 * Lets tasks which are scheduled on this queue from a task already
+	 * running on it (such as the next stage of a promise chain) run inline,
+	 * rather than being enqueued, up to @c max_depth nested levels. This
+	 * saves a round trip through the scheduler per stage, at the cost of
+	 * other tasks in the queue having to wait longer.
+	 *
+	 * This also means that set_value( ) (or set_exception( )) of a defer,
+	 * when called by a task on this queue, may run a continuation on this
+	 * queue before returning, re-entering the caller. Code which resolves
+	 * promises must therefore not hold a lock which the continuations may
+	 * take, which the channels of this library follow by resolving outside
+	 * of their locks.
+	 *
+	 * Defaults to 0, which disables inline execution.
+	 */
+	void set_inline_depth( std::size_t max_depth );
+	std::size_t inline_depth( ) const;
+
+	/**
+	 * Lets a promise continuation on this queue be fused with the task
+	 * producing the promise, if that task runs on this queue too. The
+	 * continuation is then run right after that task, as part of it, rather
+	 * than being enqueued, so a chain of such stages costs one enqueue.
+	 *
+	 * Defaults to false, as this changes the order in which tasks run.
+	 */
+	void set_fusion( bool enabled );
+	bool fusion( ) const;
+
 	/**
 	 * Sets a function callback as consumer of the queue. The queue will call
 	 * this function each time a task is added to the queue.
 	 *
-	 * @returns the number of tasks currently in the queue exactly before the
-	 * first call to @c fn will occur.
+	 * @returns the number of tasks in the queue when @c fn was set. Every
+	 * task is either counted or causes a call to @c fn, but a task pushed
+	 * concurrently with this call may be both, so the consumer must
+	 * tolerate finding fewer tasks than it was told about.
 	 */
 	std::size_t set_consumer( notify_type fn );
 
@@ -59,9 +115,35 @@ protected:
 
 private:
 	friend class scheduler;
+	friend class detail::promise_signal;
+
+	/**
+	 * Marks the tasks run by the current thread as running on a certain
+	 * queue, for as long as the scope lives.
+	 */
+	class current_scope
+	{
+	public:
+		current_scope( const queue* queue ) noexcept;
+		~current_scope( );
+
+	private:
+		const queue* previous_;
+		std::size_t previous_depth_;
+	};
 
 	task pop( );
 
+	/**
+	 * Runs @c task directly if the current thread is running a task from
+	 * this queue, and the inline depth allows it.
+	 *
+	 * @returns whether @c task was run.
+	 */
+	bool run_inline( task& task );
+
+	void add_consumed_time( std::chrono::nanoseconds time );
+
 	struct pimpl;
 	std::unique_ptr< pimpl > pimpl_;
 };
@@ -21,30 +21,84 @@
 #include <q/queue.hpp>
 
 #include <memory>
+#include <chrono>
 
 namespace q {
 
 class scheduler;
 typedef std::shared_ptr< scheduler > scheduler_ptr;
 
+/**
+ * A scheduler drains its queues in batches. Each activation on the event
+ * dispatcher runs tasks until the queues are empty or its budget is spent,
+ * and there is never more than one outstanding activation per thread of the
+ * event dispatcher.
+ */
 class scheduler
 : public std::enable_shared_from_this< scheduler >
 {
 public:
+	/**
+	 * Limits the work done in one activation, after which the activation is
+	 * re-posted to the event dispatcher, letting other tasks of the
+	 * dispatcher run in between. A zero limit means no limit.
+	 */
+	struct budget
+	{
+		budget( std::size_t tasks = 256,
+		        std::chrono::microseconds time =
+		        	std::chrono::microseconds( 2000 ) )
+		: tasks( tasks )
+		, time( time )
+		{ }
+
+		std::size_t tasks;
+		std::chrono::microseconds time;
+	};
+
+	/**
+	 * How the scheduler picks the queue to run the next task from.
+	 */
+	enum class policy
+	{
+		/** Lower priority values are always served first, and queues of
+		 *  the same priority are served round-robin, task by task */
+		strict_priority,
+
+		/** Priorities are ignored. The CPU time consumed by each queue is
+		 *  measured, and the queue with the least CPU time relative to
+		 *  its weight is served first. Queues with a CPU quota are only
+		 *  served beyond their quota when no other queue has tasks. */
+		fair_share
+	};
+
 	scheduler( const scheduler& ) = delete;
 	scheduler( scheduler&& ) = delete;
 	~scheduler( );
 
+	/**
+	 * Attaches a queue to the scheduler. Adding a queue which is already
+	 * attached does nothing.
+	 */
 	void add_queue( queue_ptr queue );
 
-	;//e
+	/**
+	 * Detaches a queue from the scheduler. Tasks left in the queue stay
+	 * there, and will be scheduled if the queue is added again.
+	 */
+	void remove_queue( queue_ptr queue );
+
+	void set_budget( budget budget );
 
 protected:
-	scheduler( event_dispatcher_ptr event_dispatcher );
+	scheduler( event_dispatcher_ptr event_dispatcher,
+	           budget budget = scheduler::budget( ),
+	           policy policy = policy::strict_priority );
 
 private:
-	void poke( );
-	task next_task( );
+	void poke( std::size_t tasks = 1 );
+	void activate( );
+	void run_batch( );
 
 	struct pimpl;
 	std::unique_ptr< pimpl > pimpl_;
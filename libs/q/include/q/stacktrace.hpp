@@ -19,11 +19,36 @@
 
 #include <q/async_termination.hpp>
 
+#include <cstddef>
 #include <iosfwd>
+#include <mutex>
+#include <string>
 #include <vector>
 
 namespace q {
 
+/**
+ * How much of a stack trace is captured when a q::exception is constructed.
+ */
+enum class stacktrace_capture
+{
+	/**
+	 * No stack trace is captured.
+	 */
+	off,
+
+	/**
+	 * Only the return addresses are captured, and they are symbolized when
+	 * the stack trace is first printed or its frames are asked for.
+	 */
+	addresses,
+
+	/**
+	 * The return addresses are captured and symbolized immediately.
+	 */
+	full
+};
+
 class stacktrace
 {
 public:
@@ -36,18 +61,41 @@ public:
 		std::string extra;
 	};
 
+	/**
+	 * The maximum number of return addresses captured.
+	 */
+	static const std::size_t max_addresses = 64;
+
 	stacktrace( ) = delete;
-	stacktrace( stacktrace&& ) = default;
+	stacktrace( stacktrace&& );
 	stacktrace( const stacktrace& ) = delete;
 
 	stacktrace( std::vector< frame >&& frames );
 
+	/**
+	 * Creates a stack trace of @c size return addresses (at most
+	 * max_addresses), which are symbolized on first use.
+	 */
+	stacktrace( void* const* addresses, std::size_t size );
+
+	/**
+	 * Returns the frames, symbolizing the return addresses on the first
+	 * call. This is thread safe. Symbols are cached process-wide, so
+	 * addresses seen before are not resolved again.
+	 */
 	const std::vector< frame >& frames( ) const;
 
 	std::string string( ) const;
 
 private:
-	std::vector< frame > frames_;
+	friend std::ostream& operator<<( std::ostream& os, const stacktrace& st );
+
+	void symbolize( ) const;
+
+	void* addresses_[ max_addresses ];
+	std::size_t size_;
+	mutable std::once_flag symbolized_;
+	mutable std::vector< frame > frames_;
 };
 
 std::ostream& operator<<( std::ostream& os, const stacktrace& st );
@@ -66,6 +114,15 @@ typedef stacktrace( *stacktrace_function )( );
  */
 stacktrace_function register_stacktrace_function( stacktrace_function );
 
+/**
+ * Sets how much of a stack trace q::exception captures, which defaults to
+ * stacktrace_capture::addresses. Stack trace functions registered with
+ * register_stacktrace_function( ) are only used if capturing isn't off.
+ */
+void set_stacktrace_capture( stacktrace_capture capture );
+
+stacktrace_capture get_stacktrace_capture( );
+
 /**
  * Creates a stack trace on the current thread and returns it as a stacktrace
  * object.
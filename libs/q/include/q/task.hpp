@@ -0,0 +1,247 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_TASK_HPP
+#define LIBQ_TASK_HPP
+
+#include <q/detail/pool_allocator.hpp>
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * The number of bytes a q::task can store inline, i.e. without allocating.
+ */
+#ifndef LIBQ_TASK_INLINE_SIZE
+#	define LIBQ_TASK_INLINE_SIZE 96
+#endif
+
+namespace q {
+
+/**
+ * A move-only void( ) function wrapper.
+ *
+ * Unlike std::function, the wrapped function object doesn't need to be
+ * copyable, and function objects up to @c InlineSize bytes (which are
+ * nothrow move constructible) are stored inline rather than on the heap.
+ * Larger ones are pool allocated (see LIBQ_POOL_ALLOCATOR).
+ */
+template< std::size_t InlineSize >
+class basic_task
+{
+	template< typename Fn >
+	struct is_inline
+	: std::integral_constant<
+		bool,
+		sizeof( Fn ) <= InlineSize &&
+		std::alignment_of< Fn >::value <=
+			std::alignment_of< std::max_align_t >::value &&
+		std::is_nothrow_move_constructible< Fn >::value
+	>
+	{ };
+
+public:
+	basic_task( ) noexcept
+	: vtable_( nullptr )
+	{ }
+
+	basic_task( std::nullptr_t ) noexcept
+	: vtable_( nullptr )
+	{ }
+
+	template<
+		typename Fn,
+		typename Decayed = typename std::decay< Fn >::type,
+		typename = typename std::enable_if<
+			!std::is_same< Decayed, basic_task >::value
+		>::type
+	>
+	basic_task( Fn&& fn )
+	: vtable_( &vtable_for< Decayed >::value )
+	{
+		construct< Decayed >( std::forward< Fn >( fn ),
+		                      is_inline< Decayed >( ) );
+	}
+
+	basic_task( basic_task&& other ) noexcept
+	: vtable_( other.vtable_ )
+	{
+		if ( vtable_ )
+			vtable_->move( &storage_, &other.storage_ );
+		other.vtable_ = nullptr;
+	}
+
+	basic_task( const basic_task& ) = delete;
+	basic_task& operator=( const basic_task& ) = delete;
+
+	~basic_task( )
+	{
+		reset( );
+	}
+
+	basic_task& operator=( basic_task&& other ) noexcept
+	{
+		if ( this != &other )
+		{
+			reset( );
+			vtable_ = other.vtable_;
+			if ( vtable_ )
+				vtable_->move( &storage_, &other.storage_ );
+			other.vtable_ = nullptr;
+		}
+		return *this;
+	}
+
+	basic_task& operator=( std::nullptr_t ) noexcept
+	{
+		reset( );
+		return *this;
+	}
+
+	void operator( )( )
+	{
+		vtable_->invoke( &storage_ );
+	}
+
+	explicit operator bool( ) const noexcept
+	{
+		return vtable_ != nullptr;
+	}
+
+private:
+	typedef typename std::aligned_storage<
+		InlineSize, std::alignment_of< std::max_align_t >::value
+	>::type storage_type;
+
+	struct vtable
+	{
+		void ( *invoke )( void* );
+		// Move constructs into uninitialized storage, and destroys source
+		void ( *move )( void*, void* );
+		void ( *destroy )( void* );
+	};
+
+	template< typename Fn, bool Inline = is_inline< Fn >::value >
+	struct vtable_for
+	{
+		static void invoke( void* storage )
+		{
+			( *static_cast< Fn* >( storage ) )( );
+		}
+
+		static void move( void* to, void* from )
+		{
+			auto fn = static_cast< Fn* >( from );
+			::new ( to ) Fn( std::move( *fn ) );
+			fn->~Fn( );
+		}
+
+		static void destroy( void* storage )
+		{
+			static_cast< Fn* >( storage )->~Fn( );
+		}
+
+		static const vtable value;
+	};
+
+	template< typename Fn >
+	struct vtable_for< Fn, false >
+	{
+		static Fn*& get( void* storage )
+		{
+			return *static_cast< Fn** >( storage );
+		}
+
+		static void invoke( void* storage )
+		{
+			( *get( storage ) )( );
+		}
+
+		static void move( void* to, void* from )
+		{
+			::new ( to ) Fn*( get( from ) );
+		}
+
+		static void destroy( void* storage )
+		{
+			auto fn = get( storage );
+			fn->~Fn( );
+			detail::pool_deallocate( fn, sizeof( Fn ) );
+		}
+
+		static const vtable value;
+	};
+
+	template< typename Fn, typename Arg >
+	void construct( Arg&& arg, std::true_type )
+	{
+		::new ( &storage_ ) Fn( std::forward< Arg >( arg ) );
+	}
+
+	template< typename Fn, typename Arg >
+	void construct( Arg&& arg, std::false_type )
+	{
+		void* ptr = detail::pool_allocate( sizeof( Fn ) );
+
+		try
+		{
+			::new ( ptr ) Fn( std::forward< Arg >( arg ) );
+		}
+		catch ( ... )
+		{
+			detail::pool_deallocate( ptr, sizeof( Fn ) );
+			throw;
+		}
+
+		::new ( &storage_ ) Fn*( static_cast< Fn* >( ptr ) );
+	}
+
+	void reset( ) noexcept
+	{
+		if ( vtable_ )
+			vtable_->destroy( &storage_ );
+		vtable_ = nullptr;
+	}
+
+	const vtable* vtable_;
+	storage_type storage_;
+};
+
+template< std::size_t InlineSize >
+template< typename Fn, bool Inline >
+const typename basic_task< InlineSize >::vtable
+basic_task< InlineSize >::vtable_for< Fn, Inline >::value = {
+	&vtable_for::invoke,
+	&vtable_for::move,
+	&vtable_for::destroy
+};
+
+template< std::size_t InlineSize >
+template< typename Fn >
+const typename basic_task< InlineSize >::vtable
+basic_task< InlineSize >::vtable_for< Fn, false >::value = {
+	&vtable_for::invoke,
+	&vtable_for::move,
+	&vtable_for::destroy
+};
+
+typedef basic_task< LIBQ_TASK_INLINE_SIZE > task;
+
+} // namespace q
+
+#endif // LIBQ_TASK_HPP
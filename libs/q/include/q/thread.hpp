@@ -21,6 +21,8 @@
 
 #include <q/detail/lib.hpp>
 
+#include <thread>
+
 namespace q {
 
 /**
@@ -74,7 +76,8 @@ public:
 		if ( !running_.load( std::memory_order_seq_cst ) )
 			return;
 
-		if ( thread_.joinable( ) )
+		if ( thread_.joinable( ) &&
+			thread_.get_id( ) != std::this_thread::get_id( ) )
 			thread_.join( );
 		else
 			// We end up here if and only if the thread function
@@ -208,7 +211,13 @@ private:
 		if ( thread_.joinable( ) )
 		{
 			running_.store( false, std::memory_order_seq_cst );
-			thread_.join( );
+
+			// Without a queue to join on, this is run by the thread
+			// itself as it completes, and can't join itself
+			if ( thread_.get_id( ) == std::this_thread::get_id( ) )
+				thread_.detach( );
+			else
+				thread_.join( );
 		}
 	}
 
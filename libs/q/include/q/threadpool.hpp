@@ -29,19 +29,39 @@ class threadpool
 , public std::enable_shared_from_this< threadpool >
 {
 public:
+	/**
+	 * How tasks are distributed to the threads of the pool.
+	 */
+	enum class scheduling
+	{
+		/** All threads share one task queue */
+		shared_queue,
+
+		/** Each thread has its own task deque, and steals tasks from
+		 *  other threads when running dry. Tasks added from within a
+		 *  thread of the pool are added to that thread's own deque. */
+		work_stealing
+	};
+
 	~threadpool( );
 
 	void add_task( task task ) override;
 
+	std::size_t parallelism( ) const override;
+
 	static std::shared_ptr< threadpool >
 	construct( const std::string& name,
-	           std::size_t threads = hard_cores( ) );
+	           std::size_t threads = hard_cores( ),
+	           scheduling mode = scheduling::shared_queue );
 
 protected:
-	threadpool( const std::string& name, std::size_t threads );
+	threadpool( const std::string& name,
+	            std::size_t threads,
+	            scheduling mode );
 
 private:
 	void start( );
+	void start_work_stealing( );
 
 	std::size_t backlog( ) const override;
 
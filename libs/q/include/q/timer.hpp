@@ -0,0 +1,168 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_TIMER_HPP
+#define LIBQ_TIMER_HPP
+
+#include <q/types.hpp>
+#include <q/exception.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace q {
+
+Q_MAKE_SIMPLE_EXCEPTION( timeout_exception );
+Q_MAKE_SIMPLE_EXCEPTION( timer_terminated_exception );
+
+class timer;
+typedef std::shared_ptr< timer > timer_ptr;
+
+/**
+ * Runs tasks on queues at given points in time.
+ *
+ * Timers are kept in a hierarchical timing wheel, driven by a dedicated
+ * thread which sleeps until the next occupied slot. Both scheduling and
+ * cancelling a timer are O(1), so millions of timeouts can be kept armed,
+ * most of which are expected to be cancelled before they expire.
+ *
+ * Timers never fire early, but up to one tick (the resolution of the timer)
+ * late, or later by up to their slack. Timers with slack are coalesced with
+ * other timers within the same power of two number of ticks, to fire in the
+ * same wakeup.
+ */
+class timer
+: public std::enable_shared_from_this< timer >
+{
+public:
+	typedef std::chrono::steady_clock clock;
+	typedef clock::duration           duration;
+	typedef clock::time_point         time_point;
+
+	/**
+	 * Identifies a scheduled timer, to cancel it. Outlives the timer
+	 * safely, i.e. cancelling an expired timer does nothing.
+	 */
+	class handle
+	{
+	public:
+		handle( )
+		: index_( 0 )
+		, generation_( 0 )
+		{ }
+
+		explicit operator bool( ) const noexcept
+		{
+			return generation_ != 0;
+		}
+
+	private:
+		friend class timer;
+
+		handle( std::uint32_t index, std::uint32_t generation )
+		: index_( index )
+		, generation_( generation )
+		{ }
+
+		std::uint32_t index_;
+		std::uint32_t generation_;
+	};
+
+	~timer( );
+
+	static timer_ptr
+	construct( const std::string& name,
+	           duration resolution = std::chrono::milliseconds( 1 ) );
+
+	/**
+	 * Pushes @c task to @c queue once @c delay has passed, or up to
+	 * @c slack later.
+	 *
+	 * @throws timer_terminated_exception if the timer is terminated.
+	 */
+	handle schedule( duration delay,
+	                 task task,
+	                 const queue_ptr& queue,
+	                 duration slack = duration::zero( ) );
+
+	/**
+	 * Like schedule( delay, task, queue, slack ), but if the timer is
+	 * terminated before it expires, @c reject is called with a
+	 * timer_terminated_exception instead, so that whatever waits for the
+	 * timer is settled.
+	 */
+	handle schedule( duration delay,
+	                 task task,
+	                 std::function< void( std::exception_ptr ) > reject,
+	                 const queue_ptr& queue,
+	                 duration slack = duration::zero( ) );
+
+	/**
+	 * Pushes a call to @c fn to @c queue every @c period, until cancelled.
+	 * Each expiry is scheduled relative to the previous one, not to when
+	 * @c fn was run, so the period doesn't drift.
+	 *
+	 * @throws timer_terminated_exception if the timer is terminated.
+	 */
+	handle schedule_periodic( duration period,
+	                          std::function< void( ) > fn,
+	                          const queue_ptr& queue,
+	                          duration slack = duration::zero( ) );
+
+	/**
+	 * Cancels a timer, dropping its task without running it.
+	 *
+	 * @returns whether the timer was still armed.
+	 */
+	bool cancel( const handle& handle );
+
+	/**
+	 * @returns the number of armed timers.
+	 */
+	std::size_t armed( ) const;
+
+	/**
+	 * Stops the timer thread. Armed timers are dropped, after their reject
+	 * functions (if any) have been called, and no more timers can be
+	 * scheduled.
+	 */
+	void terminate( );
+
+protected:
+	timer( const std::string& name, duration resolution );
+
+private:
+	void start( );
+
+	// Shared with the timer thread, which may outlive the timer briefly
+	struct pimpl;
+	std::shared_ptr< pimpl > pimpl_;
+};
+
+/**
+ * @returns the timer used by q::delay( ) and promise timeouts, which is
+ * constructed on first use unless set with set_default_timer( ).
+ */
+timer_ptr default_timer( );
+
+timer_ptr set_default_timer( timer_ptr timer );
+
+} // namespace q
+
+#endif // LIBQ_TIMER_HPP
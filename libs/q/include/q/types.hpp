@@ -18,7 +18,9 @@
 #define LIBQ_TYPES_HPP
 
 #include <q/pp.hpp>
+#include <q/task.hpp>
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <sstream>
@@ -142,8 +144,6 @@ queue_ptr set_default_queue( queue_ptr queue );
 
 typedef int priority_t;
 
-typedef std::function< void( void ) > task;
-
 } // namespace q
 
 #endif // LIBQ_TYPES_HPP
@@ -3,6 +3,7 @@
 #include <q/mutex.hpp>
 
 #include <queue>
+#include <condition_variable>
 
 namespace q {
 
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <q/cancellation.hpp>
+
+#include <algorithm>
+
+namespace q {
+
+const char* cancelled_exception::what( ) const noexcept
+{
+	return "cancelled";
+}
+
+const std::exception_ptr& cancelled_exception_ptr( )
+{
+	static const std::exception_ptr ptr =
+		std::make_exception_ptr( cancelled_exception( ) );
+
+	return ptr;
+}
+
+namespace detail {
+
+void cancellation_state::add_hook(
+	const std::shared_ptr< cancellation_hook >& hook )
+{
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+		if ( !cancelled_.load( std::memory_order_relaxed ) )
+		{
+			// Drop expired hooks before growing, so that a long-lived
+			// token doesn't accumulate the hooks of settled chains
+			if ( hooks_.size( ) == hooks_.capacity( ) )
+				hooks_.erase(
+					std::remove_if(
+						hooks_.begin( ),
+						hooks_.end( ),
+						[ ]( const std::weak_ptr< cancellation_hook >& hook )
+						{
+							return hook.expired( );
+						} ),
+					hooks_.end( ) );
+
+			hooks_.push_back( hook );
+			return;
+		}
+	}
+
+	hook->cancel( );
+}
+
+void cancellation_state::cancel( ) noexcept
+{
+	std::vector< std::weak_ptr< cancellation_hook > > hooks;
+
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+		if ( cancelled_.load( std::memory_order_relaxed ) )
+			return;
+
+		cancelled_.store( true, std::memory_order_release );
+		hooks.swap( hooks_ );
+	}
+
+	// Called without the lock, as the chains unwind synchronously
+	for ( auto& weak : hooks )
+		if ( auto hook = weak.lock( ) )
+			hook->cancel( );
+}
+
+} // namespace detail
+
+cancellation_source::cancellation_source( )
+: state_( std::make_shared< detail::cancellation_state >( ) )
+{ }
+
+void cancellation_source::cancel( ) noexcept
+{
+	state_->cancel( );
+}
+
+bool cancellation_source::is_cancelled( ) const noexcept
+{
+	return state_->is_cancelled( );
+}
+
+cancellation_token cancellation_source::token( ) const noexcept
+{
+	return cancellation_token( state_ );
+}
+
+} // namespace q
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <q/detail/hazard_pointer.hpp>
+#include <q/mutex.hpp>
+
+#include <vector>
+#include <algorithm>
+
+namespace q { namespace detail {
+
+namespace {
+
+struct retired_pointer
+{
+	void* ptr;
+	hazard_deleter deleter;
+};
+
+typedef std::vector< retired_pointer > retired_list;
+
+// Records are never freed, only recycled, so that scanning them never needs
+// to be synchronized with thread exits.
+std::atomic< hazard_record* > records_( nullptr );
+std::atomic< std::size_t > num_records_( 0 );
+
+// Pointers retired by threads which exited before they could be freed
+mutex orphans_mutex_( Q_HERE, "hazard pointer orphans" );
+retired_list orphans_;
+
+hazard_record* acquire_record( )
+{
+	for ( auto rec = records_.load( std::memory_order_acquire );
+	      rec;
+	      rec = rec->next )
+	{
+		bool active = false;
+		if ( rec->active.compare_exchange_strong(
+			active, true, std::memory_order_acq_rel ) )
+			return rec;
+	}
+
+	auto rec = new hazard_record;
+	for ( auto& pointer : rec->pointers )
+		pointer.store( nullptr, std::memory_order_relaxed );
+	rec->active.store( true, std::memory_order_relaxed );
+	rec->used = 0;
+
+	auto head = records_.load( std::memory_order_relaxed );
+	do
+	{
+		rec->next = head;
+	} while ( !records_.compare_exchange_weak(
+		head, rec, std::memory_order_acq_rel ) );
+
+	num_records_.fetch_add( 1, std::memory_order_relaxed );
+
+	return rec;
+}
+
+/**
+ * Frees all pointers in @c list which aren't protected by any hazard
+ * pointer, and leaves the rest in the list.
+ */
+void scan( retired_list& list )
+{
+	std::vector< void* > hazards;
+	hazards.reserve(
+		num_records_.load( std::memory_order_relaxed ) *
+		hazard_record::slots );
+
+	for ( auto rec = records_.load( std::memory_order_acquire );
+	      rec;
+	      rec = rec->next )
+	{
+		for ( auto& pointer : rec->pointers )
+		{
+			auto ptr = pointer.load( std::memory_order_seq_cst );
+			if ( ptr )
+				hazards.push_back( ptr );
+		}
+	}
+
+	std::sort( hazards.begin( ), hazards.end( ) );
+
+	auto still_hazardous = std::partition(
+		list.begin( ),
+		list.end( ),
+		[ &hazards ]( const retired_pointer& retired )
+		{
+			return std::binary_search(
+				hazards.begin( ), hazards.end( ), retired.ptr );
+		} );
+
+	for ( auto iter = still_hazardous; iter != list.end( ); ++iter )
+		iter->deleter( iter->ptr );
+
+	list.erase( still_hazardous, list.end( ) );
+}
+
+struct thread_state
+{
+	thread_state( )
+	: record_( acquire_record( ) )
+	{ }
+
+	~thread_state( )
+	{
+		scan( retired_ );
+
+		if ( !retired_.empty( ) )
+		{
+			Q_AUTO_UNIQUE_LOCK( orphans_mutex_ );
+
+			orphans_.insert(
+				orphans_.end( ), retired_.begin( ), retired_.end( ) );
+		}
+
+		record_->active.store( false, std::memory_order_release );
+	}
+
+	void retire( void* ptr, hazard_deleter deleter )
+	{
+		retired_.push_back( retired_pointer{ ptr, deleter } );
+
+		auto threshold = 2 * hazard_record::slots *
+			num_records_.load( std::memory_order_relaxed ) + 16;
+
+		if ( retired_.size( ) < threshold )
+			return;
+
+		adopt_orphans( );
+		scan( retired_ );
+	}
+
+	void adopt_orphans( )
+	{
+		std::unique_lock< std::mutex > lock(
+			orphans_mutex_, std::try_to_lock );
+
+		if ( !lock.owns_lock( ) || orphans_.empty( ) )
+			return;
+
+		retired_.insert( retired_.end( ), orphans_.begin( ), orphans_.end( ) );
+		orphans_.clear( );
+	}
+
+	hazard_record* record_;
+	retired_list retired_;
+};
+
+thread_state& this_thread_state( )
+{
+	static thread_local thread_state state;
+	return state;
+}
+
+} // anonymous namespace
+
+hazard_record* this_thread_hazard_record( )
+{
+	return this_thread_state( ).record_;
+}
+
+hazard_record* acquire_hazard_record( )
+{
+	return acquire_record( );
+}
+
+void release_hazard_record( hazard_record* record )
+{
+	record->active.store( false, std::memory_order_release );
+}
+
+void retire_hazardous( void* ptr, hazard_deleter deleter )
+{
+	this_thread_state( ).retire( ptr, deleter );
+}
+
+} } // namespace detail, namespace q
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <q/detail/pool_allocator.hpp>
+
+#ifdef LIBQ_POOL_ALLOCATOR
+
+#include <q/mutex.hpp>
+
+#include <new>
+
+namespace q { namespace detail {
+
+namespace {
+
+const std::size_t granularity = 32;
+const std::size_t num_classes = 16;
+const std::size_t max_size = granularity * num_classes;
+const std::size_t magazine_size = 64;
+
+struct free_block
+{
+	free_block* next;
+};
+
+/**
+ * A singly linked list of free blocks of the same size class.
+ */
+struct magazine
+{
+	magazine( )
+	: head( nullptr )
+	, count( 0 )
+	{ }
+
+	void* pop( )
+	{
+		auto block = head;
+		head = block->next;
+		--count;
+		return block;
+	}
+
+	void push( void* ptr )
+	{
+		auto block = static_cast< free_block* >( ptr );
+		block->next = head;
+		head = block;
+		++count;
+	}
+
+	free_block* head;
+	std::size_t count;
+};
+
+/**
+ * A magazine in the depot, stored in its own first block, so that giving a
+ * magazine to the depot never allocates, as it's done when freeing.
+ */
+struct depot_entry
+{
+	free_block block;
+	depot_entry* next;
+	std::size_t count;
+};
+
+static_assert( sizeof( depot_entry ) <= granularity,
+	"a depot entry must fit in the smallest block" );
+
+/**
+ * The magazines of a size class not owned by any thread. Blocks are never
+ * returned to the heap.
+ */
+struct depot_class
+{
+	depot_class( )
+	: mutex_( Q_HERE, "pool depot" )
+	, magazines_( nullptr )
+	{ }
+
+	mutex mutex_;
+	depot_entry* magazines_;
+};
+
+depot_class* depot( )
+{
+	// Never destructed, as blocks may be freed during static destruction
+	static depot_class* classes = new depot_class[ num_classes ];
+	return classes;
+}
+
+/**
+ * Takes a magazine from the depot, or carves a new one out of the heap.
+ */
+magazine take_magazine( std::size_t index )
+{
+	auto& depot_class = depot( )[ index ];
+
+	{
+		Q_AUTO_UNIQUE_LOCK( depot_class.mutex_ );
+
+		if ( auto entry = depot_class.magazines_ )
+		{
+			depot_class.magazines_ = entry->next;
+
+			magazine ret;
+			ret.head = &entry->block;
+			ret.count = entry->count;
+			return ret;
+		}
+	}
+
+	const std::size_t block_size = ( index + 1 ) * granularity;
+
+	auto slab = static_cast< char* >(
+		::operator new( block_size * magazine_size ) );
+
+	magazine ret;
+	for ( std::size_t i = magazine_size; i > 0; --i )
+		ret.push( slab + ( i - 1 ) * block_size );
+
+	return ret;
+}
+
+void give_magazine( std::size_t index, magazine mag )
+{
+	if ( !mag.count )
+		return;
+
+	auto entry = reinterpret_cast< depot_entry* >( mag.head );
+	entry->count = mag.count;
+
+	auto& depot_class = depot( )[ index ];
+
+	Q_AUTO_UNIQUE_LOCK( depot_class.mutex_ );
+
+	entry->next = depot_class.magazines_;
+	depot_class.magazines_ = entry;
+}
+
+/**
+ * A thread's magazines. Each size class has a loaded and a previous
+ * magazine, so that a thread alternating between allocating and freeing
+ * around a magazine boundary doesn't go to the depot every time.
+ */
+struct thread_cache
+{
+	struct size_class
+	{
+		magazine loaded;
+		magazine previous;
+	};
+
+	~thread_cache( )
+	{
+		for ( std::size_t i = 0; i < num_classes; ++i )
+		{
+			give_magazine( i, classes[ i ].loaded );
+			give_magazine( i, classes[ i ].previous );
+		}
+	}
+
+	void* allocate( std::size_t index )
+	{
+		auto& sc = classes[ index ];
+
+		if ( !sc.loaded.count )
+		{
+			if ( sc.previous.count )
+				std::swap( sc.loaded, sc.previous );
+			else
+				sc.loaded = take_magazine( index );
+		}
+
+		return sc.loaded.pop( );
+	}
+
+	void deallocate( void* ptr, std::size_t index )
+	{
+		auto& sc = classes[ index ];
+
+		if ( sc.loaded.count == magazine_size )
+		{
+			if ( sc.previous.count )
+				give_magazine( index, sc.previous );
+			sc.previous = sc.loaded;
+			sc.loaded = magazine( );
+		}
+
+		sc.loaded.push( ptr );
+	}
+
+	size_class classes[ num_classes ];
+};
+
+thread_local thread_cache* cache_ = nullptr;
+thread_local bool cache_destructed_ = false;
+
+struct thread_cache_owner
+{
+	~thread_cache_owner( )
+	{
+		delete cache_;
+		cache_ = nullptr;
+		cache_destructed_ = true;
+	}
+};
+
+thread_cache* this_thread_cache( )
+{
+	if ( cache_ )
+		return cache_;
+
+	// Blocks freed during thread exit, after the cache is gone, go
+	// directly to the depot
+	if ( cache_destructed_ )
+		return nullptr;
+
+	static thread_local thread_cache_owner owner;
+	( void )owner;
+
+	// Not throwing, as this may be called when freeing. Without a cache,
+	// blocks go directly to the depot.
+	cache_ = new ( std::nothrow ) thread_cache;
+	return cache_;
+}
+
+std::size_t size_class_of( std::size_t size )
+{
+	return size ? ( size - 1 ) / granularity : 0;
+}
+
+} // anonymous namespace
+
+void* pool_allocate( std::size_t size )
+{
+	if ( size > max_size )
+		return ::operator new( size );
+
+	auto index = size_class_of( size );
+
+	if ( auto cache = this_thread_cache( ) )
+		return cache->allocate( index );
+
+	auto mag = take_magazine( index );
+	auto ptr = mag.pop( );
+	give_magazine( index, mag );
+	return ptr;
+}
+
+void pool_deallocate( void* ptr, std::size_t size ) noexcept
+{
+	if ( size > max_size )
+		return ::operator delete( ptr );
+
+	auto index = size_class_of( size );
+
+	if ( auto cache = this_thread_cache( ) )
+		return cache->deallocate( ptr, index );
+
+	magazine mag;
+	mag.push( ptr );
+	give_magazine( index, mag );
+}
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_POOL_ALLOCATOR
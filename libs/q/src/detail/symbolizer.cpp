@@ -0,0 +1,270 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "symbolizer.hpp"
+
+#include <q/abi.hpp>
+#include <q/pp.hpp>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#ifndef LIBQ_ON_WINDOWS
+#	include <dlfcn.h>
+#endif
+
+namespace q {
+
+namespace detail {
+
+namespace {
+
+const std::size_t initial_size = 4096;
+const std::size_t max_probes = 32;
+
+/**
+ * The cache, an open addressing hash table of symbols which, once inserted,
+ * are never removed or modified. Its size is a power of two.
+ */
+struct table
+{
+	explicit table( std::size_t size )
+	: size_( size )
+	, used_( 0 )
+	, slots_( new std::atomic< const symbol* >[ size ] )
+	{
+		for ( std::size_t i = 0; i < size_; ++i )
+			slots_[ i ].store( nullptr, std::memory_order_relaxed );
+	}
+
+	const std::size_t size_;
+	// Only accessed with the slow path mutex locked
+	std::size_t used_;
+	std::unique_ptr< std::atomic< const symbol* >[ ] > slots_;
+};
+
+/**
+ * The current table, which is replaced by a larger one as it fills up.
+ */
+std::atomic< table* > table_( nullptr );
+
+/**
+ * Interned strings and all tables, and the mutex under which strings are
+ * interned and symbols are inserted. Never destructed, as stack traces may
+ * be printed during static destruction.
+ */
+struct slow_path
+{
+	std::mutex mutex_;
+	std::unordered_set< std::string > strings_;
+	// Tables which have been grown out of are kept, as lock-free lookups
+	// may still be probing them, but are not written to anymore
+	std::vector< std::unique_ptr< table > > tables_;
+};
+
+slow_path& get_slow_path( )
+{
+	static slow_path* slow = new slow_path;
+	return *slow;
+}
+
+/**
+ * Must be called with the slow path mutex locked.
+ */
+const char* intern( slow_path& slow, std::string&& s )
+{
+	return slow.strings_.insert( std::move( s ) ).first->c_str( );
+}
+
+/**
+ * What dladdr( ) knows about an address, before its strings are interned.
+ */
+struct resolved_symbol
+{
+	std::string lib;
+	std::string name;
+	std::uintptr_t offset;
+};
+
+resolved_symbol resolve( const void* address )
+{
+	resolved_symbol ret{ std::string( ), std::string( ), 0 };
+
+#ifndef LIBQ_ON_WINDOWS
+	Dl_info info;
+	if ( dladdr( address, &info ) )
+	{
+		const auto addr = reinterpret_cast< std::uintptr_t >( address );
+
+		if ( info.dli_fname )
+			ret.lib = info.dli_fname;
+
+		if ( info.dli_sname )
+		{
+			ret.name = demangle_cxx( info.dli_sname );
+			ret.offset = addr - reinterpret_cast< std::uintptr_t >(
+				info.dli_saddr );
+		}
+		else
+		{
+			ret.offset = addr - reinterpret_cast< std::uintptr_t >(
+				info.dli_fbase );
+		}
+	}
+#endif
+
+	return ret;
+}
+
+std::size_t hash( const void* address )
+{
+	std::uint64_t h = reinterpret_cast< std::uintptr_t >( address );
+	h ^= h >> 17;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return static_cast< std::size_t >( h >> 32 );
+}
+
+/**
+ * @returns the cached symbol of @c address in @c t, or nullptr.
+ */
+const symbol* find( const table* t, const void* address )
+{
+	const auto start = hash( address );
+
+	for ( std::size_t probe = 0; probe < max_probes; ++probe )
+	{
+		auto entry = t->slots_[ ( start + probe ) & ( t->size_ - 1 ) ].load(
+			std::memory_order_acquire );
+
+		if ( !entry )
+			return nullptr;
+		if ( entry->address == address )
+			return entry;
+	}
+
+	return nullptr;
+}
+
+/**
+ * Inserts @c sym into the first free slot of its probe sequence. Must be
+ * called with the slow path mutex locked.
+ *
+ * @returns false if all of its slots are taken.
+ */
+bool insert( table* t, const symbol* sym )
+{
+	const auto start = hash( sym->address );
+
+	for ( std::size_t probe = 0; probe < max_probes; ++probe )
+	{
+		auto& slot = t->slots_[ ( start + probe ) & ( t->size_ - 1 ) ];
+
+		if ( slot.load( std::memory_order_relaxed ) )
+			continue;
+
+		slot.store( sym, std::memory_order_release );
+		++t->used_;
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Replaces the current table @c t with one of at least twice its size, with
+ * all of its symbols rehashed into it. Must be called with the slow path
+ * mutex locked.
+ *
+ * @returns the new table.
+ */
+table* grow( slow_path& slow, const table* t )
+{
+	for ( auto size = t->size_ * 2; ; size *= 2 )
+	{
+		std::unique_ptr< table > grown( new table( size ) );
+
+		bool fits = true;
+		for ( std::size_t i = 0; fits && i < t->size_; ++i )
+			if ( auto sym = t->slots_[ i ].load( std::memory_order_relaxed ) )
+				fits = insert( grown.get( ), sym );
+
+		if ( !fits )
+			continue;
+
+		slow.tables_.push_back( std::move( grown ) );
+		table_.store( slow.tables_.back( ).get( ),
+			std::memory_order_release );
+
+		return slow.tables_.back( ).get( );
+	}
+}
+
+} // anonymous namespace
+
+const symbol& symbolize( const void* address )
+{
+	// Lock-free lookup
+	if ( auto t = table_.load( std::memory_order_acquire ) )
+		if ( auto cached = find( t, address ) )
+			return *cached;
+
+	// Not cached. dladdr( ) and the demangling are slow, and done without
+	// holding the lock, although two threads may then resolve the same
+	// address.
+	auto resolved = resolve( address );
+
+	auto& slow = get_slow_path( );
+
+	std::lock_guard< std::mutex > lock( slow.mutex_ );
+
+	auto t = table_.load( std::memory_order_relaxed );
+	if ( !t )
+	{
+		slow.tables_.emplace_back( new table( initial_size ) );
+		t = slow.tables_.back( ).get( );
+		table_.store( t, std::memory_order_release );
+	}
+	else if ( auto cached = find( t, address ) )
+	{
+		// Inserted by another thread meanwhile
+		return *cached;
+	}
+
+	// Symbols are never freed either, and are kept reachable through the
+	// tables
+	auto sym = new symbol{
+		address,
+		intern( slow, std::move( resolved.lib ) ),
+		intern( slow, std::move( resolved.name ) ),
+		resolved.offset
+	};
+
+	// Grow at half load, which keeps the probe sequences short, or when
+	// the table is crowded around this address
+	while ( t->used_ * 2 >= t->size_ || !insert( t, sym ) )
+		t = grow( slow, t );
+
+	return *sym;
+}
+
+} // namespace detail
+
+} // namespace q
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_INTERNAL_SYMBOLIZER_HPP
+#define LIBQ_INTERNAL_SYMBOLIZER_HPP
+
+#include <cstdint>
+
+namespace q {
+
+namespace detail {
+
+/**
+ * What is known about a return address. The strings are interned, and live
+ * as long as the process.
+ */
+struct symbol
+{
+	const void* address;
+
+	// The shared object, or "" if unknown
+	const char* lib;
+
+	// The demangled name, or "" if unknown
+	const char* name;
+
+	// The offset from the symbol, or from the shared object if the symbol
+	// is unknown
+	std::uintptr_t offset;
+};
+
+/**
+ * Resolves @c address through dladdr( ), and caches the result for the
+ * lifetime of the process. Looking up an address which is cached is
+ * lock-free and doesn't allocate.
+ */
+const symbol& symbolize( const void* address );
+
+} // namespace detail
+
+} // namespace q
+
+#endif // LIBQ_INTERNAL_SYMBOLIZER_HPP
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_INTERNAL_WORK_STEALING_DEQUE_HPP
+#define LIBQ_INTERNAL_WORK_STEALING_DEQUE_HPP
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace q { namespace detail {
+
+/**
+ * Chase-Lev work-stealing deque of pointers.
+ *
+ * The owning thread pushes and takes elements at the bottom (LIFO), while any
+ * other thread can steal elements from the top (FIFO). The backing array
+ * grows when full. Replaced arrays are kept until the deque is destructed,
+ * as thieves may still be reading from them.
+ */
+template< typename T >
+class work_stealing_deque
+{
+public:
+	work_stealing_deque( std::size_t log_size = 8 )
+	: top_( 0 )
+	, bottom_( 0 )
+	, array_( new array( log_size ) )
+	{
+		arrays_.emplace_back( array_.load( std::memory_order_relaxed ) );
+	}
+
+	work_stealing_deque( const work_stealing_deque& ) = delete;
+	work_stealing_deque& operator=( const work_stealing_deque& ) = delete;
+
+	/**
+	 * Pushes an element at the bottom. Must only be called by the owner.
+	 */
+	void push( T* t )
+	{
+		std::int64_t b = bottom_.load( std::memory_order_relaxed );
+		std::int64_t top = top_.load( std::memory_order_acquire );
+		array* a = array_.load( std::memory_order_relaxed );
+
+		if ( b - top > static_cast< std::int64_t >( a->size( ) ) - 1 )
+			a = grow( a, b, top );
+
+		a->put( b, t );
+		std::atomic_thread_fence( std::memory_order_release );
+		bottom_.store( b + 1, std::memory_order_relaxed );
+	}
+
+	/**
+	 * Takes the element at the bottom, or returns nullptr if the deque is
+	 * empty. Must only be called by the owner.
+	 */
+	T* take( )
+	{
+		std::int64_t b = bottom_.load( std::memory_order_relaxed ) - 1;
+		array* a = array_.load( std::memory_order_relaxed );
+		bottom_.store( b, std::memory_order_relaxed );
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		std::int64_t top = top_.load( std::memory_order_relaxed );
+
+		if ( top > b )
+		{
+			bottom_.store( b + 1, std::memory_order_relaxed );
+			return nullptr;
+		}
+
+		T* t = a->get( b );
+
+		if ( top == b )
+		{
+			// Last element, race against thieves
+			if ( !top_.compare_exchange_strong(
+				top, top + 1, std::memory_order_seq_cst,
+				std::memory_order_relaxed ) )
+				t = nullptr;
+
+			bottom_.store( b + 1, std::memory_order_relaxed );
+		}
+
+		return t;
+	}
+
+	/**
+	 * Steals the element at the top. Can be called by any thread.
+	 *
+	 * @returns nullptr if the deque was empty or if the steal lost a race.
+	 */
+	T* steal( )
+	{
+		std::int64_t top = top_.load( std::memory_order_acquire );
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		std::int64_t b = bottom_.load( std::memory_order_acquire );
+
+		if ( top >= b )
+			return nullptr;
+
+		array* a = array_.load( std::memory_order_acquire );
+		T* t = a->get( top );
+
+		if ( !top_.compare_exchange_strong(
+			top, top + 1, std::memory_order_seq_cst,
+			std::memory_order_relaxed ) )
+			return nullptr;
+
+		return t;
+	}
+
+	/**
+	 * @returns the approximate number of elements in the deque.
+	 */
+	std::size_t size( ) const
+	{
+		std::int64_t b = bottom_.load( std::memory_order_relaxed );
+		std::int64_t top = top_.load( std::memory_order_relaxed );
+		return b > top ? static_cast< std::size_t >( b - top ) : 0;
+	}
+
+	bool empty( ) const
+	{
+		return size( ) == 0;
+	}
+
+private:
+	class array
+	{
+	public:
+		array( std::size_t log_size )
+		: mask_( ( std::size_t( 1 ) << log_size ) - 1 )
+		, elements_( new std::atomic< T* >[ mask_ + 1 ] )
+		{ }
+
+		std::size_t size( ) const
+		{
+			return mask_ + 1;
+		}
+
+		T* get( std::int64_t i ) const
+		{
+			return elements_[ i & mask_ ].load( std::memory_order_relaxed );
+		}
+
+		void put( std::int64_t i, T* t )
+		{
+			elements_[ i & mask_ ].store( t, std::memory_order_relaxed );
+		}
+
+		array* grow( std::int64_t b, std::int64_t top ) const
+		{
+			std::size_t log_size = 0;
+			while ( ( std::size_t( 1 ) << log_size ) <= size( ) )
+				++log_size;
+
+			auto a = new array( log_size );
+			for ( std::int64_t i = top; i < b; ++i )
+				a->put( i, get( i ) );
+			return a;
+		}
+
+	private:
+		std::size_t mask_;
+		std::unique_ptr< std::atomic< T* >[ ] > elements_;
+	};
+
+	array* grow( array* a, std::int64_t b, std::int64_t top )
+	{
+		auto grown = a->grow( b, top );
+		arrays_.emplace_back( grown );
+		array_.store( grown, std::memory_order_release );
+		return grown;
+	}
+
+	static const std::size_t cache_line = 64;
+
+	std::atomic< std::int64_t > top_;
+	char pad0_[ cache_line - sizeof( std::atomic< std::int64_t > ) ];
+	std::atomic< std::int64_t > bottom_;
+	char pad1_[ cache_line - sizeof( std::atomic< std::int64_t > ) ];
+	std::atomic< array* > array_;
+
+	// Owned by the owner thread
+	std::vector< std::unique_ptr< array > > arrays_;
+};
+
+} } // namespace detail, namespace q
+
+#endif // LIBQ_INTERNAL_WORK_STEALING_DEQUE_HPP
@@ -15,57 +15,216 @@
  */
 
 #include <q/exception.hpp>
+#include <q/detail/pool_allocator.hpp>
 
 #include <q/stacktrace.hpp> // TODO: Remove
 
+#include <atomic>
 #include <iostream>
 
 namespace q {
 
-struct exception::pimpl
+namespace detail {
+
+namespace {
+
+std::size_t align_up( std::size_t size )
+{
+	const std::size_t alignment = std::alignment_of< std::max_align_t >::value;
+	return ( size + alignment - 1 ) & ~( alignment - 1 );
+}
+
+} // anonymous namespace
+
+/**
+ * A reference counted block of up to max_infos infos, which are constructed
+ * in the storage following the block. A block is only added to while it's
+ * not shared, otherwise a new block is started, with the shared block as
+ * its parent, which holds the infos added before it.
+ */
+class exception_info_block
 {
-	std::vector< std::shared_ptr< detail::exception_info_base > > infos_;
+public:
+	static const std::size_t max_infos = 4;
+
+	// Room for a few small infos after the first one of a block
+	static const std::size_t slack = 192;
+
+	struct entry
+	{
+		const std::type_info* type_;
+		exception_info_base* info_;
+	};
+
+	static exception_info_block* construct(
+		std::size_t size, intrusive_ptr< exception_info_block >&& parent )
+	{
+		const auto capacity = size + slack;
+
+		void* ptr = pool_allocate( header_size( ) + capacity );
+
+		return ::new ( ptr ) exception_info_block(
+			capacity, std::move( parent ) );
+	}
+
+	void add_ref( ) noexcept
+	{
+		refs_.fetch_add( 1, std::memory_order_relaxed );
+	}
+
+	void release( ) noexcept
+	{
+		if ( refs_.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+			return;
+
+		for ( std::size_t i = count_; i > 0; --i )
+			entries_[ i - 1 ].info_->~exception_info_base( );
+
+		const auto size = header_size( ) + capacity_;
+
+		this->~exception_info_block( );
+
+		pool_deallocate( this, size );
+	}
+
+	/**
+	 * @returns whether an info of @c size bytes can be added.
+	 */
+	bool has_room( std::size_t size ) const noexcept
+	{
+		return refs_.load( std::memory_order_acquire ) == 1 &&
+			count_ < max_infos &&
+			used_ + align_up( size ) <= capacity_;
+	}
+
+	void* storage( ) noexcept
+	{
+		return reinterpret_cast< char* >( this ) + header_size( ) + used_;
+	}
+
+	void add(
+		const std::type_info& type,
+		exception_info_base* info,
+		std::size_t size ) noexcept
+	{
+		entries_[ count_++ ] = entry{ &type, info };
+		used_ += align_up( size );
+	}
+
+	/**
+	 * Calls @c fn with the entries of this block and its parents, oldest
+	 * first, until it returns true.
+	 */
+	template< typename Fn >
+	bool visit( Fn&& fn ) const
+	{
+		if ( parent_ && parent_->visit( fn ) )
+			return true;
+
+		for ( std::size_t i = 0; i < count_; ++i )
+			if ( fn( entries_[ i ] ) )
+				return true;
+
+		return false;
+	}
+
+private:
+	exception_info_block(
+		std::size_t capacity, intrusive_ptr< exception_info_block >&& parent )
+	: refs_( 0 )
+	, parent_( std::move( parent ) )
+	, capacity_( capacity )
+	, used_( 0 )
+	, count_( 0 )
+	{ }
+
+	static std::size_t header_size( )
+	{
+		return align_up( sizeof( exception_info_block ) );
+	}
+
+	std::atomic< std::size_t > refs_;
+	intrusive_ptr< exception_info_block > parent_;
+	const std::size_t capacity_;
+	std::size_t used_;
+	std::size_t count_;
+	entry entries_[ max_infos ];
 };
 
+} // namespace detail
+
 exception::exception( )
-: pimpl_( new pimpl )
 {
-	*this << get_stacktrace( );
+	if ( get_stacktrace_capture( ) != stacktrace_capture::off )
+		*this << get_stacktrace( );
 }
 
 exception::exception( exception&& ref )
-: pimpl_( std::move( ref.pimpl_ ) )
+: infos_( std::move( ref.infos_ ) )
 { }
 
 exception::exception( const exception& ref )
-: pimpl_( new pimpl )
-{
-	pimpl_->infos_ = ref.pimpl_->infos_;
-}
+: infos_( ref.infos_ )
+{ }
 
 exception::~exception( )
 { }
 
-const std::vector< std::shared_ptr< detail::exception_info_base > >&
-exception::infos( ) const
+std::vector< const detail::exception_info_base* > exception::infos( ) const
+{
+	std::vector< const detail::exception_info_base* > ret;
+
+	if ( infos_ )
+		infos_->visit( [ &ret ](
+			const detail::exception_info_block::entry& entry )
+		{
+			ret.push_back( entry.info_ );
+			return false;
+		} );
+
+	return ret;
+}
+
+void* exception::reserve_info( std::size_t size )
 {
-	return pimpl_->infos_;
+	if ( !infos_ || !infos_->has_room( size ) )
+		infos_ = detail::intrusive_ptr< detail::exception_info_block >(
+			detail::exception_info_block::construct(
+				size, std::move( infos_ ) ) );
+
+	return infos_->storage( );
 }
 
-void exception::add_info( std::shared_ptr< detail::exception_info_base >&& ptr )
+void exception::add_info(
+	const std::type_info& type,
+	detail::exception_info_base* info,
+	std::size_t size ) noexcept
 {
-	pimpl_->infos_.push_back( std::move( ptr ) );
+	infos_->add( type, info, size );
 }
 
-std::vector< std::shared_ptr< detail::exception_info_base > >&
-exception::infos( )
+const detail::exception_info_base*
+exception::find_info( const std::type_info& type ) const
 {
-	return pimpl_->infos_;
+	const detail::exception_info_base* ret = nullptr;
+
+	if ( infos_ )
+		infos_->visit( [ &ret, &type ](
+			const detail::exception_info_block::entry& entry )
+		{
+			if ( *entry.type_ != type )
+				return false;
+
+			ret = entry.info_;
+			return true;
+		} );
+
+	return ret;
 }
 
 std::ostream& operator<<( std::ostream& os, const exception& e )
 {
-	const auto& infos = e.infos( );
+	const auto infos = e.infos( );
 
 	if ( infos.empty( ) )
 	{
@@ -16,65 +16,285 @@
 
 #include <q/promise/signal.hpp>
 
-#include <q/mutex.hpp>
 #include <q/queue.hpp>
 
+#include <iterator>
+#include <vector>
+
 namespace q { namespace detail {
 
 namespace {
 
-struct item
+// The head of a signal's stack once done( ) has been called. It is never
+// dereferenced.
+char sealed_tag;
+
+// The most stages run as one task, after which the chain is enqueued again
+// to let other tasks run.
+const std::size_t max_fused_stages = 64;
+
+/**
+ * Fused tasks are run one after another by the outermost one, rather than
+ * recursively, so that long chains don't grow the stack.
+ */
+struct fusion
 {
-	task task_;
-	queue_ptr queue_;
+	struct stage
+	{
+		task task_;
+		queue_ptr queue_;
+	};
+
+	fusion( )
+	: active_( false )
+	, stages_( 0 )
+	, current_( nullptr )
+	, next_( 0 )
+	{ }
+
+	bool active_;
+	std::size_t stages_;
+	// The queue of the running stage, or null for cancelled stages, which
+	// are run by whichever thread sees the cancellation
+	const queue* current_;
+	// Kept allocated between runs
+	std::vector< stage > pending_;
+	std::size_t next_;
 };
 
-} // anonymous namespace
+thread_local fusion fusion_;
 
-struct promise_signal::pimpl
+/**
+ * @returns whether a stage fused with the running one would run on @c queue.
+ * Outside of fused stages, this is up to the caller of done( ).
+ */
+bool runs_on( const queue_ptr& queue )
 {
-	mutex mutex_;
-	bool done_;
-	std::vector< item > items_;
-};
+	return !fusion_.active_ || fusion_.current_ == queue.get( );
+}
+
+} // anonymous namespace
 
-promise_signal::promise_signal( )
-: pimpl_( new pimpl )
+promise_signal::node* promise_signal::sealed( ) noexcept
 {
-	pimpl_->done_ = false;
+	return reinterpret_cast< node* >( &sealed_tag );
 }
 
-promise_signal::~promise_signal( )
+promise_signal::promise_signal( ) noexcept
+: head_( nullptr )
+, first_claimed_( false )
 { }
 
-void promise_signal::done( ) noexcept // TODO: analyze noexcept here
+promise_signal::~promise_signal( )
 {
+	auto head = head_.load( std::memory_order_acquire );
+
+	if ( head == sealed( ) )
+		return;
+
+	// Never signalled (i.e. a broken promise), just free the continuations
+	while ( head )
 	{
-		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+		auto next = head->next_;
+		if ( head != &first_ )
+			delete head;
+		head = next;
+	}
+}
 
-		pimpl_->done_ = true;
+void promise_signal::done( ) noexcept // TODO: analyze noexcept here
+{
+	auto head = head_.exchange( sealed( ), std::memory_order_acq_rel );
+
+	// The stack is in reverse order of registration
+	node* reversed = nullptr;
+	while ( head )
+	{
+		auto next = head->next_;
+		head->next_ = reversed;
+		reversed = head;
+		head = next;
 	}
 
-	for ( auto item : pimpl_->items_ )
-		item.queue_->push( std::move( item.task_ ) );
+	while ( reversed )
+	{
+		auto item = reversed;
+		reversed = item->next_;
+
+		auto queue = std::move( item->queue_ );
+		dispatch(
+			std::move( item->task_ ),
+			queue,
+			item->fused_,
+			item->cancellable_ );
 
-	pimpl_->items_.clear( );
+		if ( item != &first_ )
+			delete item;
+	}
 }
 
-void promise_signal::push( task&& task, const queue_ptr& queue )
+void promise_signal::push( task&& task,
+                           const queue_ptr& queue,
+                           bool fuse,
+                           bool cancellable )
 {
+	auto head = head_.load( std::memory_order_acquire );
+
+	if ( head == sealed( ) )
 	{
-		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+		dispatch( std::move( task ), queue, false, cancellable );
+		return;
+	}
 
-		if ( !pimpl_->done_ )
+	node* item;
+
+	if ( !first_claimed_.load( std::memory_order_relaxed ) &&
+		!first_claimed_.exchange( true, std::memory_order_relaxed ) )
+	{
+		item = &first_;
+		item->task_ = std::move( task );
+		item->queue_ = queue;
+		item->fused_ = fuse;
+		item->cancellable_ = cancellable;
+	}
+	else
+	{
+		item = new node( std::move( task ), queue, fuse, cancellable );
+	}
+
+	do
+	{
+		if ( head == sealed( ) )
 		{
-			pimpl_->items_.push_back( { std::move( task ), queue } );
+			auto queue = std::move( item->queue_ );
+			dispatch(
+				std::move( item->task_ ), queue, false, cancellable );
+
+			if ( item != &first_ )
+				delete item;
 
 			return;
 		}
+
+		item->next_ = head;
+	}
+	while ( !head_.compare_exchange_weak(
+		head, item,
+		std::memory_order_acq_rel, std::memory_order_acquire ) );
+}
+
+void promise_signal::dispatch( task&& task,
+                               const queue_ptr& queue,
+                               bool fused,
+                               bool cancellable )
+{
+	// Cancelled continuations are run as fused tasks without a queue, so
+	// that a whole cancelled chain unwinds iteratively, right away
+	if ( cancellable && token_.is_cancelled( ) )
+		run_fused( std::move( task ), nullptr );
+	else if ( fused && runs_on( queue ) )
+		run_fused( std::move( task ), queue );
+	else
+		schedule( std::move( task ), queue );
+}
+
+void promise_signal::schedule( task&& task, const queue_ptr& queue )
+{
+	if ( !queue )
+	{
+		auto run = std::move( task );
+		run( );
+	}
+	else if ( !queue->run_inline( task ) )
+		queue->push( std::move( task ) );
+}
+
+void promise_signal::run_fused( task&& task, const queue_ptr& queue )
+{
+	auto& fusion = fusion_;
+
+	if ( fusion.active_ )
+	{
+		if ( queue && fusion.stages_ >= max_fused_stages )
+			queue->push( std::move( task ) );
+		else
+			fusion.pending_.push_back(
+				fusion::stage{ std::move( task ), queue } );
+
+		return;
+	}
+
+	struct scope
+	{
+		scope( struct fusion& fusion )
+		: fusion_( fusion )
+		{
+			fusion_.active_ = true;
+			fusion_.stages_ = 0;
+		}
+
+		~scope( )
+		{
+			fusion_.active_ = false;
+			fusion_.pending_.clear( );
+			fusion_.next_ = 0;
+		}
+
+		struct fusion& fusion_;
+	} scope( fusion );
+
+	auto run = std::move( task );
+	fusion.current_ = queue.get( );
+
+	try
+	{
+		while ( true )
+		{
+			++fusion.stages_;
+			run( );
+
+			if ( fusion.next_ == fusion.pending_.size( ) )
+				break;
+
+			auto& next = fusion.pending_[ fusion.next_++ ];
+			run = std::move( next.task_ );
+			fusion.current_ = next.queue_.get( );
+		}
 	}
+	catch ( ... )
+	{
+		// The stages not yet run may belong to other chains, so they are
+		// scheduled rather than dropped
+		std::vector< fusion::stage > rest(
+			std::make_move_iterator(
+				fusion.pending_.begin( ) + fusion.next_ ),
+			std::make_move_iterator( fusion.pending_.end( ) ) );
 
-	queue->push( std::move( task ) );
+		fusion.active_ = false;
+		fusion.pending_.clear( );
+		fusion.next_ = 0;
+
+		for ( auto& stage : rest )
+		{
+			if ( stage.queue_ )
+			{
+				stage.queue_->push( std::move( stage.task_ ) );
+				continue;
+			}
+
+			// Cancelled stages have no queue to go to. Another
+			// exception from one of them is dropped, as this one is
+			// already propagating.
+			try
+			{
+				run_fused( std::move( stage.task_ ), nullptr );
+			}
+			catch ( ... )
+			{ }
+		}
+
+		throw;
+	}
 }
 
 } } // namespace detail, namespace queue
@@ -18,15 +18,27 @@
 #include <q/mutex.hpp>
 #include <q/memory.hpp>
 #include <q/exception.hpp>
+#include <q/detail/segment_queue.hpp>
+#include <q/detail/hazard_pointer.hpp>
+#include <q/detail/intrusive_ptr.hpp>
 
-#include <queue>
 #include <atomic>
+#include <queue>
 
 // TODO: REMOVE
 #include <iostream>
 
 namespace q {
 
+namespace {
+
+// The queue of the task the current thread is running, if run by a
+// scheduler, and how many inline tasks deep it currently is.
+thread_local const queue* current_queue_ = nullptr;
+thread_local std::size_t current_depth_ = 0;
+
+} // anonymous namespace
+
 mutex queue_mutex_;
 queue_ptr main_queue_;
 queue_ptr background_queue_;
@@ -91,20 +103,125 @@ queue_ptr set_default_queue( queue_ptr queue )
 }
 
 
-// TODO: Consider using a bemaphore instead, and then preferably a non-locking
-// queue altogether. The only thing necessary is that two push-calls from the
-// same thread must follow order.
+namespace {
+
+/**
+ * A reference counted consumer callback. A push( ) takes a reference under
+ * a hazard pointer and calls the callback after releasing it, as the
+ * callback may push to other queues, which would otherwise nest hazard
+ * pointers without bound. The reference of the queue itself is released
+ * through the hazard pointers, once no push( ) can be about to take one.
+ */
+struct notifyer
+{
+	notifyer( queue::notify_type&& fn )
+	: fn_( std::move( fn ) )
+	, refs_( 1 )
+	{ }
+
+	void add_ref( )
+	{
+		refs_.fetch_add( 1, std::memory_order_relaxed );
+	}
+
+	void release( )
+	{
+		if ( refs_.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+			delete this;
+	}
+
+	queue::notify_type fn_;
+	std::atomic< std::size_t > refs_;
+};
+
+void release_notifyer( void* ptr )
+{
+	static_cast< notifyer* >( ptr )->release( );
+}
+
+#ifdef LIBQ_LOCKFREE_QUEUE
+
+typedef detail::segment_queue< task > task_store;
+
+#else
+
+/**
+ * A std::queue guarded by a mutex, with the push( ) and pop( ) of
+ * detail::segment_queue.
+ */
+class task_store
+{
+public:
+	task_store( )
+	: mutex_( Q_HERE, "queue task mutex" )
+	{ }
+
+	void push( task&& t )
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+		tasks_.push( std::move( t ) );
+	}
+
+	bool pop( task& t )
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+		if ( tasks_.empty( ) )
+			return false;
+
+		t = std::move( tasks_.front( ) );
+		tasks_.pop( );
+
+		return true;
+	}
+
+private:
+	mutex mutex_;
+	std::queue< task > tasks_;
+};
+
+#endif // LIBQ_LOCKFREE_QUEUE
+
+} // anonymous namespace
+
+// The tasks are stored in a mutex guarded queue, or with LIBQ_LOCKFREE_QUEUE
+// in a lock-free queue, both of which guarantee that two push-calls from the
+// same thread follow order. The consumer is notified without a lock either
+// way, and the mutex below is only used when setting a new consumer, which is
+// expected to be rare.
 struct queue::pimpl
 {
 	pimpl( priority_t priority )
 	: priority_( priority )
+	, weight_( 1024 )
+	, cpu_quota_( 0 )
+	, consumed_time_( 0 )
+	, inline_depth_( 0 )
+	, fusion_( false )
+	, size_( 0 )
+	, notify_( nullptr )
 	, mutex_( Q_HERE, "queue mutex" )
 	{ }
 
+	~pimpl( )
+	{
+		if ( auto notify = notify_.load( std::memory_order_relaxed ) )
+			notify->release( );
+	}
+
 	const priority_t priority_;
+	std::atomic< std::size_t > weight_;
+	std::atomic< double > cpu_quota_;
+	std::atomic< std::chrono::nanoseconds::rep > consumed_time_;
+	std::atomic< std::size_t > inline_depth_;
+	std::atomic< bool > fusion_;
+	std::atomic< std::size_t > size_;
+	// Replaced notifyers are released through hazard pointers, as a
+	// concurrent push may be about to take a reference.
+	std::atomic< notifyer* > notify_;
+	task_store queue_;
+
 	mutex mutex_;
-	queue::notify_type notify_;
-	std::queue< task > queue_;
 };
 
 queue_ptr queue::make( priority_t priority )
@@ -123,20 +240,23 @@ queue::~queue( )
 
 void queue::push( task&& task )
 {
-	notify_type notifyer;
-	std::size_t size;
+	pimpl_->queue_.push( std::move( task ) );
 
-	{
-		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_, Q_HERE, "queue::push" );
+	// Sequentially consistent, as is the store of the notifyer and the load
+	// of the size in set_consumer( ): either this push sees the new
+	// notifyer, or set_consumer( ) counts this task, or both.
+	auto size = pimpl_->size_.fetch_add( 1, std::memory_order_seq_cst ) + 1;
 
-		pimpl_->queue_.push( std::move( task ) );
+	detail::intrusive_ptr< notifyer > notify;
 
-		notifyer = pimpl_->notify_;
-		size = pimpl_->queue_.size( );
+	{
+		detail::hazard_pointer hp;
+		notify = detail::intrusive_ptr< notifyer >(
+			hp.protect( pimpl_->notify_ ) );
 	}
 
-	if ( notifyer )
-		notifyer( size );
+	if ( notify )
+		notify->fn_( size );
 }
 
 priority_t queue::priority( ) const
@@ -144,34 +264,124 @@ priority_t queue::priority( ) const
 	return pimpl_->priority_;
 }
 
+void queue::set_weight( std::size_t weight )
+{
+	pimpl_->weight_.store( weight ? weight : 1, std::memory_order_relaxed );
+}
+
+std::size_t queue::weight( ) const
+{
+	return pimpl_->weight_.load( std::memory_order_relaxed );
+}
+
+void queue::set_cpu_quota( double quota )
+{
+	pimpl_->cpu_quota_.store( quota, std::memory_order_relaxed );
+}
+
+double queue::cpu_quota( ) const
+{
+	return pimpl_->cpu_quota_.load( std::memory_order_relaxed );
+}
+
+std::chrono::nanoseconds queue::consumed_time( ) const
+{
+	return std::chrono::nanoseconds(
+		pimpl_->consumed_time_.load( std::memory_order_relaxed ) );
+}
+
+void queue::add_consumed_time( std::chrono::nanoseconds time )
+{
+	pimpl_->consumed_time_.fetch_add(
+		time.count( ), std::memory_order_relaxed );
+}
+
+void queue::set_inline_depth( std::size_t max_depth )
+{
+	pimpl_->inline_depth_.store( max_depth, std::memory_order_relaxed );
+}
+
+std::size_t queue::inline_depth( ) const
+{
+	return pimpl_->inline_depth_.load( std::memory_order_relaxed );
+}
+
+void queue::set_fusion( bool enabled )
+{
+	pimpl_->fusion_.store( enabled, std::memory_order_relaxed );
+}
+
+bool queue::fusion( ) const
+{
+	return pimpl_->fusion_.load( std::memory_order_relaxed );
+}
+
 std::size_t queue::set_consumer( queue::notify_type fn )
 {
 	Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_, Q_HERE, "queue::set_consumer" );
 
-	std::size_t backlog = pimpl_->queue_.size( );
-	pimpl_->notify_ = fn;
+	auto notify = fn ? new notifyer( std::move( fn ) ) : nullptr;
+
+	auto old = pimpl_->notify_.exchange(
+		notify, std::memory_order_seq_cst );
+
+	if ( old )
+		detail::retire_hazardous( old, &release_notifyer );
 
-	return backlog;
+	return pimpl_->size_.load( std::memory_order_seq_cst );
 }
 
 bool queue::empty( )
 {
-	return pimpl_->queue_.empty( );
+	return pimpl_->size_.load( std::memory_order_seq_cst ) == 0;
+}
+
+queue::current_scope::current_scope( const queue* queue ) noexcept
+: previous_( current_queue_ )
+, previous_depth_( current_depth_ )
+{
+	current_queue_ = queue;
+	current_depth_ = 0;
+}
+
+queue::current_scope::~current_scope( )
+{
+	current_queue_ = previous_;
+	current_depth_ = previous_depth_;
+}
+
+bool queue::run_inline( task& task )
+{
+	if ( current_queue_ != this ||
+		current_depth_ >= pimpl_->inline_depth_.load(
+			std::memory_order_relaxed ) )
+		return false;
+
+	struct depth_guard
+	{
+		depth_guard( ) { ++current_depth_; }
+		~depth_guard( ) { --current_depth_; }
+	} guard;
+
+	// Destroy the task once run, as it may own the last reference to state
+	// it was stored in
+	auto run = std::move( task );
+	run( );
+
+	return true;
 }
 
 task queue::pop( )
 {
-	Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_, Q_HERE, "queue::pop" );
+	task task;
 
-	if ( pimpl_->queue_.empty( ) )
+	if ( !pimpl_->queue_.pop( task ) )
 	{
 		/* TODO: , "queue::pop: Queue empty" */
 		Q_THROW( queue_exception( ) );
 	}
 
-	task task = std::move( pimpl_->queue_.front( ) );
-
-	pimpl_->queue_.pop( );
+	pimpl_->size_.fetch_sub( 1, std::memory_order_acq_rel );
 
 	return std::move( task );
 }
@@ -15,208 +15,648 @@
  */
 
 #include <q/scheduler.hpp>
+#include <q/mutex.hpp>
 
 #include <vector>
-#include <forward_list>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#include <time.h>
 
 namespace q {
 
-template< typename T >
-class circular_list
+namespace {
+
+struct ready_level;
+
+/**
+ * The scheduler's bookkeeping of one of its queues. While the queue has
+ * tasks, it is linked into the ready list of its priority level.
+ *
+ * Entries are shared with the consumer callback of the queue, so an entry
+ * outlives its removal until the last push( ) which may notify it is done.
+ */
+struct scheduled_queue
+: std::enable_shared_from_this< scheduled_queue >
 {
-public:
-	circular_list( )
+	scheduled_queue( queue_ptr queue, ready_level* level )
+	: queue_( std::move( queue ) )
+	, level_( level )
+	, ready_( false )
+	, attached_( true )
+	, prev_( nullptr )
+	, next_( nullptr )
+	, vruntime_( 0 )
+	, period_time_( 0 )
+	, throttled_( false )
+	{ }
+
+	queue_ptr queue_;
+	ready_level* level_;
+
+	// Written under the scheduler mutex, read without it by pushers
+	std::atomic< bool > ready_;
+	std::atomic< bool > attached_;
+
+	// Strict priority
+	scheduled_queue* prev_;
+	scheduled_queue* next_;
+
+	// Fair share. The virtual runtime is the consumed CPU time (in ns)
+	// scaled by the weight of the queue.
+	std::int64_t vruntime_;
+	std::int64_t period_time_;
+	bool throttled_;
+};
+
+struct by_vruntime
+{
+	bool operator( )( const scheduled_queue* a,
+	                  const scheduled_queue* b ) const
 	{
-		next_ = list_.begin( );
+		if ( a->vruntime_ != b->vruntime_ )
+			return a->vruntime_ < b->vruntime_;
+		return std::less< const scheduled_queue* >( )( a, b );
 	}
+};
 
-	void add( T&& t )
-	{
-		auto set_next = empty( );
+typedef std::set< scheduled_queue*, by_vruntime > vruntime_set;
+
+const std::int64_t default_weight = 1024;
+
+// The period within which CPU quotas are enforced
+const std::chrono::milliseconds quota_period( 100 );
+
+std::int64_t thread_cpu_time( )
+{
+	struct timespec ts;
+	::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+	return std::int64_t( ts.tv_sec ) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * A circular, intrusive list of the ready queues of one priority. The head
+ * is the next queue to pop from, which gives round-robin between queues.
+ */
+struct ready_level
+{
+	ready_level( priority_t priority )
+	: priority_( priority )
+	, index_( 0 )
+	, head_( nullptr )
+	{ }
 
-		list_.push_front( std::move( t ) );
+	priority_t priority_;
+	std::size_t index_;
+	scheduled_queue* head_;
+};
 
-		if ( set_next )
-			next_ = list_.begin( );
+/**
+ * A bitmap of which priority levels have ready queues.
+ */
+class level_bitmap
+{
+public:
+	void resize( std::size_t levels )
+	{
+		words_.assign( ( levels + bits - 1 ) / bits, 0 );
 	}
 
-	void remove( T&& t )
+	void set( std::size_t index )
 	{
-		; // TODO: Implement
+		words_[ index / bits ] |= std::uint64_t( 1 ) << ( index % bits );
+	}
+
+	void clear( std::size_t index )
+	{
+		words_[ index / bits ] &= ~( std::uint64_t( 1 ) << ( index % bits ) );
 	}
 
 	/**
-	 * Returns a pointer to the "next" element, or nullptr if the circular
-	 * list is empty.
+	 * @returns the index of the first set bit, or npos if none is set.
 	 */
-	T* next( )
+	std::size_t find_first( ) const
 	{
-		if ( list_.empty( ) )
-			return nullptr;
+		for ( std::size_t i = 0; i < words_.size( ); ++i )
+			if ( words_[ i ] )
+				return i * bits + __builtin_ctzll( words_[ i ] );
+		return npos;
+	}
+
+	static const std::size_t npos = std::size_t( -1 );
 
-		auto ret = next_;
+private:
+	static const std::size_t bits = 64;
+
+	std::vector< std::uint64_t > words_;
+};
 
-		traverse( );
+} // anonymous namespace
 
-		return &*ret;
+struct scheduler::pimpl
+{
+	pimpl( event_dispatcher_ptr event_dispatcher,
+	       scheduler::budget budget,
+	       scheduler::policy policy )
+	: event_dispatcher_( event_dispatcher )
+	, mutex_( Q_HERE, "scheduler" )
+	, budget_( budget )
+	, policy_( policy )
+	, min_vruntime_( 0 )
+	, pending_( 0 )
+	, activations_( 0 )
+	{ }
+
+	event_dispatcher_ptr event_dispatcher_;
+	// Runners may be invoked concurrently by multi-threaded dispatchers
+	mutex mutex_;
+	scheduler::budget budget_;
+	const scheduler::policy policy_;
+
+	// Priority levels in the order they are drained, i.e. ascending
+	std::vector< std::unique_ptr< ready_level > > levels_;
+	level_bitmap ready_levels_;
+
+	// Ready queues when using the fair share policy, ordered by virtual
+	// runtime, and those of them which have exceeded their CPU quota.
+	vruntime_set fair_ready_;
+	vruntime_set throttled_;
+	std::int64_t min_vruntime_;
+	std::chrono::steady_clock::time_point period_end_;
+
+	std::unordered_map<
+		const queue*, std::shared_ptr< scheduled_queue >
+	> queues_;
+
+	// Tasks pushed to the queues but not yet claimed by an activation
+	std::atomic< std::size_t > pending_;
+	// Activations posted to, or running on, the event dispatcher
+	std::atomic< std::size_t > activations_;
+
+	bool claim_task( )
+	{
+		auto pending = pending_.load( std::memory_order_seq_cst );
+		while ( pending > 0 )
+			if ( pending_.compare_exchange_weak(
+				pending, pending - 1, std::memory_order_seq_cst ) )
+				return true;
+		return false;
 	}
 
-	template< typename Cond >
-	T* find_first( Cond&& cond )
+	ready_level* level( priority_t priority );
+	void link( scheduled_queue* entry );
+	void unlink( scheduled_queue* entry );
+	bool make_ready( scheduled_queue* entry );
+	scheduled_queue* next_ready( );
+	void after_pop( scheduled_queue* entry );
+	task pop_task( std::shared_ptr< scheduled_queue >& entry,
+	               const queue*& current );
+
+	bool fair( ) const
 	{
-		if ( list_.empty( ) )
-			return nullptr;
+		return policy_ == scheduler::policy::fair_share;
+	}
 
-		auto here = next_;
+	vruntime_set& fair_set( scheduled_queue* entry )
+	{
+		return entry->throttled_ ? throttled_ : fair_ready_;
+	}
 
-		do
+	void charge( scheduled_queue* entry, std::int64_t time );
+	void begin_period( );
+};
+
+ready_level* scheduler::pimpl::level( priority_t priority )
+{
+	auto iter = std::lower_bound(
+		levels_.begin( ),
+		levels_.end( ),
+		priority,
+		[ ]( const std::unique_ptr< ready_level >& level, priority_t p )
 		{
-			if ( Cond( *next_ ) )
-			{
-				auto ret = next_;
+			return level->priority_ < p;
+		} );
 
-				traverse( );
+	if ( iter != levels_.end( ) && ( *iter )->priority_ == priority )
+		return iter->get( );
 
-				return &*ret;
-			}
+	// New priority, re-index all levels (which is rare)
+	iter = levels_.insert(
+		iter, std::unique_ptr< ready_level >( new ready_level( priority ) ) );
 
-			traverse( );
-		} while ( here != next_ );
+	ready_levels_.resize( levels_.size( ) );
 
-		return nullptr;
+	for ( std::size_t i = 0; i < levels_.size( ); ++i )
+	{
+		levels_[ i ]->index_ = i;
+		if ( levels_[ i ]->head_ )
+			ready_levels_.set( i );
 	}
 
-	bool empty( ) const
+	return iter->get( );
+}
+
+void scheduler::pimpl::link( scheduled_queue* entry )
+{
+	if ( fair( ) )
 	{
-		return list_.empty( );
+		// Queues which have been idle don't get to catch up
+		entry->vruntime_ = std::max( entry->vruntime_, min_vruntime_ );
+		fair_set( entry ).insert( entry );
+		entry->ready_.store( true, std::memory_order_seq_cst );
+		return;
 	}
 
-private:
-	void traverse( )
+	auto level = entry->level_;
+
+	if ( level->head_ )
 	{
-		if ( ++next_ == list_.end( ) )
-			next_ = list_.begin( );
+		auto tail = level->head_->prev_;
+		entry->prev_ = tail;
+		entry->next_ = level->head_;
+		tail->next_ = entry;
+		level->head_->prev_ = entry;
+	}
+	else
+	{
+		entry->prev_ = entry;
+		entry->next_ = entry;
+		level->head_ = entry;
+		ready_levels_.set( level->index_ );
 	}
 
-	std::forward_list< T > list_;
-	typename std::forward_list< T >::iterator next_;
-};
+	entry->ready_.store( true, std::memory_order_seq_cst );
+}
 
-template< typename P, typename T >
-class round_robin_priority_list
+void scheduler::pimpl::unlink( scheduled_queue* entry )
 {
-public:
-	round_robin_priority_list( ) = default;
-
-	void add( P&& priority, T&& elem )
+	if ( fair( ) )
 	{
-		auto iter = std::lower_bound(
-			list_.begin( ),
-			list_.end( ),
-			priority );
+		fair_set( entry ).erase( entry );
+		entry->ready_.store( false, std::memory_order_seq_cst );
+		return;
+	}
 
-		if ( iter == list_.end( ) || iter->priority_ != priority )
-		{
-			// Insert new unique priority circular list
-			element_type element{ std::move( priority ) };
-			iter = list_.insert( iter, std::move( element ) );
-		}
+	auto level = entry->level_;
 
-		iter->circular_list_.add( std::move( elem ) );
+	if ( entry->next_ == entry )
+	{
+		level->head_ = nullptr;
+		ready_levels_.clear( level->index_ );
 	}
-
-	void remove( P&& priority, T&& elem )
+	else
 	{
-		// TODO: Implement
+		entry->prev_->next_ = entry->next_;
+		entry->next_->prev_ = entry->prev_;
+		if ( level->head_ == entry )
+			level->head_ = entry->next_;
 	}
 
-	template< typename Cond >
-	T* find_first( Cond&& condition )
+	entry->prev_ = entry->next_ = nullptr;
+	entry->ready_.store( false, std::memory_order_seq_cst );
+}
+
+/**
+ * Called on push. Links the queue into its ready list unless it's already
+ * there, which is the common case and doesn't need the lock.
+ *
+ * @returns false if the queue has been removed from the scheduler.
+ */
+bool scheduler::pimpl::make_ready( scheduled_queue* entry )
+{
+	// Pairs with the fence in after_pop( ): either we see the queue as not
+	// ready, or after_pop( ) sees our task.
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+
+	if ( entry->ready_.load( std::memory_order_seq_cst ) )
+		return true;
+
+	Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+	if ( !entry->attached_.load( std::memory_order_relaxed ) )
+		return false;
+
+	if ( !entry->ready_.load( std::memory_order_relaxed ) )
+		link( entry );
+
+	return true;
+}
+
+scheduled_queue* scheduler::pimpl::next_ready( )
+{
+	if ( fair( ) )
 	{
-		for ( auto& elem : list_ )
+		if ( std::chrono::steady_clock::now( ) >= period_end_ )
+			begin_period( );
+
+		if ( !fair_ready_.empty( ) )
 		{
-			if ( !elem.circular_list_.empty( ) )
-			{
-				auto pelem = elem.circular_list_.find_first( condition );
-				if ( pelem )
-					return pelem;
-			}
+			auto entry = *fair_ready_.begin( );
+			min_vruntime_ = std::max( min_vruntime_, entry->vruntime_ );
+			return entry;
 		}
 
+		// Throttled queues may use otherwise idle capacity
+		if ( !throttled_.empty( ) )
+			return *throttled_.begin( );
+
 		return nullptr;
 	}
 
-private:
-	struct element_type
+	auto index = ready_levels_.find_first( );
+
+	if ( index == level_bitmap::npos )
+		return nullptr;
+
+	return levels_[ index ]->head_;
+}
+
+/**
+ * Moves on to the next queue of the same priority, and unlinks the queue if
+ * it was drained.
+ */
+void scheduler::pimpl::after_pop( scheduled_queue* entry )
+{
+	entry->ready_.store( false, std::memory_order_seq_cst );
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+
+	if ( entry->queue_->empty( ) )
 	{
-		P priority_;
-		circular_list< T > circular_list_;
+		unlink( entry );
+	}
+	else
+	{
+		entry->ready_.store( true, std::memory_order_seq_cst );
+		if ( !fair( ) )
+			entry->level_->head_ = entry->next_;
+	}
+}
 
-		operator P( ) const
-		{
-			return priority_;
-		}
-	};
+/**
+ * Pops the next task. When measuring CPU time, @c entry is set to the queue
+ * it came from, which keeps the entry alive if the queue is removed while
+ * the task runs.
+ */
+task scheduler::pimpl::pop_task( std::shared_ptr< scheduled_queue >& entry,
+                                 const queue*& current )
+{
+	Q_AUTO_UNIQUE_LOCK( mutex_ );
 
-	std::vector< element_type > list_;
-};
+	auto ready = next_ready( );
 
-struct scheduler::pimpl
+	if ( !ready )
+		// The task was in a queue which has since been removed
+		return task( );
+
+	// The entry's queue may be removed while the task runs
+	current = ready->queue_.get( );
+
+	task ret = ready->queue_->pop( );
+
+	after_pop( ready );
+
+	if ( fair( ) )
+		entry = ready->shared_from_this( );
+
+	return ret;
+}
+
+/**
+ * Accounts CPU time consumed by a task of a queue, and re-orders the queue
+ * accordingly.
+ */
+void scheduler::pimpl::charge( scheduled_queue* entry, std::int64_t time )
 {
-	pimpl( event_dispatcher_ptr event_dispatcher )
-	: event_dispatcher_( event_dispatcher )
-	{ }
+	Q_AUTO_UNIQUE_LOCK( mutex_ );
 
-	event_dispatcher_ptr event_dispatcher_;
-	round_robin_priority_list< priority_t, queue_ptr > queues_;
-};
+	if ( !entry->queue_ )
+		// Removed while the task ran
+		return;
 
+	auto& queue = *entry->queue_;
 
-scheduler::scheduler( event_dispatcher_ptr event_dispatcher )
-: pimpl_( new pimpl( event_dispatcher ) )
+	queue.add_consumed_time( std::chrono::nanoseconds( time ) );
+
+	const bool linked = entry->ready_.load( std::memory_order_relaxed );
+
+	if ( linked )
+		fair_set( entry ).erase( entry );
+
+	const auto weight = static_cast< std::int64_t >( queue.weight( ) );
+	entry->vruntime_ += time * default_weight / weight;
+	entry->period_time_ += time;
+
+	const double quota = queue.cpu_quota( );
+
+	if ( quota > 0 && !entry->throttled_ )
+	{
+		const double capacity = std::chrono::duration_cast<
+			std::chrono::nanoseconds >( quota_period ).count( ) *
+			static_cast< double >( std::max< std::size_t >(
+				1, event_dispatcher_->parallelism( ) ) );
+
+		if ( entry->period_time_ > quota * capacity )
+			entry->throttled_ = true;
+	}
+
+	if ( linked )
+		fair_set( entry ).insert( entry );
+}
+
+void scheduler::pimpl::begin_period( )
+{
+	period_end_ = std::chrono::steady_clock::now( ) + quota_period;
+
+	for ( auto& entry : queues_ )
+	{
+		entry.second->period_time_ = 0;
+		entry.second->throttled_ = false;
+	}
+
+	for ( auto entry : throttled_ )
+		fair_ready_.insert( entry );
+
+	throttled_.clear( );
+}
+
+
+scheduler::scheduler( event_dispatcher_ptr event_dispatcher,
+                      budget budget,
+                      policy policy )
+: pimpl_( new pimpl( event_dispatcher, budget, policy ) )
 { }
 
 scheduler::~scheduler( )
-{ }
+{
+	// The entries may outlive the scheduler in notifyers which are yet to
+	// be reclaimed, but mustn't keep the queues alive
+	for ( auto& entry : pimpl_->queues_ )
+	{
+		entry.second->queue_->set_consumer( queue::notify_type( ) );
+		entry.second->queue_.reset( );
+	}
+}
 
 void scheduler::add_queue( queue_ptr queue )
 {
-	pimpl_->queues_.add( queue->priority( ), queue_ptr( queue ) );
+	std::shared_ptr< scheduled_queue > entry;
+
+	{
+		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+
+		auto& slot = pimpl_->queues_[ queue.get( ) ];
+		if ( slot )
+			// Already attached
+			return;
+
+		auto level = pimpl_->level( queue->priority( ) );
+
+		slot = std::make_shared< scheduled_queue >( queue, level );
+		entry = slot;
+	}
+
+	auto backlog = queue->set_consumer( [ this, entry ]( std::size_t )
+	{
+		if ( pimpl_->make_ready( entry.get( ) ) )
+			poke( );
+	} );
+
+	if ( backlog > 0 && pimpl_->make_ready( entry.get( ) ) )
+		poke( backlog );
+}
+
+void scheduler::remove_queue( queue_ptr queue )
+{
+	{
+		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+
+		auto iter = pimpl_->queues_.find( queue.get( ) );
+		if ( iter == pimpl_->queues_.end( ) )
+			return;
+
+		auto entry = iter->second.get( );
 
-	auto backlog = queue->set_consumer( std::bind( &scheduler::poke, this ) );
+		if ( entry->ready_.load( std::memory_order_relaxed ) )
+			pimpl_->unlink( entry );
+
+		entry->attached_.store( false, std::memory_order_relaxed );
+		entry->queue_.reset( );
+
+		pimpl_->queues_.erase( iter );
+	}
 
-	for ( auto i = backlog; i > 0; --i )
-		poke( );
+	// Tasks left in the queue which were counted as pending are skipped
+	// by pop_task( ).
+	queue->set_consumer( queue::notify_type( ) );
 }
 
-void scheduler::poke( )
+void scheduler::set_budget( budget budget )
 {
-	auto This = shared_from_this( );
+	Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+	pimpl_->budget_ = budget;
+}
+
+void scheduler::poke( std::size_t tasks )
+{
+	pimpl_->pending_.fetch_add( tasks, std::memory_order_seq_cst );
+
+	activate( );
+}
 
-	auto runner = [ This ]( ) mutable
+void scheduler::activate( )
+{
+	const std::size_t max_activations = std::max< std::size_t >(
+		1, pimpl_->event_dispatcher_->parallelism( ) );
+
+	auto activations = pimpl_->activations_.load( std::memory_order_seq_cst );
+
+	do
 	{
-		// TODO: Ensure this doesn't throw...
-		auto t = This->next_task( );
-		t( );
-	};
+		if ( activations >= max_activations )
+			// The running activations will pick up the new tasks
+			return;
+	} while ( !pimpl_->activations_.compare_exchange_weak(
+		activations, activations + 1, std::memory_order_seq_cst ) );
+
+	auto This = shared_from_this( );
 
-	pimpl_->event_dispatcher_->add_task( std::move( runner ) );
+	pimpl_->event_dispatcher_->add_task( [ This ]( )
+	{
+		This->run_batch( );
+	} );
 }
 
-task scheduler::next_task( )
+void scheduler::run_batch( )
 {
-	auto condition = [ ]( queue_ptr queue )
+	budget budget;
+	{
+		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+		budget = pimpl_->budget_;
+	}
+
+	const auto deadline = std::chrono::steady_clock::now( ) + budget.time;
+
+	std::size_t done = 0;
+
+	const bool measure = pimpl_->fair( );
+
+	while ( pimpl_->claim_task( ) )
 	{
-		return !queue->empty( );
-	};
+		std::shared_ptr< scheduled_queue > entry;
+		const queue* current = nullptr;
+
+		// TODO: Ensure this doesn't throw...
+		auto t = pimpl_->pop_task( entry, current );
+		if ( !t )
+			continue;
+
+		queue::current_scope scope( current );
+
+		if ( measure )
+		{
+			auto start = thread_cpu_time( );
+			t( );
+			pimpl_->charge( entry.get( ), thread_cpu_time( ) - start );
+		}
+		else
+		{
+			t( );
+		}
+
+		++done;
+
+		bool exhausted =
+			( budget.tasks && done >= budget.tasks ) ||
+			( budget.time.count( ) &&
+			  std::chrono::steady_clock::now( ) >= deadline );
+
+		if ( exhausted )
+		{
+			if ( pimpl_->pending_.load( std::memory_order_seq_cst ) == 0 )
+				break;
+
+			// Yield to the event dispatcher, but keep this activation
+			auto This = shared_from_this( );
+
+			pimpl_->event_dispatcher_->add_task( [ This ]( )
+			{
+				This->run_batch( );
+			} );
 
-	auto pqueue = pimpl_->queues_.find_first( condition );
+			return;
+		}
+	}
 
-	if ( !pqueue )
-		throw 0; // TODO: Throw something good here as this should never happen! Or allow this to happen if it helps building a lock-free queue.
+	pimpl_->activations_.fetch_sub( 1, std::memory_order_seq_cst );
 
-	task ret = ( *pqueue )->pop( );
-	return std::move( ret );
+	// A task may have been poked while all activations were busy, after
+	// this activation stopped claiming tasks.
+	if ( pimpl_->pending_.load( std::memory_order_seq_cst ) > 0 )
+		activate( );
 }
 
 } // namespace q
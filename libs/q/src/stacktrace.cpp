@@ -14,12 +14,15 @@
  * limitations under the License.
  */
 
-#include "detail/stacktrace.hpp"
-#include <q/abi.hpp>
+#include "detail/symbolizer.hpp"
+#include <q/stacktrace.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
 
@@ -29,15 +32,85 @@
 
 namespace q {
 
+namespace {
+
+std::size_t format_hex( char* buf, std::size_t size, std::uintptr_t value )
+{
+	return snprintf( buf, size, "0x%" PRIxPTR, value );
+}
+
+std::size_t frame_number_width( std::size_t max_frame )
+{
+	char buf[ 24 ];
+	snprintf( buf, sizeof buf, "%zu", max_frame );
+	return std::strlen( buf );
+}
+
+void print_frame(
+	std::ostream& os, std::size_t frame_width, std::size_t lib_width,
+	std::size_t addr_width, std::size_t frame, const char* lib,
+	const char* addr, const char* symbol, const char* extra )
+{
+	os << "Frame " << std::setfill( ' ' )
+	<< std::setw( frame_width ) << frame << ": "
+	<< std::setw( lib_width ) << std::left << lib << std::right
+	<< std::setw( addr_width ) << addr << " "
+	<< symbol << " "
+	<< extra << std::endl;
+}
+
+} // anonymous namespace
+
+const std::size_t stacktrace::max_addresses;
+
+stacktrace::stacktrace( stacktrace&& ref )
+: size_( ref.size_ )
+, frames_( std::move( ref.frames_ ) )
+{
+	std::copy( ref.addresses_, ref.addresses_ + size_, addresses_ );
+}
+
 stacktrace::stacktrace( std::vector< frame >&& frames )
-: frames_( std::move( frames ) )
+: size_( 0 )
+, frames_( std::move( frames ) )
 { }
 
+stacktrace::stacktrace( void* const* addresses, std::size_t size )
+: size_( std::min( size, max_addresses ) )
+{
+	std::copy( addresses, addresses + size_, addresses_ );
+}
+
 const std::vector< stacktrace::frame >& stacktrace::frames( ) const
 {
+	std::call_once( symbolized_, [ this ]( ) { symbolize( ); } );
+
 	return frames_;
 }
 
+void stacktrace::symbolize( ) const
+{
+	// Already symbolized if moved from a symbolized stack trace
+	if ( !size_ || !frames_.empty( ) )
+		return;
+
+	frames_.reserve( size_ );
+
+	char addr[ 24 ];
+	char extra[ 24 ];
+
+	for ( std::size_t i = 0; i < size_; ++i )
+	{
+		auto& symbol = detail::symbolize( addresses_[ i ] );
+
+		format_hex( addr, sizeof addr,
+			reinterpret_cast< std::uintptr_t >( symbol.address ) );
+		format_hex( extra, sizeof extra, symbol.offset );
+
+		frames_.push_back( frame{ i, symbol.lib, addr, symbol.name, extra } );
+	}
+}
+
 std::string stacktrace::string( ) const
 {
 	std::stringstream ss;
@@ -47,6 +120,41 @@ std::string stacktrace::string( ) const
 
 std::ostream& operator<<( std::ostream& os, const stacktrace& st )
 {
+	if ( st.size_ )
+	{
+		// Printed directly from the symbol cache, without building the
+		// frames
+		const detail::symbol* symbols[ stacktrace::max_addresses ];
+		std::size_t max_lib  = 0;
+		std::size_t max_addr = 0;
+
+		char addr[ 24 ];
+		char extra[ 24 ];
+
+		for ( std::size_t i = 0; i < st.size_; ++i )
+		{
+			symbols[ i ] = &detail::symbolize( st.addresses_[ i ] );
+
+			max_lib = std::max( max_lib, std::strlen( symbols[ i ]->lib ) );
+			max_addr = std::max( max_addr, format_hex( addr, sizeof addr,
+				reinterpret_cast< std::uintptr_t >( st.addresses_[ i ] ) ) );
+		}
+
+		const auto frame_width = frame_number_width( st.size_ - 1 );
+
+		for ( std::size_t i = 0; i < st.size_; ++i )
+		{
+			format_hex( addr, sizeof addr,
+				reinterpret_cast< std::uintptr_t >( st.addresses_[ i ] ) );
+			format_hex( extra, sizeof extra, symbols[ i ]->offset );
+
+			print_frame( os, frame_width, max_lib + 1, max_addr, i,
+				symbols[ i ]->lib, addr, symbols[ i ]->name, extra );
+		}
+
+		return os;
+	}
+
 	std::size_t max_frame = 0;
 	std::size_t max_lib   = 0;
 	std::size_t max_addr  = 0;
@@ -61,19 +169,12 @@ std::ostream& operator<<( std::ostream& os, const stacktrace& st )
 			max_addr = frame.addr.size( );
 	}
 
-	char buf[16];
-	snprintf( buf, sizeof buf, "%lu", max_frame );
-	max_frame = std::strlen( buf );
-
-	max_lib += 1;
+	const auto frame_width = frame_number_width( max_frame );
 
 	for ( auto& frame : st.frames( ) )
-		os << "Frame " << std::setfill( ' ' )
-		<< std::setw( max_frame ) << frame.frame << ": "
-		<< std::setw( max_lib ) << std::left << frame.lib << std::right
-		<< std::setw( max_addr ) << frame.addr << " "
-		<< frame.symbol << " "
-		<< frame.extra << std::endl;
+		print_frame( os, frame_width, max_lib + 1, max_addr, frame.frame,
+			frame.lib.c_str( ), frame.addr.c_str( ),
+			frame.symbol.c_str( ), frame.extra.c_str( ) );
 	return os;
 }
 
@@ -81,26 +182,20 @@ namespace {
 
 std::atomic< stacktrace_function > _stacktrace_function( nullptr );
 
+std::atomic< stacktrace_capture > _stacktrace_capture(
+	stacktrace_capture::addresses );
+
 stacktrace default_stacktrace( )
 {
-	static const std::size_t buflen = 128;
-	void* addresses[ buflen ];
-	std::size_t size = backtrace( addresses, buflen );
+	void* addresses[ stacktrace::max_addresses ];
+	std::size_t size = backtrace( addresses, stacktrace::max_addresses );
 
-	char** raw_frames = backtrace_symbols( addresses, size );
+	stacktrace ret( addresses, size );
 
-	std::vector< stacktrace::frame > frames;
-	frames.reserve( size );
-
-	for ( std::size_t i = 0; i < size; ++i )
-	{
-		auto frame = ::q::detail::parse_stack_frame( raw_frames[ i ] );
-		frame.frame = i;
-		frame.symbol = demangle_cxx( frame.symbol.c_str( ) );
-		frames.push_back( frame );
-	}
+	if ( get_stacktrace_capture( ) == stacktrace_capture::full )
+		ret.frames( );
 
-	return stacktrace( std::move( frames ) );
+	return ret;
 }
 
 } // anonymous namespace
@@ -110,6 +205,16 @@ stacktrace_function register_stacktrace_function( stacktrace_function fn )
 	return _stacktrace_function.exchange( fn, std::memory_order_seq_cst );
 }
 
+void set_stacktrace_capture( stacktrace_capture capture )
+{
+	_stacktrace_capture.store( capture, std::memory_order_relaxed );
+}
+
+stacktrace_capture get_stacktrace_capture( )
+{
+	return _stacktrace_capture.load( std::memory_order_relaxed );
+}
+
 stacktrace get_stacktrace( )
 {
 	stacktrace_function fn = _stacktrace_function.load(
@@ -16,9 +16,14 @@
 
 #include <q/threadpool.hpp>
 #include <q/mutex.hpp>
+#include <q/detail/segment_queue.hpp>
+#include <q/detail/pool_allocator.hpp>
+
+#include "detail/work_stealing_deque.hpp"
 
 #include <thread>
 #include <queue>
+#include <random>
 #include <condition_variable>
 #include <sstream>
 
@@ -37,27 +42,93 @@ static std::string make_thread_name( const std::string& base,
 		ret << " (#" << num << "/" << total << ")";
 	return ret.str( );
 }
+
+/**
+ * A task queued in a work-stealing pool. The deques and LIFO slots hold
+ * pointers, as a thief reads an element before it has claimed it, so the
+ * nodes are pool allocated (see LIBQ_POOL_ALLOCATOR) rather than taken from
+ * the heap for every task.
+ */
+struct task_node
+: detail::pool_allocated
+{
+	task_node( task&& task )
+	: task_( std::move( task ) )
+	{ }
+
+	task task_;
+};
+
+/**
+ * A thread in a work-stealing pool. New tasks added from the thread itself
+ * are put in the LIFO slot, which is always run next, and the task which was
+ * in the slot is moved to the deque. Other threads steal from the top of the
+ * deque, and from the slot only as a last resort.
+ */
+struct worker
+{
+	worker( const void* pool, std::size_t index )
+	: pool_( pool )
+	, index_( index )
+	, lifo_slot_( nullptr )
+	, random_( static_cast< std::minstd_rand::result_type >( index + 1 ) )
+	{ }
+
+	const void* pool_;
+	std::size_t index_;
+	std::atomic< task_node* > lifo_slot_;
+	detail::work_stealing_deque< task_node > deque_;
+	std::minstd_rand random_;
+};
+
+thread_local worker* current_worker_ = nullptr;
+
 } // anonymous namespace
 
 struct threadpool::pimpl
 {
-	pimpl( const std::string& name, std::size_t threads )
+	pimpl( const std::string& name, std::size_t threads, scheduling mode )
 	: name_( name )
 	, mutex_( Q_HERE, "[" + name + "] mutex" )
 	, num_threads_( threads )
+	, mode_( mode )
 	, started_( false )
 	, running_( false )
 	, stop_asap_( false )
 	, allow_more_jobs_( true )
+	, active_( false )
+	, sleepers_( 0 )
 	{ }
 
+	~pimpl( )
+	{
+		for ( auto& worker : workers_ )
+		{
+			delete worker->lifo_slot_.load( std::memory_order_relaxed );
+			while ( auto t = worker->deque_.take( ) )
+				delete t;
+		}
+
+		task_node* t;
+		while ( injected_.pop( t ) )
+			delete t;
+	}
+
 	typedef std::shared_ptr< thread< > >         thread_type;
 	typedef expect< void >                       result_type;
 	typedef promise< std::tuple< result_type > > promise_type;
 
+	void add_stealable_task( task&& task );
+	task_node* find_task( worker& self );
+	task_node* steal_task( worker& self );
+	bool has_stealable_task( ) const;
+	void wait_for_task( );
+	void wake_sleeper( );
+
 	std::string                 name_;
 	mutex                       mutex_;
 	std::size_t                 num_threads_;
+	scheduling                  mode_;
 	std::vector< thread_type >  threads_;
 	std::queue< task >          tasks_;
 	std::condition_variable     cond_;
@@ -65,13 +136,139 @@ struct threadpool::pimpl
 	bool                        running_;
 	bool                        stop_asap_;
 	bool                        allow_more_jobs_;
+
+	// Work-stealing mode
+	std::vector< std::unique_ptr< worker > > workers_;
+	detail::segment_queue< task_node* > injected_;
+	std::atomic< bool >         active_;
+	std::atomic< std::size_t >  sleepers_;
 };
 
-threadpool::threadpool( const std::string& name, std::size_t threads )
-: pimpl_( new pimpl( name, threads ) )
+void threadpool::pimpl::add_stealable_task( task&& task )
+{
+	if ( !active_.load( std::memory_order_acquire ) )
+		// Silenty ignore jobs
+		return;
+
+	auto t = new task_node( std::move( task ) );
+
+	auto self = current_worker_;
+
+	if ( self && self->pool_ == this )
+	{
+		auto prev = self->lifo_slot_.exchange(
+			t, std::memory_order_acq_rel );
+
+		if ( prev )
+			self->deque_.push( prev );
+	}
+	else
+	{
+		injected_.push( std::move( t ) );
+	}
+
+	wake_sleeper( );
+}
+
+task_node* threadpool::pimpl::find_task( worker& self )
+{
+	auto t = self.lifo_slot_.exchange( nullptr, std::memory_order_acq_rel );
+	if ( t )
+		return t;
+
+	t = self.deque_.take( );
+	if ( t )
+		return t;
+
+	if ( injected_.pop( t ) )
+		return t;
+
+	return steal_task( self );
+}
+
+task_node* threadpool::pimpl::steal_task( worker& self )
+{
+	const std::size_t num = workers_.size( );
+
+	if ( num < 2 )
+		return nullptr;
+
+	const std::size_t first = self.random_( ) % num;
+
+	for ( std::size_t i = 0; i < num; ++i )
+	{
+		auto& victim = *workers_[ ( first + i ) % num ];
+
+		if ( &victim == &self )
+			continue;
+
+		auto t = victim.deque_.steal( );
+		if ( t )
+			return t;
+	}
+
+	for ( std::size_t i = 0; i < num; ++i )
+	{
+		auto& victim = *workers_[ ( first + i ) % num ];
+
+		if ( &victim == &self )
+			continue;
+
+		auto t = victim.lifo_slot_.exchange(
+			nullptr, std::memory_order_acq_rel );
+		if ( t )
+			return t;
+	}
+
+	return nullptr;
+}
+
+bool threadpool::pimpl::has_stealable_task( ) const
+{
+	if ( !injected_.empty( ) )
+		return true;
+
+	for ( auto& worker : workers_ )
+		if ( !worker->deque_.empty( ) ||
+			worker->lifo_slot_.load( std::memory_order_acquire ) )
+			return true;
+
+	return false;
+}
+
+void threadpool::pimpl::wait_for_task( )
+{
+	auto lock = Q_UNIQUE_LOCK( mutex_ );
+
+	sleepers_.fetch_add( 1, std::memory_order_seq_cst );
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+
+	if ( active_.load( std::memory_order_acquire ) &&
+		!has_stealable_task( ) )
+		cond_.wait( lock );
+
+	sleepers_.fetch_sub( 1, std::memory_order_relaxed );
+}
+
+void threadpool::pimpl::wake_sleeper( )
+{
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+
+	if ( sleepers_.load( std::memory_order_relaxed ) == 0 )
+		return;
+
+	Q_AUTO_UNIQUE_LOCK( mutex_ );
+	cond_.notify_one( );
+}
+
+threadpool::threadpool( const std::string& name,
+                        std::size_t threads,
+                        scheduling mode )
+: pimpl_( new pimpl( name, threads, mode ) )
 {
 	pimpl_->running_ = true;
 	pimpl_->started_ = true;
+	pimpl_->active_.store( true, std::memory_order_release );
 	pimpl_->threads_.reserve( threads );
 }
 
@@ -81,16 +278,24 @@ threadpool::~threadpool( )
 }
 
 std::shared_ptr< threadpool >
-threadpool::construct( const std::string& name, std::size_t threads )
+threadpool::construct( const std::string& name,
+                       std::size_t threads,
+                       scheduling mode )
 {
 	auto tp = ::q::make_shared_using_constructor< threadpool >(
-		name, threads );
-	tp->start( );
+		name, threads, mode );
+	if ( mode == scheduling::work_stealing )
+		tp->start_work_stealing( );
+	else
+		tp->start( );
 	return tp;
 }
 
 void threadpool::add_task( task task )
 {
+	if ( pimpl_->mode_ == scheduling::work_stealing )
+		return pimpl_->add_stealable_task( std::move( task ) );
+
 	{
 		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
 
@@ -182,8 +387,73 @@ void threadpool::start( )
 	 */
 }
 
+void threadpool::start_work_stealing( )
+{
+	auto _this = shared_from_this( );
+
+	for ( std::size_t num = 0; num < pimpl_->num_threads_; ++num )
+		pimpl_->workers_.emplace_back( new worker( pimpl_.get( ), num ) );
+
+	for ( std::size_t num = 1; num <= pimpl_->num_threads_; ++num )
+	{
+		auto thread_name = make_thread_name(
+			pimpl_->name_, num, pimpl_->num_threads_ );
+
+		auto self = pimpl_->workers_[ num - 1 ].get( );
+
+		auto fn = [ _this, self ]( )
+		{
+			auto& pimpl = *_this->pimpl_;
+
+			current_worker_ = self;
+
+			while ( pimpl.active_.load( std::memory_order_acquire ) )
+			{
+				auto t = pimpl.find_task( *self );
+
+				if ( !t )
+				{
+					pimpl.wait_for_task( );
+					continue;
+				}
+
+				std::unique_ptr< task_node > owned_task( t );
+
+				// Invoke task
+				// TODO: Catch uncaught exceptions
+				owned_task->task_( );
+			}
+
+			current_worker_ = nullptr;
+
+			_this->mark_completion( );
+		};
+
+		auto t = run( std::move( thread_name ), std::move( fn ) );
+
+		t->terminate( );
+
+		pimpl_->threads_.push_back( std::move( t ) );
+	}
+}
+
+std::size_t threadpool::parallelism( ) const
+{
+	return pimpl_->num_threads_;
+}
+
 std::size_t threadpool::backlog( ) const
 {
+	if ( pimpl_->mode_ == scheduling::work_stealing )
+	{
+		std::size_t backlog = 0;
+		for ( auto& worker : pimpl_->workers_ )
+			backlog += worker->deque_.size( ) +
+				( worker->lifo_slot_.load( std::memory_order_relaxed )
+					? 1 : 0 );
+		return backlog;
+	}
+
 	Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
 	return pimpl_->tasks_.size( );
 }
@@ -205,6 +475,7 @@ void threadpool::do_terminate( )
 
 		pimpl_->running_ = false;
 		pimpl_->allow_more_jobs_ = false;
+		pimpl_->active_.store( false, std::memory_order_release );
 	}
 
 	pimpl_->cond_.notify_all( );
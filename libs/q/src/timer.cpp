@@ -0,0 +1,680 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <q/timer.hpp>
+#include <q/queue.hpp>
+#include <q/mutex.hpp>
+#include <q/thread.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <vector>
+
+namespace q {
+
+namespace {
+
+// The wheel has four levels of 256 slots each. A slot on the lowest level is
+// one tick, on the next 256 ticks, and so on. Timers further away than 2^32
+// ticks are kept on the highest level until they come within range.
+const std::size_t level_bits = 8;
+const std::size_t num_slots = std::size_t( 1 ) << level_bits;
+const std::uint64_t slot_mask = num_slots - 1;
+const std::size_t num_levels = 4;
+const std::uint64_t max_delta =
+	( std::uint64_t( 1 ) << ( level_bits * num_levels ) ) - 1;
+
+const std::uint32_t npos = std::numeric_limits< std::uint32_t >::max( );
+
+// The tick the timer thread sleeps until while it's busy, and when the
+// wheel is empty
+const std::uint64_t busy = 0;
+const std::uint64_t idle = std::numeric_limits< std::uint64_t >::max( );
+
+/**
+ * A timer, linked into a doubly linked list per slot by index, as the
+ * entries are kept in a deque and reused through a free list.
+ */
+struct entry
+{
+	entry( )
+	: expiry_( 0 )
+	, granule_( 1 )
+	, generation_( 1 )
+	, prev_( npos )
+	, next_( npos )
+	, slot_( npos )
+	{ }
+
+	// Time since the start of the timer at which this timer should
+	// expire, and for periodic timers the period
+	timer::duration nominal_;
+	timer::duration period_;
+
+	// The tick this timer expires on, i.e. the nominal time rounded up to
+	// its granule
+	std::uint64_t expiry_;
+	std::uint64_t granule_;
+
+	std::uint32_t generation_;
+	std::uint32_t prev_;
+	std::uint32_t next_;
+	// The level and slot this timer is linked into, or npos if unused
+	std::uint32_t slot_;
+
+	task task_;
+	std::function< void( std::exception_ptr ) > reject_;
+	std::shared_ptr< std::function< void( ) > > periodic_;
+	queue_ptr queue_;
+};
+
+struct expired
+{
+	task task_;
+	queue_ptr queue_;
+};
+
+} // anonymous namespace
+
+struct timer::pimpl
+{
+	pimpl( const std::string& name, duration resolution )
+	: name_( name )
+	, mutex_( Q_HERE, "[" + name + "] timer" )
+	, resolution_( resolution )
+	, start_( clock::now( ) )
+	, now_( 0 )
+	, armed_( 0 )
+	, free_( npos )
+	, running_( true )
+	, stopped_( false )
+	, wake_( busy )
+	{
+		for ( auto& level : heads_ )
+			for ( auto& head : level )
+				head = npos;
+
+		for ( auto& word : occupied_ )
+			word = 0;
+	}
+
+	std::uint64_t tick_of( time_point time ) const;
+	time_point time_of( std::uint64_t tick ) const;
+	std::uint64_t expiry_of( duration nominal, std::uint64_t granule ) const;
+	std::uint64_t granule_of( duration slack ) const;
+
+	handle arm( duration nominal,
+	            duration period,
+	            duration slack,
+	            task&& task,
+	            std::function< void( std::exception_ptr ) >&& reject,
+	            std::shared_ptr< std::function< void( ) > >&& periodic,
+	            const queue_ptr& queue );
+
+	std::uint32_t allocate( );
+	void release( std::uint32_t index );
+
+	void link( std::uint32_t index );
+	void unlink( std::uint32_t index );
+
+	std::size_t next_occupied( std::size_t from ) const;
+	void cascade( std::size_t level, std::size_t slot );
+	void expire( std::size_t slot );
+	void advance( std::uint64_t target );
+	std::uint64_t next_wakeup( ) const;
+
+	void run( );
+
+	std::string name_;
+	mutex mutex_;
+	std::condition_variable cond_;
+	const duration resolution_;
+	const time_point start_;
+
+	// The next tick to process. All timers expiring before it have been
+	// expired.
+	std::uint64_t now_;
+	std::size_t armed_;
+
+	std::deque< entry > entries_;
+	std::uint32_t free_;
+	std::uint32_t heads_[ num_levels ][ num_slots ];
+	// Which slots of the lowest level are non-empty
+	std::uint64_t occupied_[ num_slots / 64 ];
+
+	std::vector< expired > expired_;
+	bool running_;
+	// Set when run( ) returns, as the thread is joined asynchronously
+	bool stopped_;
+	std::condition_variable stopped_cond_;
+	std::uint64_t wake_;
+	std::shared_ptr< thread< > > thread_;
+	std::thread::id thread_id_;
+};
+
+std::uint64_t timer::pimpl::tick_of( time_point time ) const
+{
+	if ( time <= start_ )
+		return 0;
+
+	return ( time - start_ ) / resolution_;
+}
+
+timer::time_point timer::pimpl::time_of( std::uint64_t tick ) const
+{
+	return start_ + resolution_ * static_cast< duration::rep >( tick );
+}
+
+std::uint64_t
+timer::pimpl::expiry_of( duration nominal, std::uint64_t granule ) const
+{
+	const auto res = resolution_.count( );
+
+	std::uint64_t tick = nominal.count( ) <= 0
+		? 0
+		: ( nominal.count( ) + res - 1 ) / res;
+
+	// Round up to the granule, which is a power of two
+	return ( tick + granule - 1 ) & ~( granule - 1 );
+}
+
+std::uint64_t timer::pimpl::granule_of( duration slack ) const
+{
+	std::uint64_t ticks = slack / resolution_;
+
+	std::uint64_t granule = 1;
+	while ( granule * 2 <= ticks )
+		granule *= 2;
+
+	return granule;
+}
+
+timer::handle timer::pimpl::arm(
+	duration nominal,
+	duration period,
+	duration slack,
+	task&& task,
+	std::function< void( std::exception_ptr ) >&& reject,
+	std::shared_ptr< std::function< void( ) > >&& periodic,
+	const queue_ptr& queue )
+{
+	auto granule = granule_of( slack );
+
+	auto lock = Q_UNIQUE_LOCK( mutex_ );
+
+	// Nothing would ever expire it
+	if ( !running_ )
+		Q_THROW( timer_terminated_exception( ) );
+
+	// An empty wheel can skip ahead to the current time, rather than
+	// cascading its way there
+	if ( !armed_ )
+	{
+		auto current = tick_of( clock::now( ) );
+		if ( current > now_ )
+			now_ = current;
+	}
+
+	auto index = allocate( );
+	auto& e = entries_[ index ];
+
+	e.nominal_ = nominal;
+	e.period_ = period;
+	e.granule_ = granule;
+	e.expiry_ = expiry_of( nominal, granule );
+	e.task_ = std::move( task );
+	e.reject_ = std::move( reject );
+	e.periodic_ = std::move( periodic );
+	e.queue_ = queue;
+
+	link( index );
+	++armed_;
+
+	if ( e.expiry_ < wake_ )
+	{
+		wake_ = e.expiry_;
+		cond_.notify_one( );
+	}
+
+	return handle( index, e.generation_ );
+}
+
+std::uint32_t timer::pimpl::allocate( )
+{
+	if ( free_ != npos )
+	{
+		auto index = free_;
+		free_ = entries_[ index ].next_;
+		return index;
+	}
+
+	entries_.emplace_back( );
+	return static_cast< std::uint32_t >( entries_.size( ) - 1 );
+}
+
+void timer::pimpl::release( std::uint32_t index )
+{
+	auto& e = entries_[ index ];
+
+	e.task_ = nullptr;
+	e.reject_ = nullptr;
+	e.periodic_.reset( );
+	e.queue_.reset( );
+	e.slot_ = npos;
+
+	if ( ++e.generation_ == 0 )
+		e.generation_ = 1;
+
+	e.next_ = free_;
+	free_ = index;
+
+	--armed_;
+}
+
+void timer::pimpl::link( std::uint32_t index )
+{
+	auto& e = entries_[ index ];
+
+	auto expiry = e.expiry_ < now_ ? now_ : e.expiry_;
+	auto delta = expiry - now_;
+
+	std::size_t level = 0;
+	while ( level + 1 < num_levels &&
+		delta >> ( level_bits * ( level + 1 ) ) )
+		++level;
+
+	if ( delta > max_delta )
+		expiry = now_ + max_delta;
+
+	auto slot = ( expiry >> ( level_bits * level ) ) & slot_mask;
+	auto& head = heads_[ level ][ slot ];
+
+	e.slot_ = static_cast< std::uint32_t >( level * num_slots + slot );
+	e.prev_ = npos;
+	e.next_ = head;
+	if ( head != npos )
+		entries_[ head ].prev_ = index;
+	head = index;
+
+	if ( !level )
+		occupied_[ slot / 64 ] |= std::uint64_t( 1 ) << ( slot % 64 );
+}
+
+void timer::pimpl::unlink( std::uint32_t index )
+{
+	auto& e = entries_[ index ];
+
+	auto level = e.slot_ / num_slots;
+	auto slot = e.slot_ % num_slots;
+	auto& head = heads_[ level ][ slot ];
+
+	if ( e.prev_ != npos )
+		entries_[ e.prev_ ].next_ = e.next_;
+	else
+		head = e.next_;
+
+	if ( e.next_ != npos )
+		entries_[ e.next_ ].prev_ = e.prev_;
+
+	if ( !level && head == npos )
+		occupied_[ slot / 64 ] &= ~( std::uint64_t( 1 ) << ( slot % 64 ) );
+}
+
+/**
+ * @returns the first non-empty slot of the lowest level at or after @c from,
+ * or num_slots if there is none.
+ */
+std::size_t timer::pimpl::next_occupied( std::size_t from ) const
+{
+	for ( auto word = from / 64; word < num_slots / 64; ++word )
+	{
+		auto bits = occupied_[ word ];
+		if ( word == from / 64 )
+			bits &= ~std::uint64_t( 0 ) << ( from % 64 );
+
+		if ( bits )
+			return word * 64 + __builtin_ctzll( bits );
+	}
+
+	return num_slots;
+}
+
+void timer::pimpl::cascade( std::size_t level, std::size_t slot )
+{
+	auto index = heads_[ level ][ slot ];
+	heads_[ level ][ slot ] = npos;
+
+	while ( index != npos )
+	{
+		auto next = entries_[ index ].next_;
+		link( index );
+		index = next;
+	}
+}
+
+void timer::pimpl::expire( std::size_t slot )
+{
+	auto index = heads_[ 0 ][ slot ];
+	heads_[ 0 ][ slot ] = npos;
+	occupied_[ slot / 64 ] &= ~( std::uint64_t( 1 ) << ( slot % 64 ) );
+
+	while ( index != npos )
+	{
+		auto& e = entries_[ index ];
+		auto next = e.next_;
+
+		if ( e.periodic_ )
+		{
+			auto fn = e.periodic_;
+			expired_.push_back( expired{
+				[ fn ]( ) { ( *fn )( ); },
+				e.queue_
+			} );
+
+			// Skip the periods which have already passed, if the
+			// timer has fallen behind
+			e.nominal_ += e.period_;
+			auto behind = resolution_ *
+				static_cast< duration::rep >( now_ + 1 ) - e.nominal_;
+			if ( behind > duration::zero( ) )
+				e.nominal_ += e.period_ * ( behind / e.period_ + 1 );
+
+			e.expiry_ = expiry_of( e.nominal_, e.granule_ );
+			link( index );
+		}
+		else
+		{
+			expired_.push_back( expired{
+				std::move( e.task_ ),
+				std::move( e.queue_ )
+			} );
+			release( index );
+		}
+
+		index = next;
+	}
+}
+
+/**
+ * Processes all ticks up to and including @c target, jumping over those
+ * which have nothing to expire or cascade.
+ */
+void timer::pimpl::advance( std::uint64_t target )
+{
+	while ( now_ <= target )
+	{
+		auto slot = now_ & slot_mask;
+
+		if ( !slot )
+		{
+			for ( std::size_t level = 1; level < num_levels; ++level )
+			{
+				auto upper = ( now_ >> ( level_bits * level ) )
+					& slot_mask;
+				cascade( level, upper );
+				if ( upper )
+					break;
+			}
+		}
+
+		if ( heads_[ 0 ][ slot ] != npos )
+			expire( slot );
+
+		auto next = ( now_ & ~slot_mask ) + next_occupied( slot + 1 );
+		now_ = next > target + 1 ? target + 1 : next;
+	}
+}
+
+std::uint64_t timer::pimpl::next_wakeup( ) const
+{
+	if ( !armed_ )
+		return idle;
+
+	// advance( ) may stop on the first slot of a window it hasn't
+	// processed yet, in which case the higher levels are still to be
+	// cascaded into it, whether or not the lowest level has anything
+	if ( !( now_ & slot_mask ) )
+		return now_;
+
+	return ( now_ & ~slot_mask ) + next_occupied( now_ & slot_mask );
+}
+
+void timer::pimpl::run( )
+{
+	std::vector< expired > firing;
+
+	auto lock = Q_UNIQUE_LOCK( mutex_ );
+
+	thread_id_ = std::this_thread::get_id( );
+
+	while ( running_ )
+	{
+		advance( tick_of( clock::now( ) ) );
+
+		if ( !expired_.empty( ) )
+		{
+			std::swap( firing, expired_ );
+
+			{
+				Q_AUTO_UNIQUE_UNLOCK( lock );
+
+				for ( auto& item : firing )
+					item.queue_->push( std::move( item.task_ ) );
+
+				firing.clear( );
+			}
+
+			continue;
+		}
+
+		wake_ = next_wakeup( );
+
+		if ( wake_ == idle )
+			cond_.wait( lock );
+		else
+			cond_.wait_until( lock, time_of( wake_ ) );
+
+		wake_ = busy;
+	}
+
+	stopped_ = true;
+	stopped_cond_.notify_all( );
+}
+
+timer::timer( const std::string& name, duration resolution )
+: pimpl_( new pimpl( name, resolution ) )
+{ }
+
+timer::~timer( )
+{
+	terminate( );
+}
+
+timer_ptr timer::construct( const std::string& name, duration resolution )
+{
+	auto t = ::q::make_shared_using_constructor< timer >( name, resolution );
+	t->start( );
+	return t;
+}
+
+void timer::start( )
+{
+	auto pimpl = pimpl_;
+
+	auto t = run( pimpl_->name_, [ pimpl ]( )
+	{
+		pimpl->run( );
+	} );
+
+	t->terminate( );
+
+	Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+
+	pimpl_->thread_ = std::move( t );
+}
+
+timer::handle timer::schedule( duration delay,
+                               task task,
+                               const queue_ptr& queue,
+                               duration slack )
+{
+	return schedule( delay, std::move( task ), nullptr, queue, slack );
+}
+
+timer::handle timer::schedule( duration delay,
+                               task task,
+                               std::function< void( std::exception_ptr ) > reject,
+                               const queue_ptr& queue,
+                               duration slack )
+{
+	auto nominal = clock::now( ) - pimpl_->start_ + delay;
+
+	return pimpl_->arm(
+		nominal, duration::zero( ), slack, std::move( task ),
+		std::move( reject ), nullptr, queue );
+}
+
+timer::handle timer::schedule_periodic( duration period,
+                                        std::function< void( ) > fn,
+                                        const queue_ptr& queue,
+                                        duration slack )
+{
+	if ( period < pimpl_->resolution_ )
+		period = pimpl_->resolution_;
+
+	auto nominal = clock::now( ) - pimpl_->start_ + period;
+
+	return pimpl_->arm(
+		nominal, period, slack, nullptr, nullptr,
+		std::make_shared< std::function< void( ) > >( std::move( fn ) ),
+		queue );
+}
+
+bool timer::cancel( const handle& handle )
+{
+	task dropped;
+	std::shared_ptr< std::function< void( ) > > dropped_periodic;
+
+	{
+		Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+
+		if ( handle.index_ >= pimpl_->entries_.size( ) )
+			return false;
+
+		auto& e = pimpl_->entries_[ handle.index_ ];
+
+		if ( e.generation_ != handle.generation_ || e.slot_ == npos )
+			return false;
+
+		// Destructed outside of the lock, as they may hold the last
+		// references to arbitrary state
+		dropped = std::move( e.task_ );
+		dropped_periodic = std::move( e.periodic_ );
+
+		pimpl_->unlink( handle.index_ );
+		pimpl_->release( handle.index_ );
+	}
+
+	return true;
+}
+
+std::size_t timer::armed( ) const
+{
+	Q_AUTO_UNIQUE_LOCK( pimpl_->mutex_ );
+
+	return pimpl_->armed_;
+}
+
+void timer::terminate( )
+{
+	std::shared_ptr< thread< > > worker;
+	std::deque< entry > dropped;
+
+	auto lock = Q_UNIQUE_LOCK( pimpl_->mutex_ );
+
+	pimpl_->running_ = false;
+	pimpl_->cond_.notify_one( );
+
+	// The armed timers will never expire. They are settled outside of the
+	// lock, as their reject functions may schedule new timers (which then
+	// fail) or hold the last references to arbitrary state.
+	if ( pimpl_->armed_ )
+	{
+		std::swap( dropped, pimpl_->entries_ );
+		pimpl_->free_ = npos;
+		pimpl_->armed_ = 0;
+
+		for ( auto& level : pimpl_->heads_ )
+			for ( auto& head : level )
+				head = npos;
+
+		for ( auto& word : pimpl_->occupied_ )
+			word = 0;
+	}
+
+	worker = std::move( pimpl_->thread_ );
+
+	// The timer thread can't wait for itself, but holds the pimpl until
+	// it's done
+	if ( worker && pimpl_->thread_id_ != std::this_thread::get_id( ) )
+		pimpl_->stopped_cond_.wait( lock, [ this ]( )
+		{
+			return pimpl_->stopped_;
+		} );
+
+	lock.unlock( );
+
+	if ( dropped.empty( ) )
+		return;
+
+	auto terminated = std::make_exception_ptr(
+		timer_terminated_exception( ) );
+
+	for ( auto& e : dropped )
+		if ( e.slot_ != npos && e.reject_ )
+			e.reject_( terminated );
+}
+
+namespace {
+
+mutex default_timer_mutex_;
+timer_ptr default_timer_;
+
+} // anonymous namespace
+
+timer_ptr default_timer( )
+{
+	Q_AUTO_UNIQUE_LOCK( default_timer_mutex_ );
+
+	if ( !default_timer_ )
+		default_timer_ = timer::construct( "q timer" );
+
+	return default_timer_;
+}
+
+timer_ptr set_default_timer( timer_ptr timer )
+{
+	timer_ptr old;
+	{
+		Q_AUTO_UNIQUE_LOCK( default_timer_mutex_ );
+		old = default_timer_;
+		default_timer_ = timer;
+	}
+	return old;
+}
+
+} // namespace q
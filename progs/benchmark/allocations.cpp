@@ -0,0 +1,38 @@
+
+#include "benchmark.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+std::atomic< std::size_t > allocations_( 0 );
+
+} // anonymous namespace
+
+namespace benchmark {
+
+std::size_t allocations( )
+{
+	return allocations_.load( std::memory_order_relaxed );
+}
+
+} // namespace benchmark
+
+// Counts all heap allocations of the benchmark process
+
+void* operator new( std::size_t size )
+{
+	allocations_.fetch_add( 1, std::memory_order_relaxed );
+
+	if ( void* p = std::malloc( size ? size : 1 ) )
+		return p;
+
+	throw std::bad_alloc( );
+}
+
+void operator delete( void* p ) noexcept
+{
+	std::free( p );
+}
@@ -0,0 +1,118 @@
+
+#include "benchmark.hpp"
+
+#include <q/promise.hpp>
+#include <q/threadpool.hpp>
+#include <q/scheduler.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+#include <unistd.h>
+
+namespace {
+
+/**
+ * @returns the resident set size of the process, in MiB.
+ */
+double resident_mib( )
+{
+	std::size_t pages = 0;
+	std::size_t resident = 0;
+
+	std::ifstream statm( "/proc/self/statm" );
+	statm >> pages >> resident;
+
+	return double( resident ) * sysconf( _SC_PAGESIZE ) / ( 1024 * 1024 );
+}
+
+/**
+ * Builds @c chains promise chains of @c stages stages each, all pending at
+ * once, and then runs them on a threadpool. The promise states are allocated
+ * by the main thread and freed by the pool threads.
+ */
+void run( std::size_t threads, std::size_t chains, std::size_t stages )
+{
+	// Thread terminations are signalled on the default queue, which is
+	// never consumed here
+	static auto terminations = q::make_shared< q::queue >( );
+	q::set_default_queue( terminations );
+
+	auto pool = q::threadpool::construct( "allocator", threads );
+	auto queue = q::make_shared< q::queue >( );
+	auto sched = q::make_shared< q::scheduler >( pool );
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic< std::size_t > remaining( chains );
+
+	const auto rss_before = resident_mib( );
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t c = 0; c < chains; ++c )
+	{
+		auto promise = q::with( std::size_t( c ) );
+
+		for ( std::size_t s = 0; s < stages; ++s )
+			promise = promise.then( [ ]( std::size_t i )
+			{
+				return i + 1;
+			}, queue );
+
+		promise.then( [ & ]( std::size_t )
+		{
+			if ( remaining.fetch_sub( 1 ) == 1 )
+			{
+				std::unique_lock< std::mutex > lock( mutex );
+				cond.notify_one( );
+			}
+		}, queue );
+	}
+
+	const auto rss_pending = resident_mib( );
+
+	sched->add_queue( queue );
+
+	{
+		std::unique_lock< std::mutex > lock( mutex );
+		cond.wait( lock, [ & ]( ) { return remaining.load( ) == 0; } );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	pool->terminate( );
+
+	// One promise state per stage, plus the head and the tail
+	const auto nodes = chains * ( stages + 2 );
+
+	std::stringstream ss;
+	ss << chains << " chains, " << threads << " threads";
+	benchmark::report( ss.str( ), nodes, seconds );
+
+	std::cout
+		<< "    " << std::fixed << std::setprecision( 2 )
+		<< double( allocations ) / nodes << " heap allocations/node, "
+		<< std::setprecision( 0 )
+		<< nodes / seconds << " nodes/s, rss "
+		<< rss_before << " -> " << rss_pending << " MiB pending, "
+		<< resident_mib( ) << " MiB done"
+		<< std::endl;
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( allocator, "allocation rate and memory of 1M concurrent promise chains" )
+{
+#ifdef LIBQ_POOL_ALLOCATOR
+	std::cout << "  (pool allocator)" << std::endl;
+#else
+	std::cout << "  (heap allocator)" << std::endl;
+#endif
+
+	run( 2, 1000000, 2 );
+}
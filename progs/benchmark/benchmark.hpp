@@ -0,0 +1,168 @@
+/*
+ * Copyright 2013 Gustaf Räntilä
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBQ_BENCHMARK_HPP
+#define LIBQ_BENCHMARK_HPP
+
+#include <q/event_dispatcher.hpp>
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+namespace benchmark {
+
+typedef void( *benchmark_function )( );
+
+struct entry
+{
+	const char* name;
+	const char* description;
+	benchmark_function fn;
+};
+
+std::vector< entry >& registry( );
+
+struct registration
+{
+	registration( const char* name,
+	               const char* description,
+	               benchmark_function fn )
+	{
+		registry( ).push_back( entry{ name, description, fn } );
+	}
+};
+
+/**
+ * Registers a benchmark function which can be run by name from the command
+ * line. All benchmarks are run if no name is given.
+ */
+#define Q_BENCHMARK( name, description ) \
+	static void benchmark_ ## name( ); \
+	static ::benchmark::registration benchmark_registration_ ## name( \
+		#name, description, &benchmark_ ## name ); \
+	static void benchmark_ ## name( )
+
+class stopwatch
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	stopwatch( )
+	: start_( clock::now( ) )
+	{ }
+
+	double seconds( ) const
+	{
+		return std::chrono::duration< double >(
+			clock::now( ) - start_ ).count( );
+	}
+
+private:
+	clock::time_point start_;
+};
+
+/**
+ * @returns the number of heap allocations made by the process so far.
+ */
+std::size_t allocations( );
+
+/**
+ * Marks the run as failed, making the benchmark program exit with a non-zero
+ * status once all selected benchmarks have run.
+ */
+void fail( );
+
+/**
+ * @returns whether any benchmark has called fail( ).
+ */
+bool failed( );
+
+/**
+ * A single-threaded event dispatcher which is drained manually, and which
+ * counts the number of dispatcher tasks the scheduler posts.
+ */
+class manual_dispatcher
+: public ::q::event_dispatcher
+{
+public:
+	manual_dispatcher( )
+	: posted_( 0 )
+	{ }
+
+	void add_task( ::q::task task ) override
+	{
+		++posted_;
+		tasks_.push_back( std::move( task ) );
+	}
+
+	std::size_t backlog( ) const override
+	{
+		return tasks_.size( );
+	}
+
+	void drain( )
+	{
+		while ( run_one( ) )
+			;
+	}
+
+	bool run_one( )
+	{
+		if ( tasks_.empty( ) )
+			return false;
+
+		auto task = std::move( tasks_.front( ) );
+		tasks_.pop_front( );
+		task( );
+
+		return true;
+	}
+
+	std::size_t posted( ) const
+	{
+		return posted_;
+	}
+
+private:
+	std::size_t posted_;
+	std::deque< ::q::task > tasks_;
+};
+
+/**
+ * Prints a result line with the number of operations per second.
+ */
+inline void report( const std::string& what,
+                    std::size_t operations,
+                    double seconds )
+{
+	auto rate = seconds > 0 ? operations / seconds : 0.0;
+
+	std::cout
+		<< "  " << std::setw( 44 ) << std::left << what << std::right
+		<< std::setw( 12 ) << operations << " ops "
+		<< std::setw( 10 ) << std::fixed << std::setprecision( 3 )
+		<< seconds * 1000 << " ms "
+		<< std::setw( 14 ) << std::setprecision( 0 ) << rate << " ops/s"
+		<< std::endl;
+}
+
+} // namespace benchmark
+
+#endif // LIBQ_BENCHMARK_HPP
@@ -0,0 +1,376 @@
+
+#include "benchmark.hpp"
+
+#include <q/broadcast_channel.hpp>
+#include <q/channel.hpp>
+#include <q/scheduler.hpp>
+#include <q/memory.hpp>
+
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/**
+ * Lets a producer send @c messages messages as fast as the channel lets it,
+ * to a consumer receiving one message per task, and measures how many
+ * messages pile up in the channel. A @c capacity of 0 means unbounded.
+ */
+void run_overload( std::size_t messages, std::size_t capacity )
+{
+	typedef q::channel< std::size_t > channel_type;
+
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	auto channel = capacity
+		? std::make_shared< channel_type >( capacity )
+		: std::make_shared< channel_type >( );
+
+	std::size_t sent = 0;
+	std::size_t received = 0;
+	std::size_t peak = 0;
+
+	std::function< void( ) > produce = [ & ]( )
+	{
+		while ( sent < messages && channel->try_send( sent ) )
+		{
+			++sent;
+			peak = std::max( peak, sent - received );
+		}
+
+		if ( sent == messages )
+			return;
+
+		// Full, wait for room
+		channel->async_send( sent++ ).then( produce, queue );
+		peak = std::max( peak, sent - received );
+	};
+
+	std::function< void( ) > consume = [ & ]( )
+	{
+		channel->receive( ).then( [ & ]( std::size_t )
+		{
+			if ( ++received < messages )
+				consume( );
+		}, queue );
+	};
+
+	benchmark::stopwatch stopwatch;
+
+	queue->push( produce );
+	consume( );
+
+	dispatcher->drain( );
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	if ( capacity )
+		ss << "capacity " << capacity;
+	else
+		ss << "unbounded";
+	ss << ", peak " << peak << " buffered";
+	if ( received != messages )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), messages, seconds );
+}
+
+/**
+ * Streams @c messages messages through a channel, sent and received
+ * @c batch at a time with send_many( ) and receive_many( ), or one at a
+ * time with async_send( ) and receive( ) if @c batch is 1.
+ */
+void run_batched( std::size_t messages, std::size_t batch )
+{
+	typedef q::channel< std::size_t > channel_type;
+
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	channel_type channel( 1024 );
+
+	std::size_t sent = 0;
+	std::size_t received = 0;
+
+	std::function< void( ) > produce = [ & ]( )
+	{
+		if ( sent == messages )
+			return;
+
+		if ( batch == 1 )
+		{
+			channel.async_send( sent++ ).then( produce, queue );
+			return;
+		}
+
+		std::vector< std::size_t > values( batch );
+		for ( auto& message : values )
+			message = sent++;
+
+		channel.send_many( std::move( values ) ).then( produce, queue );
+	};
+
+	std::function< void( ) > consume = [ & ]( )
+	{
+		if ( batch == 1 )
+		{
+			channel.receive( ).then( [ & ]( std::size_t )
+			{
+				if ( ++received < messages )
+					consume( );
+			}, queue );
+			return;
+		}
+
+		channel.receive_many( batch ).then(
+			[ & ]( std::vector< std::tuple< std::size_t > >&& values )
+		{
+			received += values.size( );
+			if ( received < messages )
+				consume( );
+		}, queue );
+	};
+
+	benchmark::stopwatch stopwatch;
+
+	queue->push( produce );
+	consume( );
+
+	dispatcher->drain( );
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	ss << "batches of " << batch;
+	if ( received != messages )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), messages, seconds );
+}
+
+typedef std::vector< double > snapshot;
+
+/**
+ * Fans @c messages snapshots out to @c subscribers subscribers, through one
+ * channel per subscriber.
+ */
+void run_fanout_channels( std::size_t messages, std::size_t subscribers )
+{
+	std::vector< std::unique_ptr< q::channel< snapshot > > > channels;
+	for ( std::size_t i = 0; i < subscribers; ++i )
+		channels.emplace_back( new q::channel< snapshot >( 16 ) );
+
+	const snapshot payload( 64, 1.0 );
+	std::tuple< snapshot > received;
+	double sum = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t m = 0; m < messages; ++m )
+	{
+		for ( auto& channel : channels )
+			channel->try_send( payload );
+
+		for ( auto& channel : channels )
+			if ( channel->try_receive( received ) )
+				sum += std::get< 0 >( received ).front( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << subscribers << " channels, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / messages << " allocs/msg";
+	if ( sum != messages * subscribers )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), messages, seconds );
+}
+
+/**
+ * Fans @c messages snapshots out to @c subscribers subscribers of a
+ * broadcast_channel.
+ */
+void run_fanout_broadcast( std::size_t messages, std::size_t subscribers )
+{
+	typedef q::broadcast_channel< snapshot > channel_type;
+
+	channel_type channel( 16, q::broadcast_lag::block );
+
+	std::vector< channel_type::subscriber_ptr > subs;
+	for ( std::size_t i = 0; i < subscribers; ++i )
+		subs.push_back( channel.subscribe( ) );
+
+	const snapshot payload( 64, 1.0 );
+	channel_type::message_type received;
+	double sum = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t m = 0; m < messages; ++m )
+	{
+		channel.try_send( payload );
+
+		for ( auto& sub : subs )
+			if ( sub->try_receive( received ) )
+				sum += std::get< 0 >( *received ).front( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << subscribers << " subscribers, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / messages << " allocs/msg";
+	if ( sum != messages * subscribers )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), messages, seconds );
+}
+
+template< typename Channel >
+void send_spinning( Channel& channel, std::size_t message )
+{
+	while ( !channel.try_send( message ) )
+		std::this_thread::yield( );
+}
+
+template< typename Channel >
+std::size_t receive_spinning( Channel& channel )
+{
+	std::tuple< std::size_t > message;
+	while ( !channel.try_receive( message ) )
+		std::this_thread::yield( );
+	return std::get< 0 >( message );
+}
+
+/**
+ * Streams @c messages messages from @c producers threads to the calling
+ * thread through a channel of @c capacity messages.
+ */
+template< typename Channel >
+void run_stream(
+	const char* name, std::size_t producers,
+	std::size_t messages, std::size_t capacity )
+{
+	Channel channel( capacity );
+
+	benchmark::stopwatch stopwatch;
+
+	std::vector< std::thread > threads;
+	for ( std::size_t p = 0; p < producers; ++p )
+		threads.emplace_back( [ &, p ]( )
+		{
+			for ( std::size_t i = p; i < messages; i += producers )
+				send_spinning( channel, i );
+		} );
+
+	std::size_t sum = 0;
+	for ( std::size_t i = 0; i < messages; ++i )
+		sum += receive_spinning( channel );
+
+	auto seconds = stopwatch.seconds( );
+
+	for ( auto& thread : threads )
+		thread.join( );
+
+	std::stringstream ss;
+	ss << name << ", " << producers << " producers";
+	if ( sum != messages * ( messages - 1 ) / 2 )
+		ss << " (CORRUPT!)";
+
+	benchmark::report( ss.str( ), messages, seconds );
+}
+
+/**
+ * Bounces a message @c round_trips times between two threads over a pair of
+ * channels.
+ */
+template< typename Channel >
+void run_pingpong( const char* name, std::size_t round_trips )
+{
+	Channel ping( 1 );
+	Channel pong( 1 );
+
+	benchmark::stopwatch stopwatch;
+
+	std::thread ponger( [ & ]( )
+	{
+		for ( std::size_t i = 0; i < round_trips; ++i )
+			send_spinning( pong, receive_spinning( ping ) + 1 );
+	} );
+
+	std::size_t value = 0;
+	for ( std::size_t i = 0; i < round_trips; ++i )
+	{
+		send_spinning( ping, value );
+		value = receive_spinning( pong );
+	}
+
+	auto seconds = stopwatch.seconds( );
+
+	ponger.join( );
+
+	std::stringstream ss;
+	ss << name;
+	if ( value != round_trips )
+		ss << " (CORRUPT!)";
+
+	benchmark::report( ss.str( ), round_trips, seconds );
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( channel_bounded, "buffering of a channel with a fast producer" )
+{
+	run_overload( 200000, 0 );
+	run_overload( 200000, 64 );
+}
+
+Q_BENCHMARK( channel_batched, "send_many( ) and receive_many( ) vs one at a time" )
+{
+	run_batched( 256000, 1 );
+	run_batched( 256000, 16 );
+	run_batched( 256000, 256 );
+}
+
+Q_BENCHMARK( channel_broadcast, "fan-out through channels vs a broadcast_channel" )
+{
+	run_fanout_channels( 100000, 8 );
+	run_fanout_broadcast( 100000, 8 );
+}
+
+Q_BENCHMARK( channel_stream, "throughput of mutex and lock-free channels" )
+{
+	const std::size_t messages = 1000000;
+
+	run_stream< q::channel< std::size_t > >( "mutex", 1, messages, 1024 );
+	run_stream< q::spsc_channel< std::size_t > >( "spsc", 1, messages, 1024 );
+	run_stream< q::mpsc_channel< std::size_t > >( "mpsc", 1, messages, 1024 );
+
+	run_stream< q::channel< std::size_t > >( "mutex", 4, messages, 1024 );
+	run_stream< q::mpsc_channel< std::size_t > >( "mpsc", 4, messages, 1024 );
+}
+
+Q_BENCHMARK( channel_pingpong, "round trips over mutex and lock-free channels" )
+{
+	const std::size_t round_trips = 100000;
+
+	run_pingpong< q::channel< std::size_t > >( "mutex", round_trips );
+	run_pingpong< q::spsc_channel< std::size_t > >( "spsc", round_trips );
+	run_pingpong< q::mpsc_channel< std::size_t > >( "mpsc", round_trips );
+}
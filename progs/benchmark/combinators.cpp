@@ -0,0 +1,282 @@
+
+#include "benchmark.hpp"
+
+#include <q/promise.hpp>
+#include <q/scheduler.hpp>
+#include <q/memory.hpp>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+/**
+ * The value of the @c I:th input to all( ), cycling through int, double and
+ * std::string so that the inputs are of different types.
+ */
+template< std::size_t I >
+typename std::enable_if< I % 3 == 0, int >::type value( )
+{
+	return static_cast< int >( I );
+}
+
+template< std::size_t I >
+typename std::enable_if< I % 3 == 1, double >::type value( )
+{
+	return static_cast< double >( I );
+}
+
+template< std::size_t I >
+typename std::enable_if< I % 3 == 2, std::string >::type value( )
+{
+	return std::string( "value" );
+}
+
+/**
+ * Combines sizeof...( I ) resolved promises of different types with all( ),
+ * @c rounds times, on a manually drained dispatcher.
+ */
+template< std::size_t... I >
+void run_all( q::index_tuple< I... >, std::size_t rounds )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	// all( ) continues its inputs on the default queue
+	q::set_default_queue( queue );
+
+	typedef std::tuple< decltype( value< I >( ) )... > tuple_type;
+
+	std::size_t completed = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t r = 0; r < rounds; ++r )
+	{
+		q::all( q::with( value< I >( ) )... )
+		.then( [ &completed ]( tuple_type&& )
+		{
+			++completed;
+		}, queue );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << sizeof...( I ) << " promises, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / rounds << " allocs/all";
+	if ( completed != rounds )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), rounds, seconds );
+}
+
+/**
+ * Combines a std::vector of @c size resolved promises with all( ), @c rounds
+ * times, on a manually drained dispatcher.
+ */
+void run_all_vector( std::size_t size, std::size_t rounds )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	q::set_default_queue( queue );
+
+	std::size_t completed = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t r = 0; r < rounds; ++r )
+	{
+		std::vector< q::promise< std::tuple< int > > > promises;
+		promises.reserve( size );
+		for ( std::size_t i = 0; i < size; ++i )
+			promises.push_back( q::with( static_cast< int >( i ) ) );
+
+		q::all( std::move( promises ) )
+		.then( [ &completed, size ]( std::vector< int >&& values )
+		{
+			if ( values.size( ) == size )
+				++completed;
+		}, queue );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << size << " promises, "
+		<< std::fixed << std::setprecision( 2 )
+		<< double( allocations ) / ( size * rounds ) << " allocs/element";
+	if ( completed != rounds )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), size * rounds, seconds );
+}
+
+/**
+ * Combines a std::vector of @c size resolved promises, of which every tenth
+ * is rejected, @c rounds times, with either all( ) or all_settled( ). Only
+ * the combining is measured, not the construction of the inputs.
+ */
+void run_partial_failure( std::size_t size, std::size_t rounds, bool settled )
+{
+	typedef std::vector< q::promise< std::tuple< int > > > promises_type;
+
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	q::set_default_queue( queue );
+
+	const auto error = std::make_exception_ptr( std::runtime_error( "" ) );
+
+	std::vector< promises_type > inputs( rounds );
+	for ( auto& promises : inputs )
+	{
+		promises.reserve( size );
+		for ( std::size_t i = 0; i < size; ++i )
+			promises.push_back( i % 10
+				? q::with( static_cast< int >( i ) )
+				: q::reject< q::arguments< int > >( error ) );
+	}
+
+	std::size_t completed = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( auto& promises : inputs )
+	{
+		if ( settled )
+			q::all_settled( std::move( promises ) )
+			.then( [ &completed ]( std::vector< q::expect< int > >&& )
+			{
+				++completed;
+			}, queue );
+		else
+			q::all( std::move( promises ) )
+			.fail( [ &completed ]( std::exception_ptr&& )
+			{
+				++completed;
+			}, queue );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << ( settled ? "all_settled( ), " : "all( ), " )
+		<< size << " promises, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / rounds << " allocs/round";
+	if ( completed != rounds )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), rounds, seconds );
+}
+
+/**
+ * Races @c size pending promises, @c rounds times, and then resolves them
+ * all. Only the winner should reach a queue.
+ */
+void run_race( std::size_t size, std::size_t rounds )
+{
+	typedef q::detail::defer< int > defer_type;
+
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	q::set_default_queue( queue );
+
+	std::size_t completed = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t r = 0; r < rounds; ++r )
+	{
+		std::vector< defer_type::pointer_type > deferreds;
+		std::vector< q::promise< std::tuple< int > > > promises;
+		deferreds.reserve( size );
+		promises.reserve( size );
+		for ( std::size_t i = 0; i < size; ++i )
+		{
+			deferreds.push_back( defer_type::construct( ) );
+			promises.push_back( deferreds.back( )->get_promise( ) );
+		}
+
+		q::race( std::move( promises ) )
+		.then( [ &completed ]( int winner )
+		{
+			if ( winner == 0 )
+				++completed;
+		}, queue );
+
+		for ( std::size_t i = 0; i < size; ++i )
+			deferreds[ i ]->set_value( static_cast< int >( i ) );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << size << " promises, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / rounds << " allocs/race, "
+		<< double( dispatcher->posted( ) ) / rounds << " tasks/race";
+	if ( completed != rounds )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), rounds, seconds );
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( all, "all( ) of 2, 8 and 32 promises of different types" )
+{
+	run_all( q::make_index_tuple< 2 >::type( ), 100000 );
+	run_all( q::make_index_tuple< 8 >::type( ), 25000 );
+	run_all( q::make_index_tuple< 32 >::type( ), 5000 );
+}
+
+Q_BENCHMARK( all_vector, "all( ) of a std::vector of 100 to 100k promises" )
+{
+	run_all_vector( 100, 1000 );
+	run_all_vector( 10000, 10 );
+	run_all_vector( 100000, 1 );
+}
+
+Q_BENCHMARK( all_settled, "all( ) vs all_settled( ) of 10 and 1000 promises, 10% rejected" )
+{
+	run_partial_failure( 10, 2000, false );
+	run_partial_failure( 10, 2000, true );
+	run_partial_failure( 1000, 200, false );
+	run_partial_failure( 1000, 200, true );
+}
+
+Q_BENCHMARK( race, "race( ) of 8 and 1000 pending promises" )
+{
+	run_race( 8, 20000 );
+	run_race( 1000, 200 );
+}
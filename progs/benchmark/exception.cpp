@@ -0,0 +1,164 @@
+
+#include "benchmark.hpp"
+
+#include <q/exception.hpp>
+#include <q/stacktrace.hpp>
+
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+
+namespace {
+
+Q_MAKE_SIMPLE_EXCEPTION( benchmark_exception );
+
+const char* capture_name( q::stacktrace_capture capture )
+{
+	switch ( capture )
+	{
+		case q::stacktrace_capture::off: return "off";
+		case q::stacktrace_capture::addresses: return "addresses";
+		case q::stacktrace_capture::full: return "full";
+	}
+	return "";
+}
+
+/**
+ * Constructs @c count q exceptions with stack traces captured as
+ * @c capture.
+ */
+void run_construct( std::size_t count, q::stacktrace_capture capture )
+{
+	auto previous = q::get_stacktrace_capture( );
+	q::set_stacktrace_capture( capture );
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t i = 0; i < count; ++i )
+		benchmark_exception( );
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	q::set_stacktrace_capture( previous );
+
+	std::stringstream ss;
+	ss << "capture " << capture_name( capture ) << ", "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / count << " allocs/exception";
+
+	benchmark::report( ss.str( ), count, seconds );
+}
+
+/**
+ * Throws and catches @c count q exceptions carrying a string, with stack
+ * traces captured as @c capture.
+ */
+void run_throw( std::size_t count, q::stacktrace_capture capture )
+{
+	auto previous = q::get_stacktrace_capture( );
+	q::set_stacktrace_capture( capture );
+
+	std::size_t caught = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t i = 0; i < count; ++i )
+	{
+		try
+		{
+			benchmark_exception e;
+			e << std::string( "context" );
+			throw std::move( e );
+		}
+		catch ( const benchmark_exception& e )
+		{
+			if ( e.get_info< std::string >( ) )
+				++caught;
+		}
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	q::set_stacktrace_capture( previous );
+
+	std::stringstream ss;
+	ss << "capture " << capture_name( capture ) << ", "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / count << " allocs/throw";
+	if ( caught != count )
+		ss << " (UNCAUGHT!)";
+
+	benchmark::report( ss.str( ), count, seconds );
+}
+
+/**
+ * Discards all output.
+ */
+class null_buffer
+: public std::streambuf
+{
+protected:
+	int_type overflow( int_type c ) override
+	{
+		return c;
+	}
+};
+
+/**
+ * Constructs @c count q exceptions at the same place, i.e. with the same
+ * return addresses, and prints their stack traces.
+ */
+void run_print( std::size_t count )
+{
+	null_buffer buffer;
+	std::ostream os( &buffer );
+
+	std::size_t print_allocations = 0;
+
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t i = 0; i < count; ++i )
+	{
+		benchmark_exception e;
+
+		const auto allocations_before = benchmark::allocations( );
+
+		os << e.get_info< q::stacktrace >( )->get( );
+
+		print_allocations += benchmark::allocations( ) - allocations_before;
+	}
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	ss << "construct and print, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( print_allocations ) / count << " allocs/print";
+
+	benchmark::report( ss.str( ), count, seconds );
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( exception_construct, "constructing q exceptions with stack traces" )
+{
+	run_construct( 100000, q::stacktrace_capture::off );
+	run_construct( 100000, q::stacktrace_capture::addresses );
+	run_construct( 10000, q::stacktrace_capture::full );
+}
+
+Q_BENCHMARK( exception_throw, "throwing and catching q exceptions" )
+{
+	run_throw( 100000, q::stacktrace_capture::off );
+	run_throw( 100000, q::stacktrace_capture::addresses );
+}
+
+Q_BENCHMARK( exception_print, "printing stack traces of the same place" )
+{
+	run_print( 10000 );
+}
@@ -0,0 +1,71 @@
+
+#include "benchmark.hpp"
+
+#include <cstring>
+
+namespace benchmark {
+
+std::vector< entry >& registry( )
+{
+	static std::vector< entry > entries;
+	return entries;
+}
+
+namespace {
+
+bool any_failed = false;
+
+} // anonymous namespace
+
+void fail( )
+{
+	any_failed = true;
+}
+
+bool failed( )
+{
+	return any_failed;
+}
+
+} // namespace benchmark
+
+int main( int argc, char** argv )
+{
+	auto& entries = benchmark::registry( );
+
+	if ( argc > 1 && !std::strcmp( argv[ 1 ], "--list" ) )
+	{
+		for ( auto& entry : entries )
+			std::cout
+				<< std::setw( 20 ) << std::left << entry.name
+				<< entry.description << std::endl;
+		return 0;
+	}
+
+	bool found = false;
+
+	for ( auto& entry : entries )
+	{
+		bool selected = argc < 2;
+		for ( int i = 1; i < argc; ++i )
+			if ( !std::strcmp( argv[ i ], entry.name ) )
+				selected = true;
+
+		if ( !selected )
+			continue;
+
+		found = true;
+
+		std::cout << entry.name << ": " << entry.description << std::endl;
+		entry.fn( );
+		std::cout << std::endl;
+	}
+
+	if ( !found )
+	{
+		std::cerr << "No such benchmark, try --list" << std::endl;
+		return 1;
+	}
+
+	return benchmark::failed( ) ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+
+#include "benchmark.hpp"
+
+#include <q/promise.hpp>
+#include <q/channel.hpp>
+#include <q/scheduler.hpp>
+#include <q/memory.hpp>
+
+#include <atomic>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+/**
+ * Builds @c chains promise chains of @c stages then( ) stages each, and runs
+ * them to completion on a manually drained dispatcher.
+ */
+void run_chains( std::size_t chains,
+                 std::size_t stages,
+                 std::size_t inline_depth = 0 )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+	auto queue = q::make_shared< q::queue >( );
+	// Fused stages wouldn't be scheduled, nor run inline, at all
+	queue->set_fusion( false );
+	queue->set_inline_depth( inline_depth );
+	sched->add_queue( queue );
+
+	std::size_t completed = 0;
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t c = 0; c < chains; ++c )
+	{
+		auto promise = q::with( std::size_t( 0 ) );
+
+		for ( std::size_t s = 0; s < stages; ++s )
+			promise = promise.then( [ ]( std::size_t i )
+			{
+				return i + 1;
+			}, queue );
+
+		promise.then( [ &completed ]( std::size_t )
+		{
+			++completed;
+		}, queue );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	std::stringstream ss;
+	ss << stages << " stages, "
+		<< std::fixed << std::setprecision( 1 )
+		<< double( allocations ) / chains << " allocs/chain";
+	if ( inline_depth )
+		ss << ", inline";
+	if ( completed != chains )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), chains * stages, seconds );
+}
+
+/**
+ * Runs @c chains chains of @c stages stages each on one queue, scheduled one
+ * task per activation, so that the number of activations is the number of
+ * queue hops.
+ */
+void run_hops( std::size_t chains, std::size_t stages, bool fusion )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >(
+		dispatcher, q::scheduler::budget( 1, { } ) );
+	auto queue = q::make_shared< q::queue >( );
+	queue->set_fusion( fusion );
+	sched->add_queue( queue );
+
+	std::size_t completed = 0;
+
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t c = 0; c < chains; ++c )
+	{
+		auto promise = q::with( std::size_t( 0 ) );
+
+		for ( std::size_t s = 0; s < stages; ++s )
+			promise = promise.then( [ ]( std::size_t i )
+			{
+				return i + 1;
+			}, queue );
+
+		promise.then( [ &completed, stages ]( std::size_t i )
+		{
+			if ( i == stages )
+				++completed;
+		}, queue );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	ss << stages << " stages, " << ( fusion ? "fused, " : "" )
+		<< std::fixed << std::setprecision( 1 )
+		<< double( dispatcher->posted( ) ) / chains << " hops/chain";
+	if ( completed != chains )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), chains * stages, seconds );
+}
+
+/**
+ * Runs @c chains cancellable chains of @c stages stages each, optionally
+ * cancelling them before their heads are resolved. Cancelled stages should
+ * neither run nor be scheduled.
+ */
+void run_cancel( std::size_t chains, std::size_t stages, bool cancel )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >(
+		dispatcher, q::scheduler::budget( 1, { } ) );
+	auto queue = q::make_shared< q::queue >( );
+	sched->add_queue( queue );
+
+	std::size_t completed = 0;
+	std::size_t runs = 0;
+
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t c = 0; c < chains; ++c )
+	{
+		q::cancellation_source source;
+		auto deferred = q::detail::defer< std::size_t >::construct( );
+		auto promise = deferred->get_promise( )
+			.with_cancellation( source.token( ) );
+
+		for ( std::size_t s = 0; s < stages; ++s )
+			promise = promise.then( [ &runs ]( std::size_t i )
+			{
+				++runs;
+				return i + 1;
+			}, queue );
+
+		promise
+		.then( [ &completed ]( std::size_t )
+		{
+			++completed;
+		}, queue )
+		.fail( [ &completed ]( std::exception_ptr )
+		{
+			++completed;
+		}, queue );
+
+		if ( cancel )
+			source.cancel( );
+		deferred->set_value( 0 );
+
+		dispatcher->drain( );
+	}
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	ss << stages << " stages, " << ( cancel ? "cancelled, " : "" )
+		<< std::fixed << std::setprecision( 1 )
+		<< double( runs ) / chains << " runs/chain, "
+		<< double( dispatcher->posted( ) ) / chains << " hops/chain";
+	if ( completed != chains )
+		ss << " (INCOMPLETE!)";
+
+	benchmark::report( ss.str( ), chains * stages, seconds );
+}
+
+/**
+ * Lets @c threads threads register @c per_thread then( ) continuations each on
+ * a shared_promise, while the main thread resolves it. Every continuation
+ * must be scheduled exactly once, whether it was registered before or after
+ * the resolution.
+ */
+void run_race( std::size_t threads, std::size_t rounds, std::size_t per_thread )
+{
+	typedef q::shared_promise< std::tuple< int > > promise_type;
+
+	std::atomic< std::size_t > round( 0 );
+	std::atomic< std::size_t > finished( 0 );
+	std::atomic< std::size_t > scheduled( 0 );
+
+	// Replaced by the main thread between rounds only
+	const promise_type* current = nullptr;
+	q::queue_ptr queue;
+
+	auto registrar = [ & ]( )
+	{
+		for ( std::size_t r = 1; r <= rounds; ++r )
+		{
+			while ( round.load( std::memory_order_acquire ) < r )
+				std::this_thread::yield( );
+
+			auto promise = *current;
+
+			for ( std::size_t i = 0; i < per_thread; ++i )
+				promise.then( [ ]( int ) { }, queue );
+
+			finished.fetch_add( 1, std::memory_order_acq_rel );
+		}
+	};
+
+	benchmark::stopwatch stopwatch;
+
+	std::vector< std::thread > registrars;
+	for ( std::size_t t = 0; t < threads; ++t )
+		registrars.emplace_back( registrar );
+
+	for ( std::size_t r = 1; r <= rounds; ++r )
+	{
+		q::channel< int > channel;
+		auto promise = channel.receive( ).share( );
+
+		queue = q::make_shared< q::queue >( );
+		queue->set_consumer( [ &scheduled ]( std::size_t )
+		{
+			scheduled.fetch_add( 1, std::memory_order_relaxed );
+		} );
+
+		current = &promise;
+		finished.store( 0, std::memory_order_relaxed );
+		round.store( r, std::memory_order_release );
+
+		channel.send( static_cast< int >( r ) );
+
+		while ( finished.load( std::memory_order_acquire ) < threads )
+			std::this_thread::yield( );
+	}
+
+	for ( auto& thread : registrars )
+		thread.join( );
+
+	auto seconds = stopwatch.seconds( );
+
+	const auto registrations = threads * rounds * per_thread;
+
+	std::stringstream ss;
+	ss << threads << " threads";
+	if ( scheduled.load( ) != registrations )
+		ss << " (LOST CONTINUATIONS!)";
+
+	benchmark::report( ss.str( ), registrations, seconds );
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( then_chain, "allocations and time of then( ) chains" )
+{
+	run_chains( 20000, 1 );
+	run_chains( 20000, 10 );
+}
+
+Q_BENCHMARK( then_inline, "then( ) chains with and without inline execution" )
+{
+	run_chains( 20000, 10 );
+	run_chains( 20000, 10, 64 );
+}
+
+Q_BENCHMARK( then_fusion, "queue hops of then( ) chains with and without fusion" )
+{
+	run_hops( 20000, 10, false );
+	run_hops( 20000, 10, true );
+}
+
+Q_BENCHMARK( then_cancel, "then( ) chains with and without cancellation" )
+{
+	run_cancel( 20000, 10, false );
+	run_cancel( 20000, 10, true );
+}
+
+Q_BENCHMARK( then_race, "then( ) on a shared_promise racing its resolution" )
+{
+	run_race( 16, 2000, 8 );
+}
@@ -0,0 +1,254 @@
+
+#include "benchmark.hpp"
+
+#include <q/types.hpp>
+#include <q/mutex.hpp>
+#include <q/detail/segment_queue.hpp>
+
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <sstream>
+
+namespace {
+
+/**
+ * The original implementation of q::queue: a std::queue guarded by a mutex,
+ * where the notifyer is copied under the lock for every push.
+ */
+class mutex_queue
+{
+public:
+	typedef std::function< void( std::size_t ) > notify_type;
+
+	mutex_queue( )
+	: mutex_( Q_HERE, "mutex_queue" )
+	, notify_( [ ]( std::size_t ) { } )
+	{ }
+
+	void push( q::task&& task )
+	{
+		notify_type notifyer;
+		std::size_t size;
+
+		{
+			Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+			queue_.push( std::move( task ) );
+
+			notifyer = notify_;
+			size = queue_.size( );
+		}
+
+		notifyer( size );
+	}
+
+	bool pop( q::task& task )
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+		if ( queue_.empty( ) )
+			return false;
+
+		task = std::move( queue_.front( ) );
+		queue_.pop( );
+
+		return true;
+	}
+
+private:
+	q::mutex mutex_;
+	notify_type notify_;
+	std::queue< q::task > queue_;
+};
+
+/**
+ * The default backing store of q::queue, a std::queue guarded by a mutex.
+ */
+class locked_store
+{
+public:
+	locked_store( )
+	: mutex_( Q_HERE, "locked_store" )
+	{ }
+
+	void push( q::task&& task )
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+		queue_.push( std::move( task ) );
+	}
+
+	bool pop( q::task& task )
+	{
+		Q_AUTO_UNIQUE_LOCK( mutex_ );
+
+		if ( queue_.empty( ) )
+			return false;
+
+		task = std::move( queue_.front( ) );
+		queue_.pop( );
+
+		return true;
+	}
+
+private:
+	q::mutex mutex_;
+	std::queue< q::task > queue_;
+};
+
+/**
+ * q::queue as it is now, where the notifyer isn't copied under a lock, with
+ * the default mutex guarded store or the lock-free store of
+ * LIBQ_LOCKFREE_QUEUE.
+ */
+template< typename Store >
+class notifying_queue
+{
+public:
+	typedef std::function< void( std::size_t ) > notify_type;
+
+	notifying_queue( )
+	: size_( 0 )
+	, notify_( [ ]( std::size_t ) { } )
+	{ }
+
+	void push( q::task&& task )
+	{
+		queue_.push( std::move( task ) );
+		auto size = size_.fetch_add( 1, std::memory_order_acq_rel ) + 1;
+		notify_( size );
+	}
+
+	bool pop( q::task& task )
+	{
+		if ( !queue_.pop( task ) )
+			return false;
+		size_.fetch_sub( 1, std::memory_order_acq_rel );
+		return true;
+	}
+
+private:
+	std::atomic< std::size_t > size_;
+	notify_type notify_;
+	Store queue_;
+};
+
+typedef notifying_queue< locked_store > locked_queue;
+typedef notifying_queue< q::detail::segment_queue< q::task > > lockfree_queue;
+
+/**
+ * Runs @c producers threads which each push @c per_producer tasks, while
+ * @c consumers threads pop and run them. With a single consumer, the
+ * per-producer FIFO order is verified.
+ */
+template< typename Queue >
+double run( std::size_t producers,
+            std::size_t consumers,
+            std::size_t per_producer,
+            bool& in_order )
+{
+	Queue queue;
+
+	std::atomic< bool > go( false );
+	std::atomic< std::size_t > consumed( 0 );
+	std::vector< std::size_t > last_seen( producers, 0 );
+	std::atomic< bool > ordered( true );
+
+	const std::size_t total = producers * per_producer;
+
+	std::vector< std::thread > threads;
+
+	for ( std::size_t p = 0; p < producers; ++p )
+		threads.emplace_back( [ &, p ]( )
+		{
+			while ( !go.load( std::memory_order_acquire ) )
+				;
+
+			for ( std::size_t i = 1; i <= per_producer; ++i )
+				queue.push( [ &, p, i ]( )
+				{
+					if ( consumers == 1 )
+					{
+						if ( last_seen[ p ] + 1 != i )
+							ordered.store( false );
+						last_seen[ p ] = i;
+					}
+				} );
+		} );
+
+	for ( std::size_t c = 0; c < consumers; ++c )
+		threads.emplace_back( [ & ]( )
+		{
+			while ( !go.load( std::memory_order_acquire ) )
+				;
+
+			q::task task;
+
+			while ( consumed.load( std::memory_order_relaxed ) < total )
+			{
+				if ( queue.pop( task ) )
+				{
+					task( );
+					consumed.fetch_add( 1, std::memory_order_relaxed );
+				}
+			}
+		} );
+
+	benchmark::stopwatch stopwatch;
+	go.store( true, std::memory_order_release );
+
+	for ( auto& thread : threads )
+		thread.join( );
+
+	auto seconds = stopwatch.seconds( );
+
+	in_order = ordered.load( );
+
+	return seconds;
+}
+
+template< typename Queue >
+void run_and_report( const char* name,
+                     std::size_t producers,
+                     std::size_t consumers,
+                     std::size_t per_producer )
+{
+	bool in_order;
+	auto seconds = run< Queue >( producers, consumers, per_producer, in_order );
+
+	std::stringstream ss;
+	ss << name << " " << producers << "p/" << consumers << "c";
+	if ( !in_order )
+		ss << " (OUT OF ORDER!)";
+
+	benchmark::report( ss.str( ), producers * per_producer, seconds );
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( queue, "q::queue contention, mutex vs lock-free backing store" )
+{
+	const std::size_t per_producer = 200000;
+
+	std::size_t cores = std::thread::hardware_concurrency( );
+	if ( cores < 2 )
+		cores = 2;
+
+	const std::pair< std::size_t, std::size_t > configurations[ ] = {
+		{ 1, 1 },
+		{ 4, 1 },
+		{ cores, 1 },
+		{ cores / 2, cores / 2 },
+		{ cores, cores }
+	};
+
+	for ( auto& config : configurations )
+	{
+		run_and_report< mutex_queue >(
+			"mutex", config.first, config.second, per_producer );
+		run_and_report< locked_queue >(
+			"locked", config.first, config.second, per_producer );
+		run_and_report< lockfree_queue >(
+			"lock-free", config.first, config.second, per_producer );
+	}
+}
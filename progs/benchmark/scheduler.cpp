@@ -0,0 +1,217 @@
+
+#include "benchmark.hpp"
+
+#include <q/scheduler.hpp>
+#include <q/memory.hpp>
+
+#include <vector>
+#include <sstream>
+
+namespace {
+
+void run( const char* name, q::scheduler::budget budget, std::size_t tasks )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher, budget );
+	auto queue = q::make_shared< q::queue >( );
+
+	std::size_t counter = 0;
+
+	// Half of the tasks are queued up before the queue gets a consumer
+	for ( std::size_t i = 0; i < tasks / 2; ++i )
+		queue->push( [ &counter ]( ) { ++counter; } );
+
+	benchmark::stopwatch stopwatch;
+
+	sched->add_queue( queue );
+
+	for ( std::size_t i = tasks / 2; i < tasks; ++i )
+		queue->push( [ &counter ]( ) { ++counter; } );
+
+	dispatcher->drain( );
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	ss << name << ", " << dispatcher->posted( ) << " activations";
+	if ( counter != tasks )
+		ss << " (LOST TASKS!)";
+
+	benchmark::report( ss.str( ), tasks, seconds );
+}
+
+/**
+ * Spreads @c tasks tasks evenly over @c num_queues queues, mostly idle, and
+ * dispatches them through one scheduler.
+ */
+void run_queues( std::size_t num_queues, std::size_t tasks )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >( dispatcher );
+
+	std::vector< q::queue_ptr > queues;
+	for ( std::size_t i = 0; i < num_queues; ++i )
+	{
+		queues.push_back( q::make_shared< q::queue >( ) );
+		sched->add_queue( queues.back( ) );
+	}
+
+	std::size_t counter = 0;
+
+	benchmark::stopwatch stopwatch;
+
+	// Few queues are non-empty at any time
+	for ( std::size_t i = 0; i < tasks; ++i )
+	{
+		queues[ ( i * 7919 ) % num_queues ]->push(
+			[ &counter ]( ) { ++counter; } );
+
+		if ( i % 16 == 15 )
+			dispatcher->drain( );
+	}
+
+	dispatcher->drain( );
+
+	auto seconds = stopwatch.seconds( );
+
+	std::stringstream ss;
+	ss << num_queues << " queues";
+	if ( counter != tasks )
+		ss << " (LOST TASKS!)";
+
+	benchmark::report( ss.str( ), tasks, seconds );
+}
+
+/**
+ * A task which keeps the CPU busy for a while, and then re-queues itself
+ * until stopped, so that its queue never runs dry.
+ */
+struct spinner
+{
+	q::queue_ptr queue;
+	std::chrono::microseconds work;
+	std::chrono::microseconds* spent;
+	const bool* stop;
+
+	void operator( )( ) const
+	{
+		auto until = std::chrono::steady_clock::now( ) + work;
+		while ( std::chrono::steady_clock::now( ) < until )
+			;
+
+		*spent += work;
+
+		if ( !*stop )
+			queue->push( spinner( *this ) );
+	}
+};
+
+struct fairness_queue
+{
+	const char* name;
+	std::chrono::microseconds work;
+	std::size_t weight;
+	double quota;
+};
+
+void run_fairness( const char* name,
+                   q::scheduler::policy policy,
+                   std::vector< fairness_queue > configs )
+{
+	auto dispatcher = std::make_shared< benchmark::manual_dispatcher >( );
+	auto sched = q::make_shared< q::scheduler >(
+		dispatcher, q::scheduler::budget( ), policy );
+
+	bool stop = false;
+
+	std::vector< q::queue_ptr > queues;
+	std::vector< std::chrono::microseconds > spent(
+		configs.size( ), std::chrono::microseconds( 0 ) );
+
+	for ( auto& config : configs )
+	{
+		auto queue = q::make_shared< q::queue >( );
+		queue->set_weight( config.weight );
+		queue->set_cpu_quota( config.quota );
+		sched->add_queue( queue );
+
+		for ( std::size_t i = 0; i < 4; ++i )
+			queue->push( spinner{
+				queue, config.work, &spent[ queues.size( ) ], &stop } );
+
+		queues.push_back( queue );
+	}
+
+	benchmark::stopwatch stopwatch;
+
+	while ( dispatcher->run_one( ) )
+		if ( !stop && stopwatch.seconds( ) > 1 )
+			stop = true;
+
+	std::chrono::microseconds total( 0 );
+	for ( auto& time : spent )
+		total += time;
+
+	// The measured CPU time (only measured by fair share schedulers) is
+	// printed in ms next to the share.
+	std::cout << "  " << std::setw( 34 ) << std::left << name << std::right;
+	for ( std::size_t i = 0; i < queues.size( ); ++i )
+	{
+		auto share = total.count( )
+			? 100.0 * spent[ i ].count( ) / total.count( )
+			: 0.0;
+
+		auto measured = std::chrono::duration_cast<
+			std::chrono::milliseconds >( queues[ i ]->consumed_time( ) );
+
+		std::cout
+			<< "  " << configs[ i ].name << " "
+			<< std::fixed << std::setprecision( 1 ) << share << "% ("
+			<< measured.count( ) << " ms)";
+	}
+	std::cout << std::endl;
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( scheduler, "scheduler dispatch overhead per task, by budget" )
+{
+	const std::size_t tasks = 1000000;
+
+	run( "1 task per activation", q::scheduler::budget( 1, { } ), tasks );
+	run( "default budget", q::scheduler::budget( ), tasks );
+	run( "unlimited", q::scheduler::budget( 0, { } ), tasks );
+}
+
+Q_BENCHMARK( scheduler_queues, "scheduler dispatch with many mostly idle queues" )
+{
+	const std::size_t tasks = 1000000;
+
+	for ( std::size_t num_queues : { 1, 100, 10000 } )
+		run_queues( num_queues, tasks );
+}
+
+Q_BENCHMARK( scheduler_fairness, "CPU share of queues with different task lengths" )
+{
+	typedef std::chrono::microseconds us;
+
+	const auto strict = q::scheduler::policy::strict_priority;
+	const auto fair = q::scheduler::policy::fair_share;
+
+	run_fairness( "strict priority", strict, {
+		{ "long", us( 200 ), 1024, 0 },
+		{ "short", us( 10 ), 1024, 0 }
+	} );
+	run_fairness( "fair share", fair, {
+		{ "long", us( 200 ), 1024, 0 },
+		{ "short", us( 10 ), 1024, 0 }
+	} );
+	run_fairness( "fair share, short weighted 3x", fair, {
+		{ "long", us( 200 ), 1024, 0 },
+		{ "short", us( 10 ), 3 * 1024, 0 }
+	} );
+	run_fairness( "fair share, background quota 10%", fair, {
+		{ "background", us( 200 ), 1024, 0.1 },
+		{ "foreground", us( 10 ), 1024, 0 }
+	} );
+}
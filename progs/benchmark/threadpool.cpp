@@ -0,0 +1,181 @@
+
+#include "benchmark.hpp"
+
+#include <q/promise.hpp>
+#include <q/threadpool.hpp>
+#include <q/scheduler.hpp>
+#include <q/thread.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <sstream>
+
+namespace {
+
+/**
+ * Runs @c chains independent promise chains of @c stages trivial stages each
+ * on a queue scheduled onto a threadpool. Every stage is resolved on a pool
+ * thread, and schedules the next stage from there, which is the pattern the
+ * work-stealing mode is designed for.
+ */
+double run( q::threadpool::scheduling mode,
+            std::size_t threads,
+            std::size_t chains,
+            std::size_t stages )
+{
+	// Thread terminations are signalled on the default queue, which is
+	// never consumed here
+	static auto terminations = q::make_shared< q::queue >( );
+	q::set_default_queue( terminations );
+
+	auto pool = q::threadpool::construct( "benchmark", threads, mode );
+	auto queue = q::make_shared< q::queue >( );
+	auto sched = q::make_shared< q::scheduler >( pool );
+	sched->add_queue( queue );
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic< std::size_t > remaining( chains );
+
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t c = 0; c < chains; ++c )
+	{
+		auto promise = q::with( std::size_t( 0 ) );
+
+		for ( std::size_t s = 0; s < stages; ++s )
+			promise = promise.then( [ ]( std::size_t i )
+			{
+				return i + 1;
+			}, queue );
+
+		promise.then( [ & ]( std::size_t )
+		{
+			if ( remaining.fetch_sub( 1 ) == 1 )
+			{
+				std::unique_lock< std::mutex > lock( mutex );
+				cond.notify_one( );
+			}
+		}, queue );
+	}
+
+	{
+		std::unique_lock< std::mutex > lock( mutex );
+		cond.wait( lock, [ & ]( ) { return remaining.load( ) == 0; } );
+	}
+
+	auto seconds = stopwatch.seconds( );
+
+	pool->terminate( );
+
+	return seconds;
+}
+
+/**
+ * Runs @c chains chains of @c tasks tasks each directly on a threadpool,
+ * every task adding the next one of its chain from the pool thread, which
+ * measures the cost of queueing a single task in each mode.
+ *
+ * @c allocations is set to the number of heap allocations made meanwhile.
+ */
+double run_tasks( q::threadpool::scheduling mode,
+                  std::size_t threads,
+                  std::size_t chains,
+                  std::size_t tasks,
+                  std::size_t& allocations )
+{
+	static auto terminations = q::make_shared< q::queue >( );
+	q::set_default_queue( terminations );
+
+	auto pool = q::threadpool::construct( "benchmark", threads, mode );
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic< std::size_t > remaining( chains );
+
+	struct step
+	{
+		q::threadpool* pool_;
+		std::size_t left_;
+		std::function< void( ) >* done_;
+
+		void operator( )( )
+		{
+			if ( --left_ == 0 )
+				( *done_ )( );
+			else
+				pool_->add_task( step{ pool_, left_, done_ } );
+		}
+	};
+
+	std::function< void( ) > done = [ & ]( )
+	{
+		if ( remaining.fetch_sub( 1 ) == 1 )
+		{
+			std::unique_lock< std::mutex > lock( mutex );
+			cond.notify_one( );
+		}
+	};
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t c = 0; c < chains; ++c )
+		pool->add_task( step{ pool.get( ), tasks, &done } );
+
+	{
+		std::unique_lock< std::mutex > lock( mutex );
+		cond.wait( lock, [ & ]( ) { return remaining.load( ) == 0; } );
+	}
+
+	auto seconds = stopwatch.seconds( );
+	allocations = benchmark::allocations( ) - allocations_before;
+
+	pool->terminate( );
+
+	return seconds;
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( threadpool, "promise chains on a shared queue vs work-stealing pool" )
+{
+	const std::size_t chains = 64;
+	const std::size_t stages = 2000;
+
+	std::size_t threads = q::hard_cores( );
+	if ( threads < 2 )
+		threads = 2;
+
+	const std::pair< q::threadpool::scheduling, const char* > modes[ ] = {
+		{ q::threadpool::scheduling::shared_queue, "shared queue" },
+		{ q::threadpool::scheduling::work_stealing, "work-stealing" }
+	};
+
+	for ( auto& mode : modes )
+	{
+		auto seconds = run( mode.first, threads, chains, stages );
+
+		std::stringstream ss;
+		ss << mode.second << " " << threads << " threads";
+
+		benchmark::report( ss.str( ), chains * stages, seconds );
+	}
+
+	for ( auto& mode : modes )
+	{
+		std::size_t allocations = 0;
+		auto seconds = run_tasks(
+			mode.first, threads, chains, stages * 10, allocations );
+
+		std::stringstream ss;
+		ss << mode.second << " tasks, " << std::fixed
+			<< std::setprecision( 2 )
+			<< double( allocations ) / ( chains * stages * 10 )
+			<< " allocs/task";
+
+		benchmark::report( ss.str( ), chains * stages * 10, seconds );
+	}
+}
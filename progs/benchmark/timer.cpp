@@ -0,0 +1,165 @@
+
+#include "benchmark.hpp"
+
+#include <q/promise.hpp>
+#include <q/timer.hpp>
+#include <q/threadpool.hpp>
+#include <q/scheduler.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+
+namespace {
+
+/**
+ * Arms @c timers timeouts spread over a minute, as for as many concurrent
+ * requests, and cancels them all again. Neither should depend on how many
+ * timers are armed.
+ */
+void run_arm_cancel( std::size_t timers )
+{
+	auto timer = q::timer::construct( "benchmark timer" );
+	auto queue = q::make_shared< q::queue >( );
+
+	std::vector< q::timer::handle > handles;
+	handles.reserve( timers );
+
+	const auto allocations_before = benchmark::allocations( );
+	benchmark::stopwatch arming;
+
+	for ( std::size_t i = 0; i < timers; ++i )
+		handles.push_back( timer->schedule(
+			std::chrono::milliseconds( 1000 + i % 60000 ),
+			[ ]( ) { },
+			queue ) );
+
+	auto arm_seconds = arming.seconds( );
+	const auto allocations = benchmark::allocations( ) - allocations_before;
+
+	benchmark::stopwatch cancelling;
+
+	std::size_t cancelled = 0;
+	for ( auto& handle : handles )
+		cancelled += timer->cancel( handle ) ? 1 : 0;
+
+	auto cancel_seconds = cancelling.seconds( );
+
+	timer->terminate( );
+
+	std::stringstream ss;
+	ss << "arm, " << std::fixed << std::setprecision( 2 )
+		<< double( allocations ) / timers << " allocs/timer";
+	benchmark::report( ss.str( ), timers, arm_seconds );
+
+	ss.str( "" );
+	ss << "cancel";
+	if ( cancelled != timers )
+		ss << " (NOT ARMED!)";
+	benchmark::report( ss.str( ), timers, cancel_seconds );
+}
+
+/**
+ * Lets @c timers timers, spread over @c spread, fire on a threadpool, and
+ * measures how late they run. No timer may be later than a tick plus its
+ * slack, beyond what it takes the pool thread to wake up and run it.
+ */
+void run_fire( std::size_t timers,
+               std::chrono::milliseconds spread,
+               std::chrono::milliseconds slack )
+{
+	typedef std::chrono::steady_clock clock;
+
+	// Thread terminations are signalled on the default queue, which is
+	// never consumed here
+	static auto terminations = q::make_shared< q::queue >( );
+	q::set_default_queue( terminations );
+
+	auto timer = q::timer::construct( "benchmark timer" );
+	auto pool = q::threadpool::construct( "timer", 1 );
+	auto queue = q::make_shared< q::queue >( );
+	auto sched = q::make_shared< q::scheduler >( pool );
+	sched->add_queue( queue );
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::atomic< std::size_t > remaining( timers );
+	std::atomic< std::int64_t > total_late( 0 );
+	std::atomic< std::int64_t > max_late( 0 );
+
+	benchmark::stopwatch stopwatch;
+
+	for ( std::size_t i = 0; i < timers; ++i )
+	{
+		auto delay = spread * i / timers;
+		auto deadline = clock::now( ) + delay;
+
+		timer->schedule( delay, [ &, deadline ]( )
+		{
+			std::int64_t late =
+				std::chrono::duration_cast< std::chrono::microseconds >(
+					clock::now( ) - deadline ).count( );
+
+			total_late += late;
+
+			auto max = max_late.load( );
+			while ( late > max && !max_late.compare_exchange_weak( max, late ) )
+				;
+
+			if ( remaining.fetch_sub( 1 ) == 1 )
+			{
+				std::unique_lock< std::mutex > lock( mutex );
+				cond.notify_one( );
+			}
+		}, queue, slack );
+	}
+
+	{
+		std::unique_lock< std::mutex > lock( mutex );
+		cond.wait( lock, [ & ]( ) { return remaining.load( ) == 0; } );
+	}
+
+	auto seconds = stopwatch.seconds( );
+
+	timer->terminate( );
+	pool->terminate( );
+
+	std::stringstream ss;
+	ss << spread.count( ) << " ms spread, " << slack.count( ) << " ms slack";
+	benchmark::report( ss.str( ), timers, seconds );
+
+	// The default resolution of one tick, plus an allowance for waking up
+	// the timer and pool threads. A missed cascade is a whole rotation of
+	// the lowest level (256 ticks) late.
+	const std::int64_t bound =
+		std::chrono::duration_cast< std::chrono::microseconds >(
+			std::chrono::milliseconds( 1 ) + slack +
+			std::chrono::milliseconds( 50 ) ).count( );
+
+	std::cout
+		<< "    " << std::fixed << std::setprecision( 0 )
+		<< double( total_late.load( ) ) / timers << " us late on average, "
+		<< max_late.load( ) << " us at most";
+	if ( max_late.load( ) > bound )
+	{
+		std::cout << " (TOO LATE!)";
+		benchmark::fail( );
+	}
+	std::cout << std::endl;
+}
+
+} // anonymous namespace
+
+Q_BENCHMARK( timer_arm, "arming and cancelling 1M timeouts on a timing wheel" )
+{
+	run_arm_cancel( 1000000 );
+}
+
+Q_BENCHMARK( timer_fire, "lateness of firing timers, with and without slack" )
+{
+	run_fire( 10000, std::chrono::milliseconds( 500 ),
+	          std::chrono::milliseconds( 0 ) );
+	run_fire( 10000, std::chrono::milliseconds( 500 ),
+	          std::chrono::milliseconds( 8 ) );
+}
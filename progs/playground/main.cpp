@@ -410,18 +410,24 @@ int main( int argc, char** argv )
 	/* */
 
 	auto bg_prom = q::with( 5 )
-	.then( [ ]( int i ) -> int
+	.then( [ ]( int i )
 	{
-		usleep( 100 * 1000 );
-		std::cout << "background thread got " << i << std::endl;
-		usleep( 100 * 1000 );
-		return i * 2;
+		return q::delay(
+			std::chrono::milliseconds( 100 ), q::background_queue( ) )
+		.then( [ i ]( ) -> int
+		{
+			std::cout << "background thread got " << i << std::endl;
+			return i * 2;
+		}, q::background_queue( ) );
 	}, q::background_queue( ) )
 	.then( [ ]( int i )
 	{
-		usleep( 100 * 1000 );
-		std::cout << "background thread got " << i << std::endl;
-		usleep( 100 * 1000 );
+		return q::delay(
+			std::chrono::milliseconds( 100 ), q::background_queue( ) )
+		.then( [ i ]( )
+		{
+			std::cout << "background thread got " << i << std::endl;
+		}, q::background_queue( ) );
 	}, q::background_queue( ) );
 
 	auto shared_prom = prom.share( );